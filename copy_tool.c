@@ -1,19 +1,71 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h> // for FICLONE
 #include <fcntl.h> // for open flags
+#include <linux/falloc.h> // for FALLOC_FL_PUNCH_HOLE
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h> // Note - liburing isn't installed everywhere, the few syscalls we need are simple
+#include <immintrin.h>
 
 #define IN
 #define OUT
 
+#define DEFAULT_CHUNK_SIZE_MB (64)
+#define WORKER_BUFFER_SIZE (1024 * 1024)
+#define PROGRESS_POLL_MS (100)
+#define PROGRESS_INTERVAL_SECONDS (1.0)
+#define BYTES_IN_MB (1024 * 1024)
+#define MIN_WINDOW_SIZE_MB (64)
+#define MAX_WINDOW_SIZE_MB (1024)
+#define WINDOWS_PER_FILE (16)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Below this size the destination likely stays in the cache anyway so memcpy is better than streaming around it
+#define NON_TEMPORAL_THRESHOLD (256 * 1024)
+// Zero block detection (-z) works in blocks of this size, which also is the smallest hole it can leave
+#define ZERO_BLOCK_SIZE (64 * 1024)
+#define JOURNAL_SUFFIX ".copy_journal"
+#define JOURNAL_MAGIC (0x4c4e524a59504f43ULL) // "COPYJRNL"
+#define XXH_PRIME64_1 (0x9E3779B185EBCA87ULL)
+#define XXH_PRIME64_2 (0xC2B2AE3D27D4EB4FULL)
+#define XXH_PRIME64_3 (0x165667B19E3779F9ULL)
+#define XXH_PRIME64_4 (0x85EBCA77C2B2AE63ULL)
+#define XXH_PRIME64_5 (0x27D4EB2F165667C5ULL)
+// The tree copy (-r) copies smaller files right in the worker that lists their directory
+#define LARGE_FILE_SIZE (8 * 1024 * 1024)
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+#define TREE_WORKERS_PER_CPU (4)
+#define DEFAULT_IO_URING_DEPTH (32)
+#define IO_URING_BLOCK_SIZE (1024 * 1024)
+#define DIRECT_IO_ALIGNMENT (4096)
+#define BENCHMARK_MIN_SIZE (4 * 1024)
+#define BENCHMARK_MAX_SIZE (1024 * 1024 * 1024)
+#define BENCHMARK_BYTES_PER_SIZE (2LL * 1024 * 1024 * 1024)
+
 char* g_error_string = NULL;
+bool g_use_huge_pages = false;
+bool g_skip_zero_blocks = false;
+off_t g_skipped_bytes = 0;
+bool g_quiet = false;
+int g_io_uring_depth = DEFAULT_IO_URING_DEPTH;
+bool g_use_direct_io = false;
 
 #define VERIFY_NOT_AND_CLEANUP(to_verify)		\
 	if ((to_verify)) {							\
@@ -34,36 +86,161 @@ bool does_file_exist(IN const char* filePath) {
 	return (0 == result);
 }
 
-void copy_block(IN char* src, IN OUT char* dst, IN size_t size) {
+void copy_block_bytes(IN char* src, IN OUT char* dst, IN size_t size) {
 	for (size_t i = 0; i < size; i++) {
 		dst[i] = src[i];
 	}
 }
 
-bool copy_part(IN int src, IN int dst, IN off_t data_to_copy, IN off_t offset_in_file) {
-	bool result = false;
-	void* src_memory = MAP_FAILED;
-	void* dst_memory = MAP_FAILED;
+void copy_block_memcpy(IN char* src, IN OUT char* dst, IN size_t size) {
+	memcpy(dst, src, size);
+}
 
-	src_memory = mmap(NULL, data_to_copy, PROT_READ | PROT_WRITE, MAP_PRIVATE, src, offset_in_file);
-	VERIFY_NOT_AND_CLEANUP(MAP_FAILED == src_memory);
+// The streaming kernels write whole aligned vectors around the cache (the copied data isn't read again), memcpy copies
+// the unaligned head and the tail
+__attribute__((target("avx2")))
+void copy_block_avx2(IN char* src, IN OUT char* dst, IN size_t size) {
+	if (size < NON_TEMPORAL_THRESHOLD) {
+		memcpy(dst, src, size);
+		return;
+	}
 
-	dst_memory = mmap(NULL, data_to_copy, PROT_READ | PROT_WRITE, MAP_SHARED, dst, offset_in_file);
-	VERIFY_NOT_AND_CLEANUP(MAP_FAILED == dst_memory)
+	size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+	memcpy(dst, src, head);
+	src += head;
+	dst += head;
+	size -= head;
 
-	copy_block(src_memory, dst_memory, data_to_copy);
-	result = true;
+	for (; size >= 128; size -= 128, src += 128, dst += 128) {
+		__m256i a = _mm256_loadu_si256((__m256i*)src);
+		__m256i b = _mm256_loadu_si256((__m256i*)(src + 32));
+		__m256i c = _mm256_loadu_si256((__m256i*)(src + 64));
+		__m256i d = _mm256_loadu_si256((__m256i*)(src + 96));
+		_mm256_stream_si256((__m256i*)dst, a);
+		_mm256_stream_si256((__m256i*)(dst + 32), b);
+		_mm256_stream_si256((__m256i*)(dst + 64), c);
+		_mm256_stream_si256((__m256i*)(dst + 96), d);
+	}
 
-cleanup:
-	if (MAP_FAILED != src_memory) {
-		munmap(src_memory, data_to_copy);
+	// Note - Streaming stores are weakly ordered so they are fenced before anyone else sees the data
+	_mm_sfence();
+	memcpy(dst, src, size);
+}
+
+__attribute__((target("avx512f")))
+void copy_block_avx512(IN char* src, IN OUT char* dst, IN size_t size) {
+	if (size < NON_TEMPORAL_THRESHOLD) {
+		memcpy(dst, src, size);
+		return;
 	}
 
-	if (MAP_FAILED != dst_memory) {
-		munmap(dst_memory, data_to_copy);
+	size_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+	memcpy(dst, src, head);
+	src += head;
+	dst += head;
+	size -= head;
+
+	for (; size >= 256; size -= 256, src += 256, dst += 256) {
+		__m512i a = _mm512_loadu_si512(src);
+		__m512i b = _mm512_loadu_si512(src + 64);
+		__m512i c = _mm512_loadu_si512(src + 128);
+		__m512i d = _mm512_loadu_si512(src + 192);
+		_mm512_stream_si512((__m512i*)dst, a);
+		_mm512_stream_si512((__m512i*)(dst + 64), b);
+		_mm512_stream_si512((__m512i*)(dst + 128), c);
+		_mm512_stream_si512((__m512i*)(dst + 192), d);
+	}
+
+	_mm_sfence();
+	memcpy(dst, src, size);
+}
+
+bool is_zero_block_generic(IN const char* block, IN size_t size) {
+	const uint64_t* words = (const uint64_t*)block;
+	uint64_t accumulated = 0;
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		accumulated |= words[i];
+	}
+	for (size_t i = size & ~(sizeof(uint64_t) - 1); i < size; i++) {
+		accumulated |= (uint8_t)block[i];
+	}
+	return (0 == accumulated);
+}
+
+// Note - ORs a whole 128 byte line before testing it, real data usually stops the check in its first line
+__attribute__((target("avx2")))
+bool is_zero_block_avx2(IN const char* block, IN size_t size) {
+	size_t i = 0;
+	for (; i + 128 <= size; i += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(block + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(block + i + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(block + i + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(block + i + 96));
+		__m256i accumulated = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+		if (!_mm256_testz_si256(accumulated, accumulated)) {
+			return false;
+		}
+	}
+	return is_zero_block_generic(block + i, size - i);
+}
+
+typedef void (*CopyBlockFunction)(IN char* src, IN OUT char* dst, IN size_t size);
+typedef bool (*IsZeroBlockFunction)(IN const char* block, IN size_t size);
+
+// Chosen by the CPU at startup (select_simd_kernels)
+CopyBlockFunction copy_block = copy_block_memcpy;
+IsZeroBlockFunction is_zero_block = is_zero_block_generic;
+const char* g_copy_block_name = "memcpy";
+
+void select_simd_kernels() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		copy_block = copy_block_avx512;
+		g_copy_block_name = "avx512";
+	}
+	else if (__builtin_cpu_supports("avx2")) {
+		copy_block = copy_block_avx2;
+		g_copy_block_name = "avx2";
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		is_zero_block = is_zero_block_avx2;
+	}
+}
+
+// Finds the next run of blocks from *run_start that aren't all zeros (without -z the whole rest is one run), the zero
+// blocks before it are left as holes
+bool next_data_run(IN const char* buffer, IN size_t size, IN OUT size_t* run_start, OUT size_t* run_size) {
+	size_t offset = *run_start;
+
+	if (!g_skip_zero_blocks) {
+		*run_size = size - offset;
+		return (*run_size > 0);
+	}
+
+	while (offset < size && is_zero_block(buffer + offset, min(size - offset, ZERO_BLOCK_SIZE))) {
+		__atomic_fetch_add(&g_skipped_bytes, min(size - offset, ZERO_BLOCK_SIZE), __ATOMIC_RELAXED);
+		offset += min(size - offset, ZERO_BLOCK_SIZE);
+	}
+
+	*run_start = offset;
+	while (offset < size && !is_zero_block(buffer + offset, min(size - offset, ZERO_BLOCK_SIZE))) {
+		offset += min(size - offset, ZERO_BLOCK_SIZE);
 	}
 
-	return result;
+	*run_size = offset - *run_start;
+	return (*run_size > 0);
+}
+
+// The source is mapped one window ahead so the kernel reads the next window while we copy the current one
+void* map_source_window(IN int src, IN off_t window_size, IN off_t offset, IN int advice) {
+	void* memory = mmap(NULL, window_size, PROT_READ, MAP_SHARED, src, offset);
+	if (MAP_FAILED != memory) {
+		// Note - The advice is only a hint so failing to give it doesn't fail the copy
+		madvise(memory, window_size, MADV_SEQUENTIAL);
+		madvise(memory, window_size, advice);
+	}
+	return memory;
 }
 
 bool get_file_size(IN int fd, OUT off_t* size) {
@@ -79,6 +256,132 @@ cleanup:
 	return return_value;
 }
 
+// Empties the destination before giving it the source's size, so everything we don't write stays a hole (and nothing
+// from an older destination survives in the source's holes)
+bool prepare_destination(IN int dst, IN off_t file_size) {
+	bool return_value = false;
+
+	int result = ftruncate(dst, 0);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	result = ftruncate(dst, file_size);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Finds the first data extent of [offset, end), *data_start is end when the rest of the range is a hole. File systems
+// without SEEK_DATA report the whole range as data
+bool find_data_extent(IN int fd, IN off_t offset, IN off_t end, OUT off_t* data_start, OUT off_t* data_end) {
+	bool return_value = false;
+	*data_start = offset;
+	*data_end = end;
+
+	off_t start = lseek(fd, offset, SEEK_DATA);
+	if (-1 == start && ENXIO == errno) {
+		*data_start = end;
+		return true;
+	}
+	if (-1 == start && (EINVAL == errno || EOPNOTSUPP == errno)) {
+		return true;
+	}
+	VERIFY_NOT_AND_CLEANUP(-1 == start);
+
+	off_t hole = lseek(fd, start, SEEK_HOLE);
+	VERIFY_NOT_AND_CLEANUP(-1 == hole);
+
+	*data_start = min(start, end);
+	*data_end = min(hole, end);
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Large windows keep the mmap/munmap calls (and the TLB shootdowns of every munmap) rare, small files still get a
+// window big enough to be copied at once
+off_t get_window_size(IN off_t file_size) {
+	off_t window_size = file_size / WINDOWS_PER_FILE;
+	if (window_size < (off_t)MIN_WINDOW_SIZE_MB * BYTES_IN_MB) {
+		window_size = (off_t)MIN_WINDOW_SIZE_MB * BYTES_IN_MB;
+	}
+	window_size = min(window_size, (off_t)MAX_WINDOW_SIZE_MB * BYTES_IN_MB);
+
+	// Note - Huge page aligned windows are also page aligned, as mmap requires for the offsets
+	return ((window_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+}
+
+void copy_window(IN char* src, IN OUT char* dst, IN off_t size) {
+	size_t run_start = 0;
+	size_t run_size = 0;
+
+	// Note - Skipped zero blocks are never touched in the destination mapping so they get no pages
+	for (; next_data_run(src, size, &run_start, &run_size); run_start += run_size) {
+		copy_block(src + run_start, dst + run_start, run_size);
+	}
+}
+
+bool copy_extent_mmap(IN int src, IN int dst, IN off_t start, IN off_t end, IN off_t window_size) {
+	bool return_value = false;
+	void* src_memory = MAP_FAILED;
+	void* next_src_memory = MAP_FAILED;
+	void* dst_memory = MAP_FAILED;
+	off_t to_copy = min(end - start, window_size);
+	off_t next_to_copy = 0;
+	off_t current_position = start;
+
+	src_memory = map_source_window(src, to_copy, start, MADV_WILLNEED);
+	VERIFY_NOT_AND_CLEANUP(MAP_FAILED == src_memory);
+
+	while (current_position < end) {
+		off_t next_position = current_position + to_copy;
+		if (next_position < end) {
+			next_to_copy = min(end - next_position, window_size);
+			next_src_memory = map_source_window(src, next_to_copy, next_position, MADV_WILLNEED);
+			VERIFY_NOT_AND_CLEANUP(MAP_FAILED == next_src_memory);
+		}
+
+		dst_memory = mmap(NULL, to_copy, PROT_READ | PROT_WRITE, MAP_SHARED, dst, current_position);
+		VERIFY_NOT_AND_CLEANUP(MAP_FAILED == dst_memory);
+		if (g_use_huge_pages) {
+			// Note - File mappings only get transparent huge pages where the file system supports them (tmpfs with
+			// huge=advise, hugetlbfs always has them)
+			madvise(dst_memory, to_copy, MADV_HUGEPAGE);
+		}
+
+		copy_window(src_memory, dst_memory, to_copy);
+
+		munmap(dst_memory, to_copy);
+		dst_memory = MAP_FAILED;
+		munmap(src_memory, to_copy);
+		src_memory = next_src_memory;
+		next_src_memory = MAP_FAILED;
+
+		current_position = next_position;
+		to_copy = next_to_copy;
+	}
+
+	return_value = true;
+
+cleanup:
+	if (MAP_FAILED != src_memory) {
+		munmap(src_memory, to_copy);
+	}
+
+	if (MAP_FAILED != next_src_memory) {
+		munmap(next_src_memory, next_to_copy);
+	}
+
+	if (MAP_FAILED != dst_memory) {
+		munmap(dst_memory, to_copy);
+	}
+
+	return return_value;
+}
+
 bool copy_file(IN int src, IN int dst) {
 	bool return_value = false;
 	off_t file_size = 0;
@@ -86,17 +389,27 @@ bool copy_file(IN int src, IN int dst) {
 	bool result = get_file_size(src, &file_size);
 	VERIFY_NOT_AND_CLEANUP(!result);
 
-	int int_result = ftruncate(dst, file_size);
-	VERIFY_NOT_AND_CLEANUP(-1 == int_result);
+	result = prepare_destination(dst, file_size);
+	VERIFY_NOT_AND_CLEANUP(!result);
 
+	off_t window_size = get_window_size(file_size);
 	long page_size = sysconf(_SC_PAGESIZE);
-	off_t current_position = 0;
 
-	while (current_position < file_size) {
-		off_t to_copy = min(file_size - current_position, 4 * page_size);
-		result = copy_part(src, dst, to_copy, current_position);
+	for (off_t offset = 0; offset < file_size; ) {
+		off_t data_start = 0;
+		off_t data_end = 0;
+		result = find_data_extent(src, offset, file_size, &data_start, &data_end);
 		VERIFY_NOT_AND_CLEANUP(!result);
-		current_position += to_copy;
+
+		// Note - mmap offsets must be page aligned, extents are aligned to file system blocks which usually are pages
+		data_start -= data_start % page_size;
+		data_start = (data_start < offset) ? (offset) : (data_start);
+		__atomic_fetch_add(&g_skipped_bytes, data_start - offset, __ATOMIC_RELAXED);
+		if (data_start < data_end) {
+			result = copy_extent_mmap(src, dst, data_start, data_end, window_size);
+			VERIFY_NOT_AND_CLEANUP(!result);
+		}
+		offset = data_end;
 	}
 
 	return_value = true;
@@ -105,27 +418,1612 @@ cleanup:
 	return return_value;
 }
 
-int main(int argc, char** argv)
-{
-	assert(argc == 3);
-	int return_value = -1;
-	char* src_path = argv[1];
-	char* dst_path = argv[2];
-	int src_fd = -1;
-	int dst_fd = -1;
+// The parallel copy (-j) splits the file into chunks that a pool of worker threads take one after the other, every
+// worker copies its chunks with positional reads and writes through its own buffer so workers never share state
+// except for the next chunk and the progress counter.
+//
+// The incremental copy (-i) uses the same chunks but compares every block of the source and the destination by hash and
+// only writes the blocks that differ. Every finished chunk is marked in a journal next to the destination so a copy
+// that got interrupted continues from the chunks it didn't finish.
+typedef struct {
+	int src;
+	int dst;
+	off_t file_size;
+	off_t chunk_size;
+	off_t next_chunk;
+	off_t bytes_copied;
+	int workers_done;
+	bool failed;
 
-	if (!does_file_exist(src_path)) {
-		printf("Source file does not exist\n");
-		goto cleanup;
+	bool incremental;
+	off_t old_dst_size;
+	int journal_fd;
+	char journal_path[PATH_MAX];
+	char* done_chunks;
+	off_t chunks_resumed;
+	off_t blocks_compared;
+	off_t blocks_written;
+} ParallelCopy;
+
+// The journal starts with the source it belongs to, a journal of another source (or another version of it) is ignored
+typedef struct {
+	uint64_t magic;
+	uint64_t file_size;
+	uint64_t chunk_size;
+	int64_t mtime_seconds;
+	int64_t mtime_nanoseconds;
+} JournalHeader;
+
+uint64_t rotate_left(IN uint64_t value, IN int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t read_u64(IN const char* data) {
+	uint64_t value = 0;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+uint64_t xxh64_round(IN uint64_t accumulator, IN uint64_t input) {
+	accumulator += input * XXH_PRIME64_2;
+	return rotate_left(accumulator, 31) * XXH_PRIME64_1;
+}
+
+uint64_t xxh64_merge(IN uint64_t accumulator, IN uint64_t value) {
+	accumulator ^= xxh64_round(0, value);
+	return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 with seed 0
+uint64_t hash_block(IN const char* data, IN size_t size) {
+	const char* end = data + size;
+	uint64_t hash = 0;
+
+	if (size >= 32) {
+		uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = XXH_PRIME64_2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -XXH_PRIME64_1;
+		for (; data + 32 <= end; data += 32) {
+			v1 = xxh64_round(v1, read_u64(data));
+			v2 = xxh64_round(v2, read_u64(data + 8));
+			v3 = xxh64_round(v3, read_u64(data + 16));
+			v4 = xxh64_round(v4, read_u64(data + 24));
+		}
+		hash = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12) + rotate_left(v4, 18);
+		hash = xxh64_merge(hash, v1);
+		hash = xxh64_merge(hash, v2);
+		hash = xxh64_merge(hash, v3);
+		hash = xxh64_merge(hash, v4);
+	}
+	else {
+		hash = XXH_PRIME64_5;
 	}
 
-	src_fd = open(src_path, O_RDWR);
-	VERIFY_NOT_AND_CLEANUP(-1 == src_fd);
+	hash += size;
+	for (; data + 8 <= end; data += 8) {
+		hash ^= xxh64_round(0, read_u64(data));
+		hash = rotate_left(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (data + 4 <= end) {
+		uint32_t value = 0;
+		memcpy(&value, data, sizeof(value));
+		hash ^= value * XXH_PRIME64_1;
+		hash = rotate_left(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		data += 4;
+	}
+	for (; data < end; data++) {
+		hash ^= (uint8_t)*data * XXH_PRIME64_5;
+		hash = rotate_left(hash, 11) * XXH_PRIME64_1;
+	}
 
-	dst_fd = open(dst_path, O_RDWR | O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO);
-	VERIFY_NOT_AND_CLEANUP(-1 == dst_fd);
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+double get_elapsed_seconds(IN struct timespec* start) {
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+bool write_all(IN int dst, IN const char* buffer, IN size_t size, IN off_t offset) {
+	bool return_value = false;
+
+	for (size_t written = 0; written < size; ) {
+		ssize_t write_size = pwrite(dst, buffer + written, size - written, offset + written);
+		if (-1 == write_size && EINTR == errno) {
+			continue;
+		}
+		VERIFY_NOT_AND_CLEANUP(write_size <= 0);
+		written += write_size;
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Copies length bytes at offset from src to dst (short reads and writes are continued)
+bool copy_range(IN int src, IN int dst, IN off_t offset, IN off_t length, IN char* buffer, IN OUT off_t* bytes_copied) {
+	bool return_value = false;
+	off_t end = offset + length;
+
+	while (offset < end) {
+		ssize_t read_size = pread(src, buffer, min(end - offset, WORKER_BUFFER_SIZE), offset);
+		if (-1 == read_size && EINTR == errno) {
+			continue;
+		}
+		if (0 == read_size) {
+			// Note - The source got shorter while we copied it
+			errno = EIO;
+		}
+		VERIFY_NOT_AND_CLEANUP(read_size <= 0);
+
+		size_t run_start = 0;
+		size_t run_size = 0;
+		for (; next_data_run(buffer, read_size, &run_start, &run_size); run_start += run_size) {
+			bool result = write_all(dst, buffer + run_start, run_size, offset + run_start);
+			VERIFY_NOT_AND_CLEANUP(!result);
+		}
+
+		offset += read_size;
+		__atomic_fetch_add(bytes_copied, read_size, __ATOMIC_RELAXED);
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Only the data extents of the chunk are copied, its holes just count as progress
+bool copy_chunk(IN ParallelCopy* copy, IN off_t chunk_start, IN off_t chunk_end, IN char* buffer) {
+	bool return_value = false;
+
+	for (off_t offset = chunk_start; offset < chunk_end; ) {
+		off_t data_start = 0;
+		off_t data_end = 0;
+		bool result = find_data_extent(copy->src, offset, chunk_end, &data_start, &data_end);
+		VERIFY_NOT_AND_CLEANUP(!result);
+
+		__atomic_fetch_add(&g_skipped_bytes, data_start - offset, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&copy->bytes_copied, data_start - offset, __ATOMIC_RELAXED);
+		if (data_start < data_end) {
+			result = copy_range(copy->src, copy->dst, data_start, data_end - data_start, buffer, &copy->bytes_copied);
+			VERIFY_NOT_AND_CLEANUP(!result);
+		}
+		offset = data_end;
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+bool read_all(IN int fd, OUT char* buffer, IN size_t size, IN off_t offset) {
+	bool return_value = false;
+
+	for (size_t done = 0; done < size; ) {
+		ssize_t read_size = pread(fd, buffer + done, size - done, offset + done);
+		if (-1 == read_size && EINTR == errno) {
+			continue;
+		}
+		if (0 == read_size) {
+			errno = EIO;
+		}
+		VERIFY_NOT_AND_CLEANUP(read_size <= 0);
+		done += read_size;
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Makes [start, end) of the destination read as zeros by punching a hole, file systems that can't punch holes get zeros
+// written over the blocks that aren't zero already. buffer holds a block
+bool clear_destination_range(IN int dst, IN off_t start, IN off_t end, IN char* buffer) {
+	bool return_value = false;
+
+	int result = fallocate(dst, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+	if (0 == result) {
+		return true;
+	}
+	VERIFY_NOT_AND_CLEANUP(EOPNOTSUPP != errno);
+
+	for (off_t offset = start; offset < end; ) {
+		size_t block_size = min(end - offset, WORKER_BUFFER_SIZE);
+		bool read_result = read_all(dst, buffer, block_size, offset);
+		VERIFY_NOT_AND_CLEANUP(!read_result);
+
+		if (!is_zero_block(buffer, block_size)) {
+			memset(buffer, 0, block_size);
+			bool write_result = write_all(dst, buffer, block_size, offset);
+			VERIFY_NOT_AND_CLEANUP(!write_result);
+		}
+		offset += block_size;
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Syncs one block of a data extent of the source, it's only written if its hash differs from the destination's (blocks
+// past the old end of the destination have nothing to compare with) and then only its data runs (next_data_run)
+bool sync_block(IN ParallelCopy* copy, IN off_t offset, IN size_t block_size, IN char* buffer, IN char* dst_buffer) {
+	bool return_value = false;
+	bool result = read_all(copy->src, buffer, block_size, offset);
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	bool is_different = true;
+	if (offset + (off_t)block_size <= copy->old_dst_size) {
+		result = read_all(copy->dst, dst_buffer, block_size, offset);
+		VERIFY_NOT_AND_CLEANUP(!result);
+		is_different = (hash_block(buffer, block_size) != hash_block(dst_buffer, block_size));
+		__atomic_fetch_add(&copy->blocks_compared, 1, __ATOMIC_RELAXED);
+	}
+	if (!is_different) {
+		return true;
+	}
+
+	// Note - The zero runs (-z) become holes, the old data under them has to go first
+	if (g_skip_zero_blocks && offset < copy->old_dst_size) {
+		result = clear_destination_range(copy->dst, offset, min(offset + (off_t)block_size, copy->old_dst_size), dst_buffer);
+		VERIFY_NOT_AND_CLEANUP(!result);
+	}
+
+	size_t run_start = 0;
+	size_t run_size = 0;
+	for (; next_data_run(buffer, block_size, &run_start, &run_size); run_start += run_size) {
+		result = write_all(copy->dst, buffer + run_start, run_size, offset + run_start);
+		VERIFY_NOT_AND_CLEANUP(!result);
+	}
+	__atomic_fetch_add(&copy->blocks_written, 1, __ATOMIC_RELAXED);
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Walks the data extents of the chunk like copy_chunk, the source's holes become holes of the destination (punched
+// where the old destination has data, past its old end they already are) and the data is synced block by block.
+// buffer holds two blocks, one for each file
+bool sync_chunk(IN ParallelCopy* copy, IN off_t chunk_start, IN off_t chunk_end, IN char* buffer) {
+	bool return_value = false;
+	char* dst_buffer = buffer + WORKER_BUFFER_SIZE;
+
+	for (off_t offset = chunk_start; offset < chunk_end; ) {
+		off_t data_start = 0;
+		off_t data_end = 0;
+		bool result = find_data_extent(copy->src, offset, chunk_end, &data_start, &data_end);
+		VERIFY_NOT_AND_CLEANUP(!result);
+
+		if (offset < min(data_start, copy->old_dst_size)) {
+			result = clear_destination_range(copy->dst, offset, min(data_start, copy->old_dst_size), dst_buffer);
+			VERIFY_NOT_AND_CLEANUP(!result);
+		}
+		__atomic_fetch_add(&g_skipped_bytes, data_start - offset, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&copy->bytes_copied, data_start - offset, __ATOMIC_RELAXED);
+
+		for (offset = data_start; offset < data_end; ) {
+			size_t block_size = min(data_end - offset, WORKER_BUFFER_SIZE);
+			result = sync_block(copy, offset, block_size, buffer, dst_buffer);
+			VERIFY_NOT_AND_CLEANUP(!result);
+
+			offset += block_size;
+			__atomic_fetch_add(&copy->bytes_copied, block_size, __ATOMIC_RELAXED);
+		}
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+bool mark_chunk_done(IN ParallelCopy* copy, IN off_t chunk_index) {
+	bool return_value = false;
+	char done = 1;
+
+	// Note - The chunk must be on the disk before the journal says so, or resuming after a crash would skip it
+	int result = fdatasync(copy->dst);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	ssize_t written = pwrite(copy->journal_fd, &done, sizeof(done), sizeof(JournalHeader) + chunk_index);
+	VERIFY_NOT_AND_CLEANUP(sizeof(done) != written);
+
+	return_value = true;
 
-	bool result = copy_file(src_fd, dst_fd);
+cleanup:
+	return return_value;
+}
+
+// Reads the chunks an earlier run finished from the destination's journal, or starts a new journal
+bool open_journal(IN ParallelCopy* copy, IN const char* dst_path) {
+	bool return_value = false;
+	struct stat src_stat = {0};
+	off_t chunk_count = (copy->file_size + copy->chunk_size - 1) / copy->chunk_size;
+
+	int result = fstat(copy->src, &src_stat);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	JournalHeader expected = {
+		.magic = JOURNAL_MAGIC,
+		.file_size = copy->file_size,
+		.chunk_size = copy->chunk_size,
+		.mtime_seconds = src_stat.st_mtim.tv_sec,
+		.mtime_nanoseconds = src_stat.st_mtim.tv_nsec,
+	};
+
+	copy->done_chunks = calloc(chunk_count + 1, 1);
+	VERIFY_NOT_AND_CLEANUP(NULL == copy->done_chunks);
+
+	snprintf(copy->journal_path, sizeof(copy->journal_path), "%s" JOURNAL_SUFFIX, dst_path);
+	copy->journal_fd = open(copy->journal_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	VERIFY_NOT_AND_CLEANUP(-1 == copy->journal_fd);
+
+	JournalHeader header = {0};
+	ssize_t read_size = pread(copy->journal_fd, &header, sizeof(header), 0);
+	if (sizeof(header) == read_size && 0 == memcmp(&header, &expected, sizeof(header))) {
+		// Note - A short read just leaves the chunks the journal never got to as not done
+		read_size = pread(copy->journal_fd, copy->done_chunks, chunk_count, sizeof(header));
+		VERIFY_NOT_AND_CLEANUP(-1 == read_size);
+	}
+	else {
+		result = ftruncate(copy->journal_fd, 0);
+		VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+		ssize_t written = pwrite(copy->journal_fd, &expected, sizeof(expected), 0);
+		VERIFY_NOT_AND_CLEANUP(sizeof(expected) != written);
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+void* copy_worker_logic(void* argument) {
+	ParallelCopy* copy = argument;
+	char* buffer = malloc(2 * WORKER_BUFFER_SIZE);
+	if (NULL == buffer) {
+		g_error_string = "Failed to allocate a worker buffer";
+		__atomic_store_n(&copy->failed, true, __ATOMIC_RELAXED);
+	}
+
+	while (NULL != buffer && !__atomic_load_n(&copy->failed, __ATOMIC_RELAXED)) {
+		off_t chunk = __atomic_fetch_add(&copy->next_chunk, copy->chunk_size, __ATOMIC_RELAXED);
+		if (chunk >= copy->file_size) {
+			break;
+		}
+
+		off_t chunk_end = min(chunk + copy->chunk_size, copy->file_size);
+		off_t chunk_index = chunk / copy->chunk_size;
+		bool result = true;
+		if (!copy->incremental) {
+			result = copy_chunk(copy, chunk, chunk_end, buffer);
+		}
+		else if (copy->done_chunks[chunk_index]) {
+			__atomic_fetch_add(&copy->chunks_resumed, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&copy->bytes_copied, chunk_end - chunk, __ATOMIC_RELAXED);
+		}
+		else {
+			result = sync_chunk(copy, chunk, chunk_end, buffer) && mark_chunk_done(copy, chunk_index);
+		}
+
+		if (!result) {
+			__atomic_store_n(&copy->failed, true, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(buffer);
+	__atomic_fetch_add(&copy->workers_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void print_skipped_bytes() {
+	if (g_skipped_bytes > 0) {
+		printf("Skipped %lld bytes of holes%s\n", (long long)g_skipped_bytes, (g_skip_zero_blocks) ? (" and zero blocks") : (""));
+	}
+}
+
+void print_progress(IN ParallelCopy* copy, IN struct timespec* start) {
+	off_t bytes_copied = __atomic_load_n(&copy->bytes_copied, __ATOMIC_RELAXED);
+	double elapsed = get_elapsed_seconds(start);
+	printf("Copied %lld of %lld MB (%.1f MB/s)\n", (long long)(bytes_copied / BYTES_IN_MB), (long long)(copy->file_size / BYTES_IN_MB),
+		   (elapsed > 0) ? ((bytes_copied / (double)BYTES_IN_MB) / elapsed) : (0.0));
+	fflush(stdout);
+}
+
+// dst_path is only needed for the journal of the incremental copy
+bool parallel_copy_file(IN int src, IN int dst, IN const char* dst_path, IN int worker_count, IN off_t chunk_size,
+						IN bool incremental) {
+	bool return_value = false;
+	ParallelCopy copy = {.src = src, .dst = dst, .chunk_size = chunk_size, .incremental = incremental, .journal_fd = -1};
+	pthread_t workers[worker_count];
+	int started = 0;
+	int int_result = 0;
+
+	bool result = get_file_size(src, &copy.file_size);
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	if (incremental) {
+		// Note - The destination keeps its data, the blocks that already match are never written
+		result = get_file_size(dst, &copy.old_dst_size);
+		VERIFY_NOT_AND_CLEANUP(!result);
+
+		result = open_journal(&copy, dst_path);
+		VERIFY_NOT_AND_CLEANUP(!result);
+
+		int_result = ftruncate(dst, copy.file_size);
+		VERIFY_NOT_AND_CLEANUP(-1 == int_result);
+	}
+	else {
+		result = prepare_destination(dst, copy.file_size);
+		VERIFY_NOT_AND_CLEANUP(!result);
+	}
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 0; started < worker_count; started++) {
+		int_result = pthread_create(&workers[started], NULL, copy_worker_logic, &copy);
+		errno = int_result;
+		VERIFY_NOT_AND_CLEANUP(0 != int_result);
+	}
+
+	// The main thread only reports the progress while the workers copy
+	double last_report = 0;
+	struct timespec poll_interval = {.tv_sec = 0, .tv_nsec = PROGRESS_POLL_MS * 1000000L};
+	while (__atomic_load_n(&copy.workers_done, __ATOMIC_ACQUIRE) < worker_count) {
+		nanosleep(&poll_interval, NULL);
+		if (get_elapsed_seconds(&start) - last_report >= PROGRESS_INTERVAL_SECONDS) {
+			last_report = get_elapsed_seconds(&start);
+			print_progress(&copy, &start);
+		}
+	}
+
+	double elapsed = get_elapsed_seconds(&start);
+	VERIFY_NOT_AND_CLEANUP(copy.failed);
+	printf("Copied %lld bytes in %.2f seconds (%.1f MB/s) with %d threads\n", (long long)copy.file_size, elapsed,
+		   (elapsed > 0) ? ((copy.file_size / (double)BYTES_IN_MB) / elapsed) : (0.0), worker_count);
+	print_skipped_bytes();
+	if (incremental) {
+		printf("Compared %lld blocks, wrote %lld blocks, %lld chunks were done by an earlier run\n",
+			   (long long)copy.blocks_compared, (long long)copy.blocks_written, (long long)copy.chunks_resumed);
+		// Note - The copy is complete so the next run starts over
+		unlink(copy.journal_path);
+	}
+	return_value = true;
+
+cleanup:
+	// Note - If starting a worker failed the ones we did start just finish the copy on their own
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	if (-1 != copy.journal_fd) {
+		close(copy.journal_fd);
+	}
+
+	free(copy.done_chunks);
+	return return_value;
+}
+
+// Note - These errors mean that the file system or kernel can't do a strategy for these files at all, so we move to
+// the next one instead of failing the copy
+bool is_strategy_unsupported(IN int error) {
+	return (EOPNOTSUPP == error) || (ENOTTY == error) || (EXDEV == error) || (EINVAL == error) || (ENOSYS == error) ||
+		   (EBADF == error) || (EPERM == error);
+}
+
+// Reflink - The destination shares the source's extents (copy on write) so nothing is copied at all
+bool clone_file(IN int src, IN int dst, IN off_t file_size, OUT bool* is_unsupported) {
+	bool return_value = false;
+	(void)file_size;
+
+	int result = ioctl(dst, FICLONE, src);
+	if (-1 == result && is_strategy_unsupported(errno)) {
+		*is_unsupported = true;
+		goto cleanup;
+	}
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// copy_file_range - The kernel copies inside the page cache (or offloads the copy to the file system / storage)
+bool copy_file_range_file(IN int src, IN int dst, IN off_t file_size, OUT bool* is_unsupported) {
+	bool return_value = false;
+	bool copied_any = false;
+
+	bool result = prepare_destination(dst, file_size);
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	for (off_t offset = 0; offset < file_size; ) {
+		off_t src_offset = 0;
+		off_t data_end = 0;
+		result = find_data_extent(src, offset, file_size, &src_offset, &data_end);
+		VERIFY_NOT_AND_CLEANUP(!result);
+
+		__atomic_fetch_add(&g_skipped_bytes, src_offset - offset, __ATOMIC_RELAXED);
+		off_t dst_offset = src_offset;
+		while (src_offset < data_end) {
+			ssize_t copied = copy_file_range(src, &src_offset, dst, &dst_offset, data_end - src_offset, 0);
+			if (-1 == copied && !copied_any && is_strategy_unsupported(errno)) {
+				*is_unsupported = true;
+				goto cleanup;
+			}
+			if (-1 == copied && EINTR == errno) {
+				continue;
+			}
+			if (0 == copied) {
+				// Note - The source got shorter while we copied it
+				errno = EIO;
+			}
+			VERIFY_NOT_AND_CLEANUP(copied <= 0);
+			copied_any = true;
+		}
+		offset = data_end;
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// sendfile - The data moves from the source's page cache to the destination through a kernel pipe (splice)
+bool sendfile_file(IN int src, IN int dst, IN off_t file_size, OUT bool* is_unsupported) {
+	bool return_value = false;
+	bool copied_any = false;
+
+	bool result = prepare_destination(dst, file_size);
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	for (off_t offset = 0; offset < file_size; ) {
+		off_t src_offset = 0;
+		off_t data_end = 0;
+		result = find_data_extent(src, offset, file_size, &src_offset, &data_end);
+		VERIFY_NOT_AND_CLEANUP(!result);
+
+		__atomic_fetch_add(&g_skipped_bytes, src_offset - offset, __ATOMIC_RELAXED);
+		// Note - sendfile writes at the destination's file position
+		off_t seek_result = lseek(dst, src_offset, SEEK_SET);
+		VERIFY_NOT_AND_CLEANUP(-1 == seek_result);
+
+		while (src_offset < data_end) {
+			ssize_t copied = sendfile(dst, src, &src_offset, data_end - src_offset);
+			if (-1 == copied && !copied_any && is_strategy_unsupported(errno)) {
+				*is_unsupported = true;
+				goto cleanup;
+			}
+			if (-1 == copied && EINTR == errno) {
+				continue;
+			}
+			if (0 == copied) {
+				errno = EIO;
+			}
+			VERIFY_NOT_AND_CLEANUP(copied <= 0);
+			copied_any = true;
+		}
+		offset = data_end;
+	}
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// io_uring - A single thread keeps g_io_uring_depth blocks in flight. Every block is a read linked to the write of
+// the same registered buffer, so the kernel starts the write as soon as the read is done without waiting for us
+typedef struct {
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned pending_submissions;
+	int in_flight;
+} IoUring;
+
+// A block of the copy, one per registered buffer
+typedef struct {
+	char* buffer;
+	off_t offset;
+	size_t length;
+	size_t to_write;
+	size_t written;
+	bool is_short_read;
+	bool has_remainder;
+	bool is_active;
+} IoUringSlot;
+
+void close_io_uring(IN IoUring* ring) {
+	if (NULL != ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (NULL != ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+
+	if (NULL != ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+
+	if (-1 != ring->fd) {
+		close(ring->fd);
+	}
+}
+
+bool setup_io_uring(IN unsigned entries, OUT IoUring* ring, OUT bool* is_unsupported) {
+	bool return_value = false;
+	struct io_uring_params params = {0};
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (-1 == ring->fd && is_strategy_unsupported(errno)) {
+		// Note - Kernels can have io_uring compiled out or disabled (kernel.io_uring_disabled)
+		*is_unsupported = true;
+		goto cleanup;
+	}
+	VERIFY_NOT_AND_CLEANUP(-1 == ring->fd);
+
+	ring->sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+	ring->cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = (ring->cq_ring_size > ring->sq_ring_size) ? (ring->cq_ring_size) : (ring->sq_ring_size);
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ring) {
+		ring->sq_ring = NULL;
+	}
+	VERIFY_NOT_AND_CLEANUP(NULL == ring->sq_ring);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	}
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_ring) {
+			ring->cq_ring = NULL;
+		}
+		VERIFY_NOT_AND_CLEANUP(NULL == ring->cq_ring);
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes) {
+		ring->sqes = NULL;
+	}
+	VERIFY_NOT_AND_CLEANUP(NULL == ring->sqes);
+
+	ring->sq_head = (unsigned*)((char*)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Note - The ring has two entries for every slot and every slot has at most two requests queued, so it is never full
+void queue_io_uring_request(IN IoUring* ring, IN int opcode, IN int fd, IN void* buffer, IN size_t length, IN off_t offset,
+							IN int buffer_index, IN unsigned flags, IN uint64_t user_data) {
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buffer;
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->flags = flags;
+	sqe->user_data = user_data;
+	if (-1 != buffer_index) {
+		sqe->buf_index = buffer_index;
+	}
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending_submissions++;
+	ring->in_flight++;
+}
+
+// Submits what was queued and waits for at least one completion
+bool enter_io_uring(IN IoUring* ring) {
+	bool return_value = false;
+	int result = 0;
+
+	do {
+		result = syscall(__NR_io_uring_enter, ring->fd, ring->pending_submissions, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (-1 == result && EINTR == errno);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	ring->pending_submissions -= result;
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// The user data of a request is its slot and whether it is the write
+#define IO_URING_USER_DATA(slot, is_write) (((uint64_t)(slot) << 1) | (is_write))
+
+void queue_slot_write(IN IoUring* ring, IN IoUringSlot* slot, IN int slot_index, IN int dst, IN bool fixed_buffers) {
+	queue_io_uring_request(ring, (fixed_buffers) ? (IORING_OP_WRITE_FIXED) : (IORING_OP_WRITE), dst, slot->buffer + slot->written,
+						   slot->to_write - slot->written, slot->offset + slot->written, (fixed_buffers) ? (slot_index) : (-1), 0,
+						   IO_URING_USER_DATA(slot_index, 1));
+}
+
+// Queues the read of the slot's block and the write linked to it
+void queue_slot_block(IN IoUring* ring, IN IoUringSlot* slot, IN int slot_index, IN int src, IN int dst, IN bool fixed_buffers) {
+	slot->to_write = slot->length;
+	slot->written = 0;
+	slot->is_short_read = false;
+	slot->has_remainder = false;
+
+	queue_io_uring_request(ring, (fixed_buffers) ? (IORING_OP_READ_FIXED) : (IORING_OP_READ), src, slot->buffer, slot->length,
+						   slot->offset, (fixed_buffers) ? (slot_index) : (-1), IOSQE_IO_LINK, IO_URING_USER_DATA(slot_index, 0));
+	queue_slot_write(ring, slot, slot_index, dst, fixed_buffers);
+}
+
+// Moves the slot past what a short read gave and reads the rest of its block
+void queue_slot_remainder(IN IoUring* ring, IN IoUringSlot* slot, IN int slot_index, IN int src, IN int dst, IN bool fixed_buffers) {
+	slot->offset += slot->to_write;
+	slot->length -= slot->to_write;
+	queue_slot_block(ring, slot, slot_index, src, dst, fixed_buffers);
+}
+
+// Gives the slot the next block of data, returns false when the source has no more data (or finding it failed)
+bool start_slot(IN IoUring* ring, IN IoUringSlot* slot, IN int slot_index, IN int src, IN int dst, IN bool fixed_buffers,
+				IN off_t file_size, IN OUT off_t* offset, IN OUT off_t* data_end, OUT bool* has_failed) {
+	while (*offset >= *data_end) {
+		if (*offset >= file_size) {
+			return false;
+		}
+		off_t data_start = 0;
+		if (!find_data_extent(src, *offset, file_size, &data_start, data_end)) {
+			*has_failed = true;
+			return false;
+		}
+		__atomic_fetch_add(&g_skipped_bytes, data_start - *offset, __ATOMIC_RELAXED);
+		*offset = data_start;
+	}
+
+	slot->offset = *offset;
+	slot->length = min(*data_end - *offset, IO_URING_BLOCK_SIZE);
+	*offset += slot->length;
+	if (g_use_direct_io) {
+		// Note - Only the last block of the file can be unaligned, its read is short and the destination is cut later
+		slot->length = ((slot->length + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT) * DIRECT_IO_ALIGNMENT;
+	}
+	slot->is_active = true;
+
+	queue_slot_block(ring, slot, slot_index, src, dst, fixed_buffers);
+	return true;
+}
+
+// Handles one completion, errno is set when it returns false
+bool complete_slot_request(IN IoUring* ring, IN IoUringSlot* slot, IN int slot_index, IN int src, IN int dst,
+						   IN bool fixed_buffers, IN off_t file_size, IN bool is_write, IN int result) {
+	if (!is_write) {
+		if (0 == result) {
+			// Note - The source got shorter while we copied it
+			errno = EIO;
+			return false;
+		}
+		if (result < 0) {
+			errno = -result;
+			return false;
+		}
+		// Note - A short read breaks the link so its write gets canceled, we write what was read ourselves. Only a read
+		// that reaches the end of the file (like the rounded up last block of O_DIRECT) is done, otherwise the rest of the
+		// block is read after that write
+		if ((size_t)result < slot->length) {
+			slot->is_short_read = true;
+			slot->to_write = result;
+			if (slot->offset + result >= file_size) {
+				if (g_use_direct_io) {
+					slot->to_write = ((slot->to_write + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT) * DIRECT_IO_ALIGNMENT;
+				}
+			}
+			else {
+				slot->has_remainder = true;
+				if (g_use_direct_io) {
+					// Note - The read of the rest has to start aligned, an unaligned tail is read again with it
+					slot->to_write = (slot->to_write / DIRECT_IO_ALIGNMENT) * DIRECT_IO_ALIGNMENT;
+				}
+			}
+		}
+		return true;
+	}
+
+	if (-ECANCELED == result && slot->is_short_read) {
+		slot->is_short_read = false;
+		if (0 == slot->to_write) {
+			queue_slot_remainder(ring, slot, slot_index, src, dst, fixed_buffers);
+		}
+		else {
+			queue_slot_write(ring, slot, slot_index, dst, fixed_buffers);
+		}
+		return true;
+	}
+	if (result <= 0) {
+		errno = (0 == result) ? (EIO) : (-result);
+		return false;
+	}
+
+	slot->written += result;
+	if (slot->written < slot->to_write) {
+		queue_slot_write(ring, slot, slot_index, dst, fixed_buffers);
+	}
+	else if (slot->has_remainder) {
+		queue_slot_remainder(ring, slot, slot_index, src, dst, fixed_buffers);
+	}
+	else {
+		slot->is_active = false;
+	}
+	return true;
+}
+
+// Turns O_DIRECT on (or back off) for both files, the file system may not support it
+bool set_direct_io(IN int src, IN int dst, IN bool enable) {
+	int fds[] = {src, dst};
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(fds[i], F_GETFL);
+		if (-1 == flags) {
+			return false;
+		}
+		flags = (enable) ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+		if (-1 == fcntl(fds[i], F_SETFL, flags)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool io_uring_file(IN int src, IN int dst, IN off_t file_size, OUT bool* is_unsupported) {
+	bool return_value = false;
+	IoUring ring = {.fd = -1};
+	int depth = g_io_uring_depth;
+	IoUringSlot slots[depth];
+	struct iovec buffers[depth];
+	char* memory = NULL;
+	bool fixed_buffers = false;
+	bool is_direct = false;
+	off_t offset = 0;
+	off_t data_end = 0;
+
+	memset(slots, 0, sizeof(slots));
+	bool result = setup_io_uring(2 * depth, &ring, is_unsupported);
+	if (*is_unsupported) {
+		goto cleanup;
+	}
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	memory = aligned_alloc(DIRECT_IO_ALIGNMENT, (size_t)depth * IO_URING_BLOCK_SIZE);
+	VERIFY_NOT_AND_CLEANUP(NULL == memory);
+	for (int i = 0; i < depth; i++) {
+		slots[i].buffer = memory + ((size_t)i * IO_URING_BLOCK_SIZE);
+		buffers[i].iov_base = slots[i].buffer;
+		buffers[i].iov_len = IO_URING_BLOCK_SIZE;
+	}
+
+	// Note - Registering pins the buffers once instead of on every request, it can fail on a low RLIMIT_MEMLOCK and
+	// then the requests just use the buffers unregistered
+	fixed_buffers = (0 == syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, buffers, depth));
+
+	result = prepare_destination(dst, file_size);
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	if (g_use_direct_io) {
+		is_direct = set_direct_io(src, dst, true);
+		if (!is_direct) {
+			set_direct_io(src, dst, false);
+			if (!g_quiet) {
+				printf("O_DIRECT isn't supported for these files, copying through the page cache\n");
+			}
+		}
+	}
+
+	bool has_failed = false;
+	for (int i = 0; i < depth && !has_failed; i++) {
+		start_slot(&ring, &slots[i], i, src, dst, fixed_buffers, file_size, &offset, &data_end, &has_failed);
+	}
+
+	// Note - After a failure we still wait for the requests in flight, they use our buffers
+	while (ring.in_flight > 0) {
+		result = enter_io_uring(&ring);
+		VERIFY_NOT_AND_CLEANUP(!result);
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			int slot_index = cqe->user_data >> 1;
+			bool is_write = cqe->user_data & 1;
+			IoUringSlot* slot = &slots[slot_index];
+
+			ring.in_flight--;
+			if (has_failed) {
+				continue;
+			}
+
+			result = complete_slot_request(&ring, slot, slot_index, src, dst, fixed_buffers, file_size, is_write, cqe->res);
+			if (!result) {
+				has_failed = true;
+				g_error_string = strerror(errno);
+			}
+			else if (!slot->is_active) {
+				start_slot(&ring, slot, slot_index, src, dst, fixed_buffers, file_size, &offset, &data_end, &has_failed);
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	VERIFY_NOT_AND_CLEANUP(has_failed);
+
+	if (g_use_direct_io) {
+		// Note - The aligned writes of the last block went past the end of the file (also when O_DIRECT fell back)
+		int int_result = ftruncate(dst, file_size);
+		VERIFY_NOT_AND_CLEANUP(-1 == int_result);
+	}
+
+	return_value = true;
+
+cleanup:
+	if (is_direct) {
+		set_direct_io(src, dst, false);
+	}
+	close_io_uring(&ring);
+	free(memory);
+	return return_value;
+}
+
+bool mmap_file(IN int src, IN int dst, IN off_t file_size, OUT bool* is_unsupported) {
+	(void)file_size;
+	(void)is_unsupported;
+	return copy_file(src, dst);
+}
+
+typedef bool (*CopyStrategyFunction)(IN int src, IN int dst, IN off_t file_size, OUT bool* is_unsupported);
+
+typedef struct {
+	const char* name;
+	CopyStrategyFunction copy;
+	// The kernel strategies (clone included, it only shares extents) never show us the data so they can't find zero
+	// blocks, -z skips them
+	bool sees_data;
+} CopyStrategy;
+
+// The strategies are tried in this order, the mmap copy works on every file we can map so it is always last
+CopyStrategy g_copy_strategies[] = {
+	{"clone", clone_file, false},
+	{"copy_file_range", copy_file_range_file, false},
+	{"sendfile", sendfile_file, false},
+	{"io_uring", io_uring_file, false},
+	{"mmap", mmap_file, true},
+};
+
+#define COPY_STRATEGY_COUNT ((int)(sizeof(g_copy_strategies) / sizeof(g_copy_strategies[0])))
+
+int find_copy_strategy(IN const char* name) {
+	for (int i = 0; i < COPY_STRATEGY_COUNT; i++) {
+		if (0 == strcmp(name, g_copy_strategies[i].name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Tries the strategies from the fastest one, when forced_strategy isn't -1 only that strategy is used
+bool copy_file_with_strategies(IN int src, IN int dst, IN int forced_strategy) {
+	bool return_value = false;
+	off_t file_size = 0;
+	int strategy = 0;
+
+	bool result = get_file_size(src, &file_size);
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (strategy = 0; strategy < COPY_STRATEGY_COUNT; strategy++) {
+		if (-1 != forced_strategy && strategy != forced_strategy) {
+			continue;
+		}
+		if (-1 == forced_strategy && g_skip_zero_blocks && !g_copy_strategies[strategy].sees_data) {
+			continue;
+		}
+
+		bool is_unsupported = false;
+		result = g_copy_strategies[strategy].copy(src, dst, file_size, &is_unsupported);
+		if (result) {
+			break;
+		}
+		if (!is_unsupported || -1 != forced_strategy) {
+			if (NULL == g_error_string) {
+				g_error_string = strerror(errno);
+			}
+			goto cleanup;
+		}
+	}
+
+	double elapsed = get_elapsed_seconds(&start);
+	if (!g_quiet) {
+		printf("Copied %lld bytes in %.2f seconds (%.1f MB/s) using %s\n", (long long)file_size, elapsed,
+			   (elapsed > 0) ? ((file_size / (double)BYTES_IN_MB) / elapsed) : (0.0), g_copy_strategies[strategy].name);
+		print_skipped_bytes();
+	}
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// The tree copy (-r) keeps a stack of jobs shared by a pool of workers. A directory job lists its directory, pushes its
+// sub directories and its large files as more jobs and copies the rest of its files itself, so small files never wait
+// in the stack and large files spread over the workers. Paths are relative to the source and destination roots, every
+// file is opened relative to its directory's fd.
+typedef struct TreeJob {
+	struct TreeJob* next;
+	char* path;
+	bool is_directory;
+} TreeJob;
+
+// Permissions and timestamps of the directories are set once everything in them was created
+typedef struct TreeDirectory {
+	struct TreeDirectory* next;
+	char* path;
+	struct stat st;
+} TreeDirectory;
+
+typedef struct {
+	int src_root;
+	int dst_root;
+	pthread_mutex_t lock;
+	pthread_cond_t has_jobs;
+	TreeJob* jobs;
+	TreeDirectory* directories;
+	int busy_workers;
+	bool done;
+
+	off_t files;
+	off_t directory_count;
+	off_t bytes;
+	off_t failures;
+} TreeCopy;
+
+bool push_tree_job(IN TreeCopy* tree, IN const char* path, IN bool is_directory) {
+	TreeJob* job = malloc(sizeof(*job));
+	char* job_path = strdup(path);
+	if (NULL == job || NULL == job_path) {
+		free(job);
+		free(job_path);
+		return false;
+	}
+
+	job->path = job_path;
+	job->is_directory = is_directory;
+	pthread_mutex_lock(&tree->lock);
+	job->next = tree->jobs;
+	tree->jobs = job;
+	pthread_cond_signal(&tree->has_jobs);
+	pthread_mutex_unlock(&tree->lock);
+	return true;
+}
+
+void report_tree_failure(IN TreeCopy* tree, IN const char* path) {
+	printf("Failed to copy %s: %s\n", path, strerror(errno));
+	__atomic_fetch_add(&tree->failures, 1, __ATOMIC_RELAXED);
+}
+
+bool copy_tree_file(IN TreeCopy* tree, IN int src_dir, IN int dst_dir, IN const char* name) {
+	bool return_value = false;
+	struct stat st = {0};
+	int src = -1;
+	int dst = -1;
+
+	src = openat(src_dir, name, O_RDONLY | O_NOFOLLOW);
+	VERIFY_NOT_AND_CLEANUP(-1 == src);
+
+	int result = fstat(src, &st);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	// Note - The real mode is set after the copy so the umask doesn't change it
+	dst = openat(dst_dir, name, O_RDWR | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	VERIFY_NOT_AND_CLEANUP(-1 == dst);
+
+	bool copied = copy_file_with_strategies(src, dst, -1);
+	VERIFY_NOT_AND_CLEANUP(!copied);
+
+	result = fchmod(dst, st.st_mode & 07777);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	struct timespec times[2] = {st.st_atim, st.st_mtim};
+	result = futimens(dst, times);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	__atomic_fetch_add(&tree->files, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&tree->bytes, st.st_size, __ATOMIC_RELAXED);
+	return_value = true;
+
+cleanup:
+	if (-1 != src) {
+		close(src);
+	}
+
+	if (-1 != dst) {
+		close(dst);
+	}
+
+	return return_value;
+}
+
+bool copy_tree_symlink(IN int src_dir, IN int dst_dir, IN const char* name, IN struct stat* st) {
+	bool return_value = false;
+	char target[PATH_MAX] = {0};
+
+	ssize_t length = readlinkat(src_dir, name, target, sizeof(target) - 1);
+	VERIFY_NOT_AND_CLEANUP(-1 == length);
+
+	int result = symlinkat(target, dst_dir, name);
+	if (-1 == result && EEXIST == errno) {
+		unlinkat(dst_dir, name, 0);
+		result = symlinkat(target, dst_dir, name);
+	}
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	struct timespec times[2] = {st->st_atim, st->st_mtim};
+	result = utimensat(dst_dir, name, times, AT_SYMLINK_NOFOLLOW);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	return_value = true;
+
+cleanup:
+	return return_value;
+}
+
+// Copies one entry of a directory (path is the entry's path from the roots)
+void copy_tree_entry(IN TreeCopy* tree, IN int src_dir, IN int dst_dir, IN const char* name, IN const char* path,
+					 IN unsigned char type) {
+	struct stat st = {0};
+	bool result = true;
+
+	// Note - getdents gives the type of the entry for free, we only stat what we need more about
+	if (DT_DIR != type) {
+		if (-1 == fstatat(src_dir, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			report_tree_failure(tree, path);
+			return;
+		}
+		type = IFTODT(st.st_mode);
+	}
+
+	switch (type) {
+		case DT_DIR:
+			result = push_tree_job(tree, path, true);
+			break;
+		case DT_REG:
+			if (st.st_size >= LARGE_FILE_SIZE) {
+				result = push_tree_job(tree, path, false);
+			}
+			else {
+				result = copy_tree_file(tree, src_dir, dst_dir, name);
+			}
+			break;
+		case DT_LNK:
+			result = copy_tree_symlink(src_dir, dst_dir, name, &st);
+			break;
+		default:
+			printf("Skipping %s, it isn't a regular file, directory or symbolic link\n", path);
+			break;
+	}
+
+	if (!result) {
+		report_tree_failure(tree, path);
+	}
+}
+
+bool copy_tree_directory(IN TreeCopy* tree, IN const char* path) {
+	bool return_value = false;
+	int src_dir = -1;
+	int dst_dir = -1;
+	char* buffer = NULL;
+	TreeDirectory* directory = NULL;
+
+	src_dir = openat(tree->src_root, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	VERIFY_NOT_AND_CLEANUP(-1 == src_dir);
+
+	directory = calloc(1, sizeof(*directory));
+	VERIFY_NOT_AND_CLEANUP(NULL == directory);
+
+	int result = fstat(src_dir, &directory->st);
+	VERIFY_NOT_AND_CLEANUP(-1 == result);
+
+	// Note - The directory stays writable by us until the end even if the source's isn't
+	result = mkdirat(tree->dst_root, path, S_IRWXU);
+	VERIFY_NOT_AND_CLEANUP(-1 == result && EEXIST != errno);
+
+	dst_dir = openat(tree->dst_root, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	VERIFY_NOT_AND_CLEANUP(-1 == dst_dir);
+
+	buffer = malloc(DIRENT_BUFFER_SIZE);
+	VERIFY_NOT_AND_CLEANUP(NULL == buffer);
+
+	while (true) {
+		ssize_t size = getdents64(src_dir, buffer, DIRENT_BUFFER_SIZE);
+		VERIFY_NOT_AND_CLEANUP(-1 == size);
+		if (0 == size) {
+			break;
+		}
+
+		for (ssize_t offset = 0; offset < size; ) {
+			struct dirent64* entry = (struct dirent64*)(buffer + offset);
+			offset += entry->d_reclen;
+			if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, "..")) {
+				continue;
+			}
+
+			char entry_path[PATH_MAX] = {0};
+			if (0 == strcmp(path, ".")) {
+				snprintf(entry_path, sizeof(entry_path), "%s", entry->d_name);
+			}
+			else {
+				snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+			}
+			copy_tree_entry(tree, src_dir, dst_dir, entry->d_name, entry_path, entry->d_type);
+		}
+	}
+
+	directory->path = strdup(path);
+	VERIFY_NOT_AND_CLEANUP(NULL == directory->path);
+
+	pthread_mutex_lock(&tree->lock);
+	directory->next = tree->directories;
+	tree->directories = directory;
+	pthread_mutex_unlock(&tree->lock);
+	directory = NULL;
+
+	__atomic_fetch_add(&tree->directory_count, 1, __ATOMIC_RELAXED);
+	return_value = true;
+
+cleanup:
+	if (-1 != src_dir) {
+		close(src_dir);
+	}
+
+	if (-1 != dst_dir) {
+		close(dst_dir);
+	}
+
+	free(directory);
+	free(buffer);
+	return return_value;
+}
+
+void* tree_worker_logic(void* argument) {
+	TreeCopy* tree = argument;
+
+	while (true) {
+		pthread_mutex_lock(&tree->lock);
+		while (NULL == tree->jobs && !tree->done) {
+			pthread_cond_wait(&tree->has_jobs, &tree->lock);
+		}
+		if (NULL == tree->jobs) {
+			pthread_mutex_unlock(&tree->lock);
+			break;
+		}
+		TreeJob* job = tree->jobs;
+		tree->jobs = job->next;
+		tree->busy_workers++;
+		pthread_mutex_unlock(&tree->lock);
+
+		bool result = false;
+		if (job->is_directory) {
+			result = copy_tree_directory(tree, job->path);
+		}
+		else {
+			result = copy_tree_file(tree, tree->src_root, tree->dst_root, job->path);
+		}
+		if (!result) {
+			report_tree_failure(tree, job->path);
+		}
+		free(job->path);
+		free(job);
+
+		// Note - Only a busy worker can add jobs, so when none is busy and there are no jobs the tree is done
+		pthread_mutex_lock(&tree->lock);
+		tree->busy_workers--;
+		if (NULL == tree->jobs && 0 == tree->busy_workers) {
+			tree->done = true;
+			pthread_cond_broadcast(&tree->has_jobs);
+		}
+		pthread_mutex_unlock(&tree->lock);
+	}
+
+	return NULL;
+}
+
+// Sets the permissions and timestamps of the directories, none of them is written anymore
+void finish_tree_directories(IN TreeCopy* tree) {
+	while (NULL != tree->directories) {
+		TreeDirectory* directory = tree->directories;
+		tree->directories = directory->next;
+
+		struct timespec times[2] = {directory->st.st_atim, directory->st.st_mtim};
+		if (-1 == fchmodat(tree->dst_root, directory->path, directory->st.st_mode & 07777, 0) ||
+			-1 == utimensat(tree->dst_root, directory->path, times, 0)) {
+			report_tree_failure(tree, directory->path);
+		}
+		free(directory->path);
+		free(directory);
+	}
+}
+
+bool copy_tree(IN int src_root, IN int dst_root, IN int worker_count) {
+	bool return_value = false;
+	TreeCopy tree = {.src_root = src_root, .dst_root = dst_root};
+	pthread_t workers[worker_count];
+	int started = 0;
+
+	pthread_mutex_init(&tree.lock, NULL);
+	pthread_cond_init(&tree.has_jobs, NULL);
+
+	// Note - Every file prints its own summary otherwise
+	g_quiet = true;
+	bool result = push_tree_job(&tree, ".", true);
+	VERIFY_NOT_AND_CLEANUP(!result);
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 0; started < worker_count; started++) {
+		int int_result = pthread_create(&workers[started], NULL, tree_worker_logic, &tree);
+		errno = int_result;
+		VERIFY_NOT_AND_CLEANUP(0 != int_result);
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	started = 0;
+	finish_tree_directories(&tree);
+
+	double elapsed = get_elapsed_seconds(&start);
+	printf("Copied %lld files (%lld MB) and %lld directories in %.2f seconds (%.0f files/s, %.1f MB/s) with %d threads\n",
+		   (long long)tree.files, (long long)(tree.bytes / BYTES_IN_MB), (long long)tree.directory_count, elapsed,
+		   (elapsed > 0) ? (tree.files / elapsed) : (0.0), (elapsed > 0) ? ((tree.bytes / (double)BYTES_IN_MB) / elapsed) : (0.0),
+		   worker_count);
+	print_skipped_bytes();
+
+	if (tree.failures > 0) {
+		printf("Failed to copy %lld entries\n", (long long)tree.failures);
+		// Note - The workers' errors were already printed with their paths
+		g_error_string = "The tree was copied partially";
+		goto cleanup;
+	}
+	return_value = true;
+
+cleanup:
+	if (0 != started) {
+		// Note - Nobody else pushes jobs when starting a worker failed, the started ones finish the tree themselves
+		for (int i = 0; i < started; i++) {
+			pthread_join(workers[i], NULL);
+		}
+		finish_tree_directories(&tree);
+	}
+	pthread_cond_destroy(&tree.has_jobs);
+	pthread_mutex_destroy(&tree.lock);
+	return return_value;
+}
+
+// Compares the copy kernels on in memory buffers, every size is copied about BENCHMARK_BYTES_PER_SIZE bytes in total
+bool run_copy_benchmark() {
+	bool return_value = false;
+	char* src = MAP_FAILED;
+	char* dst = MAP_FAILED;
+	struct {
+		const char* name;
+		CopyBlockFunction copy;
+	} kernels[] = {
+		{"bytes", copy_block_bytes},
+		{"memcpy", copy_block_memcpy},
+		{g_copy_block_name, copy_block},
+	};
+	int kernel_count = (copy_block == copy_block_memcpy) ? (2) : (3);
+
+	src = mmap(NULL, BENCHMARK_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	VERIFY_NOT_AND_CLEANUP(MAP_FAILED == src);
+	dst = mmap(NULL, BENCHMARK_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	VERIFY_NOT_AND_CLEANUP(MAP_FAILED == dst);
+
+	// Note - Touching the buffers first keeps the page faults out of the measurements
+	memset(src, 0x5a, BENCHMARK_MAX_SIZE);
+	memset(dst, 0, BENCHMARK_MAX_SIZE);
+
+	printf("%12s", "size");
+	for (int kernel = 0; kernel < kernel_count; kernel++) {
+		printf(" %10s GB/s", kernels[kernel].name);
+	}
+	printf("\n");
+
+	for (size_t size = BENCHMARK_MIN_SIZE; size <= BENCHMARK_MAX_SIZE; size *= 4) {
+		long long iterations = BENCHMARK_BYTES_PER_SIZE / size;
+		printf("%12zu", size);
+		for (int kernel = 0; kernel < kernel_count; kernel++) {
+			struct timespec start = {0};
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (long long i = 0; i < iterations; i++) {
+				kernels[kernel].copy(src, dst, size);
+				// Note - Keeps the compiler from dropping the copies whose result is never read
+				__asm__ volatile("" : : "r"(dst) : "memory");
+			}
+			double elapsed = get_elapsed_seconds(&start);
+			printf(" %15.2f", (iterations * (double)size) / elapsed / (1024.0 * 1024 * 1024));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	return_value = true;
+
+cleanup:
+	if (MAP_FAILED != src) {
+		munmap(src, BENCHMARK_MAX_SIZE);
+	}
+
+	if (MAP_FAILED != dst) {
+		munmap(dst, BENCHMARK_MAX_SIZE);
+	}
+
+	return return_value;
+}
+
+void print_usage(IN const char* program) {
+	printf("Usage: %s [-j threads] [-c chunk_MB] [-s strategy] [-H] [-z] [-i] [-r] [-q depth] [-D] <source> <destination>\n", program);
+	printf("       %s -b\n", program);
+	printf("  -j  Copy in parallel chunks with the given number of threads\n");
+	printf("  -c  The size of the parallel chunks in MB (default %d)\n", DEFAULT_CHUNK_SIZE_MB);
+	printf("  -s  Only use one copy strategy (clone, copy_file_range, sendfile, io_uring or mmap) instead of trying them in order\n");
+	printf("  -H  Ask for huge pages on the destination mapping of the mmap copy\n");
+	printf("  -z  Also leave holes for all zero blocks of the source, the strategies that don't see the data are skipped so\n"
+		   "      it copies with mmap (or -j and -i)\n");
+	printf("  -i  Only write the blocks that differ from the destination, resuming an interrupted -i copy (uses -j)\n");
+	printf("  -r  Copy a directory tree, -j sets the number of threads (default %d per CPU)\n", TREE_WORKERS_PER_CPU);
+	printf("  -q  The number of blocks io_uring keeps in flight (default %d)\n", DEFAULT_IO_URING_DEPTH);
+	printf("  -D  Read and write with O_DIRECT in the io_uring copy\n");
+	printf("  -b  Benchmark the memory copy kernels instead of copying a file\n");
+}
+
+int main(int argc, char** argv)
+{
+	int return_value = -1;
+	int worker_count = 0;
+	off_t chunk_size = (off_t)DEFAULT_CHUNK_SIZE_MB * BYTES_IN_MB;
+	int forced_strategy = -1;
+	bool run_benchmark = false;
+	bool incremental = false;
+	bool recursive = false;
+	int src_fd = -1;
+	int dst_fd = -1;
+
+	int option = 0;
+	while (-1 != (option = getopt(argc, argv, "j:c:s:Hbzirq:D"))) {
+		switch (option) {
+			case 'j': worker_count = atoi(optarg); break;
+			case 'c': chunk_size = (off_t)atoi(optarg) * BYTES_IN_MB; break;
+			case 'H': g_use_huge_pages = true; break;
+			case 'b': run_benchmark = true; break;
+			case 'z': g_skip_zero_blocks = true; break;
+			case 'i': incremental = true; break;
+			case 'r': recursive = true; break;
+			case 'q': g_io_uring_depth = atoi(optarg); break;
+			case 'D': g_use_direct_io = true; break;
+			case 's':
+				forced_strategy = find_copy_strategy(optarg);
+				if (-1 == forced_strategy) {
+					print_usage(argv[0]);
+					return -1;
+				}
+				break;
+			default:
+				print_usage(argv[0]);
+				return -1;
+		}
+	}
+	select_simd_kernels();
+	if (run_benchmark) {
+		if (!run_copy_benchmark()) {
+			printf("%s\n", g_error_string);
+			return -1;
+		}
+		return 0;
+	}
+	if (argc - optind != 2 || worker_count < 0 || chunk_size <= 0 || g_io_uring_depth <= 0) {
+		print_usage(argv[0]);
+		return -1;
+	}
+	// Note - The chunk copy of -j and -i is always pread/pwrite, so the options of the strategies would do nothing there
+	bool strategy_options = (-1 != forced_strategy || g_use_huge_pages || g_use_direct_io || DEFAULT_IO_URING_DEPTH != g_io_uring_depth);
+	if (!recursive && (worker_count > 0 || incremental) && strategy_options) {
+		printf("-s, -H, -q and -D only apply to the copy strategies, not to -j or -i\n");
+		print_usage(argv[0]);
+		return -1;
+	}
+	if (g_skip_zero_blocks && -1 != forced_strategy && !g_copy_strategies[forced_strategy].sees_data) {
+		printf("-z needs a strategy that sees the data, %s doesn't\n", g_copy_strategies[forced_strategy].name);
+		print_usage(argv[0]);
+		return -1;
+	}
+	if (recursive && -1 != forced_strategy) {
+		printf("-s doesn't apply to -r, every file tries the strategies in order\n");
+		print_usage(argv[0]);
+		return -1;
+	}
+	char* src_path = argv[optind];
+	char* dst_path = argv[optind + 1];
+
+	if (!does_file_exist(src_path)) {
+		printf("Source file does not exist\n");
+		goto cleanup;
+	}
+
+	src_fd = open(src_path, O_RDONLY);
+	VERIFY_NOT_AND_CLEANUP(-1 == src_fd);
+
+	if (recursive) {
+		int int_result = mkdir(dst_path, S_IRWXU);
+		VERIFY_NOT_AND_CLEANUP(-1 == int_result && EEXIST != errno);
+
+		dst_fd = open(dst_path, O_RDONLY | O_DIRECTORY);
+		VERIFY_NOT_AND_CLEANUP(-1 == dst_fd);
+
+		worker_count = (worker_count > 0) ? (worker_count) : (TREE_WORKERS_PER_CPU * sysconf(_SC_NPROCESSORS_ONLN));
+		VERIFY_NOT_AND_CLEANUP(!copy_tree(src_fd, dst_fd, worker_count));
+		return_value = 0;
+		goto cleanup;
+	}
+
+	dst_fd = open(dst_path, O_RDWR | O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO);
+	VERIFY_NOT_AND_CLEANUP(-1 == dst_fd);
+
+	bool result = false;
+	if (worker_count > 0 || incremental) {
+		worker_count = (worker_count > 0) ? (worker_count) : (1);
+		result = parallel_copy_file(src_fd, dst_fd, dst_path, worker_count, chunk_size, incremental);
+	}
+	else {
+		result = copy_file_with_strategies(src_fd, dst_fd, forced_strategy);
+	}
 	VERIFY_NOT_AND_CLEANUP(!result);
 
 	return_value = 0;
@@ -12,12 +12,70 @@
 #include <math.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h> // Note - The kernel's AIO through its syscalls, libaio is just a wrapper of them
 
-typedef enum Parameters_t {
-	ProgramPath = 0,
-	TargetFile,
-	ParameterCount,
-} Parameters;
+typedef enum AccessPattern_t {
+	APSequential = 0,
+	APRandom,
+	APStrided,
+	// Note - Set by -x, the operations come from a trace
+	APReplay,
+	APCount,
+} AccessPattern;
+
+typedef enum Operation_t {
+	OPWrite = 0,
+	OPRead,
+	OPCount,
+} Operation;
+
+typedef enum IOMode_t {
+	IMDirect = 0,
+	IMBuffered,
+	IMMmap,
+	IMCount,
+} IOMode;
+
+// How writes are made durable, the flags are at open and the rest in the measured time of the write that syncs
+typedef enum DurabilityMode_t {
+	DMNone = 0,
+	DMDsync,
+	DMSync,
+	DMFsync,
+	DMFdatasync,
+	DMSyncRange,
+	DMGroupCommit,
+	DMMsync,
+	DMCount,
+} DurabilityMode;
+
+typedef enum MapAdvice_t {
+	MANormal = 0,
+	MARandom,
+	MASequential,
+	MAWillNeed,
+	MAHugePage,
+	MACount,
+} MapAdvice;
+
+typedef enum RegionMode_t {
+	RMDisjoint = 0,
+	RMShared,
+	RMCount,
+} RegionMode;
+
+typedef enum OutputFormat_t {
+	OFText = 0,
+	OFCsv,
+	OFJson,
+	OFCount,
+} OutputFormat;
 
 typedef enum FileType_t {
 	FTFile = 0,
@@ -39,6 +97,19 @@ typedef enum ErrorCodes_t {
 	ECFileIsADirectory 				= -10,
 	ECFailedOpenToWriteDuringSetup	= -11,
 	ECFailedToCreateFile			= -12,
+	ECBadArgument					= -13,
+	ECFailedToOpenForBenchmark		= -14,
+	ECFailedToReadAllData			= -15,
+	ECFailedToMapFile				= -16,
+	ECOutOfMemory					= -17,
+	ECFailedToCreateThread			= -18,
+	ECFailedToSetupAio				= -19,
+	ECFailedToSubmitAio				= -20,
+	ECFailedToGetAioEvents			= -21,
+	ECFailedToPreallocate			= -22,
+	ECFailedToSync					= -23,
+	ECFailedToReadTrace				= -24,
+	ECFailedToWriteTrace			= -25,
 } ErrorCodes;
 
 #define VERIFY(condition, message, errorCode) 	\
@@ -55,12 +126,202 @@ typedef enum ErrorCodes_t {
 
 #define ARRAYSIZE(arr) (sizeof(arr)/sizeof(arr[0]))
 
-static char buf[1024*1024] __attribute__ ((__aligned__ (4096)));
-#define TARGET_FILE_SIZE (256 * 1024 * 1024)
-#define KILOBYTE(num) (num * 1024)
+#define KILOBYTE(num) ((num) * 1024)
 #define MEGABYTE(num) (KILOBYTE(num) * 1024)
+#define DEFAULT_FILE_SIZE (MEGABYTE(256))
 #define WRITE_SIZE (MEGABYTE(1))
 #define NUMBER_OF_TESTS_FOR_AVEREGE (5)
+#define MIN_BLOCK_SIZE (512)
+#define MAX_BLOCK_SIZE (MEGABYTE(16))
+#define MAX_BLOCK_SIZES (32)
+#define BUFFER_ALIGNMENT (4096)
+#define INITIAL_SERIES_CAPACITY (64)
+#define LATENCY_SUB_BUCKET_BITS (5)
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+// Note - The raw clock isn't slewed by NTP, so a correction in the middle of a test doesn't show up as latency
+#define BENCHMARK_CLOCK (CLOCK_MONOTONIC_RAW)
+#define MAX_THREADS (256)
+#define MAX_QUEUE_DEPTH (1024)
+// Note - Every setup thread fills its part of the file in writes of this size
+#define FILL_CHUNK_SIZE (MEGABYTE(4))
+#define MAX_FILL_THREADS (16)
+#define TRACE_MAGIC ("EX1TRACE")
+#define TRACE_VERSION (1)
+#define INITIAL_TRACE_CAPACITY (4096)
+
+// Note - Big enough for the largest block size of the run (and at least 1MB for the setup)
+static char* buf = NULL;
+static size_t bufSize = 0;
+
+// Note - The CSV and JSON results go to stdout alone, everything else goes to stderr for them
+static FILE* statusOutput = NULL;
+
+// Note - For the data of the operations, the workers and the setup threads have their own
+static uint64_t globalRandomState[4] = {0};
+
+static const char* accessPatternNames[APCount] = {"sequential", "random", "strided", "replay"};
+static const char* operationNames[OPCount] = {"write", "read"};
+static const char* ioModeNames[IMCount] = {"direct", "buffered", "mmap"};
+static const char* durabilityModeNames[DMCount] = {"none", "dsync", "sync", "fsync", "fdatasync", "sync_range", "group",
+												   "msync"};
+static const char* mapAdviceNames[MACount] = {"normal", "random", "sequential", "willneed", "hugepage"};
+static const int mapAdviceValues[MACount] = {MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED, MADV_HUGEPAGE};
+static const char* regionModeNames[RMCount] = {"disjoint", "shared"};
+static const char* outputFormatNames[OFCount] = {"text", "csv", "json"};
+
+typedef struct BenchmarkConfig_t {
+	AccessPattern pattern;
+	Operation operation;
+	size_t blockSizes[MAX_BLOCK_SIZES];
+	int blockSizeCount;
+	bool modes[IMCount];
+	bool durabilityModes[DMCount];
+	// The writes between syncs of the modes that sync
+	int syncInterval;
+	// Note - 0 means twice the block size, so every other block is skipped
+	size_t stride;
+	off_t fileSize;
+	// A run stops after secondsPerRun if it isn't 0, otherwise after bytesPerRun (0 means the file size)
+	long long bytesPerRun;
+	double secondsPerRun;
+	int repetitions;
+	// Every thread does its own operations, with a queue depth above 1 through AIO
+	int threads;
+	int queueDepth;
+	RegionMode regionMode;
+	// The mmap mode's mapping
+	bool shouldPopulate;
+	MapAdvice mapAdvice;
+	// The trace to replay instead of the pattern, optionally at its own pace, and where to save the first run's trace
+	const char* replayPath;
+	bool shouldKeepTiming;
+	const char* capturePath;
+	// Note - 0 means no time series, otherwise the length of its intervals
+	double intervalMilliseconds;
+	OutputFormat format;
+} BenchmarkConfig;
+
+static BenchmarkConfig config = {
+	.pattern = APRandom,
+	.operation = OPWrite,
+	.blockSizes = {WRITE_SIZE},
+	.blockSizeCount = 1,
+	.modes = {true, true, false},
+	.durabilityModes = {true},
+	.syncInterval = 1,
+	.stride = 0,
+	.fileSize = DEFAULT_FILE_SIZE,
+	.bytesPerRun = 0,
+	.secondsPerRun = 0,
+	.repetitions = NUMBER_OF_TESTS_FOR_AVEREGE,
+	.threads = 1,
+	.queueDepth = 1,
+	.regionMode = RMDisjoint,
+	.shouldPopulate = false,
+	.mapAdvice = MANormal,
+	.format = OFText,
+};
+
+// Latencies are kept HDR style - exact below 2 * LATENCY_SUB_BUCKETS ns and from there LATENCY_SUB_BUCKETS
+// buckets for every power of 2, so every value is kept to within 1 / LATENCY_SUB_BUCKETS of itself and recording one
+// is just an increment
+typedef struct LatencyHistogram_t {
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t total;
+	uint64_t maxNanoseconds;
+} LatencyHistogram;
+
+// One operation of a trace, the timestamp is from the start of its run. Note - The binary format is these as they are
+// in memory after a TraceHeader, so it moves between machines of the same endianness
+typedef struct TraceRecord_t {
+	uint64_t timestampNanoseconds;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t operation;
+} TraceRecord;
+
+typedef struct TraceHeader_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+} TraceHeader;
+
+typedef struct Trace_t {
+	TraceRecord* records;
+	size_t count;
+	size_t capacity;
+} Trace;
+
+// Note - The whole trace is loaded up front so reading it doesn't show up in the replay
+static Trace replayTrace = {0};
+static bool isTraceCaptured = false;
+
+// One interval of the time series (-i), enough to spot the intervals where writeback or the device stalled
+typedef struct IntervalSample_t {
+	long long operations;
+	long long bytes;
+	uint64_t totalNanoseconds;
+	uint64_t maxNanoseconds;
+} IntervalSample;
+
+typedef struct TimeSeries_t {
+	IntervalSample* samples;
+	size_t count;
+	size_t capacity;
+} TimeSeries;
+
+typedef struct BenchmarkResult_t {
+	size_t blockSize;
+	IOMode mode;
+	DurabilityMode durability;
+	long long operations;
+	long long bytes;
+	double seconds;
+	// Note - Of the whole process while the threads ran, which is just them
+	long minorFaults;
+	long majorFaults;
+	LatencyHistogram latencies;
+	// Every repetition's intervals follow the previous repetition's
+	TimeSeries series;
+	long long threadOperations[MAX_THREADS];
+	long long threadBytes[MAX_THREADS];
+	double threadSeconds[MAX_THREADS];
+} BenchmarkResult;
+
+// Group commit - a thread that needs its writes durable either syncs for everyone who wrote before it or waits for the
+// sync that's already running, then maybe syncs again, so with many threads one fdatasync covers many writes
+typedef struct GroupCommit_t {
+	pthread_mutex_t lock;
+	pthread_cond_t synced;
+	long long writes;
+	long long syncedWrites;
+	bool isSyncing;
+} GroupCommit;
+
+// What one thread of a run works on and what it measured
+typedef struct WorkerContext_t {
+	int index;
+	size_t blockSize;
+	DurabilityMode durability;
+	GroupCommit* groupCommit;
+	int fd;
+	char* mapping;
+	off_t regionStart;
+	off_t regionSize;
+	long long bytesToMove;
+	uint64_t randomState[4];
+	// queueDepth blocks, every operation in flight has its own
+	char* buffers;
+	struct timespec runStart;
+	long long operations;
+	long long bytes;
+	double seconds;
+	LatencyHistogram latencies;
+	TimeSeries series;
+	// Note - Only while capturing the first run
+	Trace* captured;
+} WorkerContext;
 
 
 bool doesFileExist(const char * filePath) {
@@ -89,18 +350,79 @@ FileType getFileType(const char * filePath) {
 void printFileType(FileType fileType) {
 	VERIFY(FTNeither != fileType, "Not a regular file or directory\n", ECNotFileOrDir);
 	if (FTFile == fileType) {
-		printf("It is a regular file\n");
+		fprintf(statusOutput, "It is a regular file\n");
 	}
 	else if (FTDir == fileType) {
-		printf("It is a directory\n");	
+		fprintf(statusOutput, "It is a directory\n");
 	}
 }
 
-off_t getRandomOffsetInFile(size_t writeSize) {
-	// Note - This assumes a file size of 256 MB
-	size_t randomValue = (size_t)random();
-	size_t possibleAllignedWrites = TARGET_FILE_SIZE / writeSize;
-	return (off_t)((randomValue % possibleAllignedWrites) * writeSize);
+// xoshiro256+, fast enough that filling the file is bound by the device and with all 64 bits random, where rand_r
+// stops at 2^31 and can't reach every block of a big file
+uint64_t getNextRandom(uint64_t state[4]) {
+	uint64_t result = state[0] + state[3];
+	uint64_t shifted = state[1] << 17;
+
+	state[2] ^= state[0];
+	state[3] ^= state[1];
+	state[1] ^= state[2];
+	state[0] ^= state[3];
+	state[2] ^= shifted;
+	state[3] = (state[3] << 45) | (state[3] >> 19);
+	return result;
+}
+
+// splitmix64 of seed, so close seeds still give unrelated states
+void seedRandom(uint64_t state[4], uint64_t seed) {
+	for (int i = 0; i < 4; i++) {
+		seed += 0x9E3779B97F4A7C15ULL;
+		uint64_t value = seed;
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+		state[i] = value ^ (value >> 31);
+	}
+}
+
+// Random data doesn't compress, so compressing filesystems and devices can't make the benchmark look better
+void fillRandom(char* buffer, size_t size, uint64_t state[4]) {
+	uint64_t* words = (uint64_t*)buffer;
+	size_t wordCount = size / sizeof(uint64_t);
+	for (size_t i = 0; i < wordCount; i++) {
+		words[i] = getNextRandom(state);
+	}
+	if (0 != (size % sizeof(uint64_t))) {
+		uint64_t last = getNextRandom(state);
+		memcpy(buffer + (wordCount * sizeof(uint64_t)), &last, size % sizeof(uint64_t));
+	}
+}
+
+off_t getRandomOffsetInRegion(WorkerContext* context) {
+	uint64_t possibleAllignedWrites = context->regionSize / context->blockSize;
+	return (off_t)((getNextRandom(context->randomState) % possibleAllignedWrites) * context->blockSize);
+}
+
+// The offset of the operationIndex'th operation of a thread, always block aligned and inside the thread's region
+off_t getOffsetInRegion(WorkerContext* context, long long operationIndex) {
+	size_t blockSize = context->blockSize;
+	long long blocksInRegion = context->regionSize / blockSize;
+	size_t stride = (0 != config.stride) ? (config.stride) : (2 * blockSize);
+	long long block = 0;
+
+	switch (config.pattern) {
+		case APSequential:
+			block = operationIndex % blocksInRegion;
+			break;
+		case APStrided: {
+			// Note - Every pass over the region starts one block later than the previous one so all of it gets used
+			long long position = operationIndex * (long long)stride;
+			long long passes = position / context->regionSize;
+			block = (((position % context->regionSize) / blockSize) + passes) % blocksInRegion;
+			break;
+		}
+		default:
+			return context->regionStart + getRandomOffsetInRegion(context);
+	}
+	return context->regionStart + (off_t)(block * blockSize);
 }
 
 off_t getFileSize(const char * path) {
@@ -109,24 +431,65 @@ off_t getFileSize(const char * path) {
 	return data.st_size;
 }
 
-void makeGlobalBufferRandom(long dataToRandomize) {
-	int runsToMake = dataToRandomize / sizeof(long);
-	long* bufAsLong = (long*)buf;
-	for (int i = 0; i < runsToMake; i++) {
-		bufAsLong[i] = random();
+void makeGlobalBufferRandom(size_t dataToRandomize) {
+	fillRandom(buf, dataToRandomize, globalRandomState);
+}
+
+// One setup thread's part of the file
+typedef struct FillContext_t {
+	int fd;
+	off_t start;
+	off_t end;
+	uint64_t randomState[4];
+} FillContext;
+
+void* fillWorker(void* argument) {
+	FillContext* context = argument;
+	char* buffer = aligned_alloc(BUFFER_ALIGNMENT, FILL_CHUNK_SIZE);
+	VERIFY(NULL != buffer, "Failed to allocate the fill buffer\n", ECOutOfMemory);
+
+	off_t offset = context->start;
+	while (offset < context->end) {
+		size_t dataToWrite = ((context->end - offset) < FILL_CHUNK_SIZE) ? (context->end - offset) : (FILL_CHUNK_SIZE);
+		fillRandom(buffer, dataToWrite, context->randomState);
+		ssize_t result = pwrite(context->fd, buffer, dataToWrite, offset);
+		VERIFY_ERRNO(-1 != result, "Failed writing random data to the file: %s\n", ECFailedToWriteDuringSetup);
+		offset += result;
 	}
+
+	free(buffer);
+	return NULL;
 }
 
-void appendRandomDataToFile(const char * path, off_t dataSize) {
-	int fd = open(path, O_APPEND | O_RDWR);
-	VERIFY_ERRNO(-1 != fd, "Failed to open the file to make it 256MB: %s\n", ECFailedOpenToWriteDuringSetup);
+// Fills the file from start to end with random data, with a thread for every CPU and whole chunks for all of them
+void fillFileRandom(const char * path, off_t start, off_t end) {
+	int fd = open(path, O_RDWR);
+	VERIFY_ERRNO(-1 != fd, "Failed to open the file to fill it: %s\n", ECFailedOpenToWriteDuringSetup);
 
-	while (dataSize > 0) {
-		int dataToWrite = (dataSize < sizeof(buf)) ? (dataSize) : (sizeof(buf));
-		makeGlobalBufferRandom(dataToWrite);
-		int result = write(fd, buf, dataToWrite);
-		VERIFY_ERRNO(-1 != result, "Failed writing to buffer to make it 256MB: %s\n", ECFailedToWriteDuringSetup);
-		dataSize -= dataToWrite;
+	// Note - Reserving it all up front keeps the file's extents contiguous and runs out of space before writing anything.
+	// Filesystems without fallocate just get the writes.
+	if (-1 == fallocate(fd, 0, start, end - start)) {
+		VERIFY_ERRNO(EOPNOTSUPP == errno, "Failed to preallocate the file: %s\n", ECFailedToPreallocate);
+	}
+
+	long chunks = ((end - start) + FILL_CHUNK_SIZE - 1) / FILL_CHUNK_SIZE;
+	long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	threadCount = (threadCount > MAX_FILL_THREADS) ? (MAX_FILL_THREADS) : ((threadCount < 1) ? (1) : (threadCount));
+	threadCount = (threadCount > chunks) ? (chunks) : (threadCount);
+	pthread_t threads[MAX_FILL_THREADS];
+	FillContext contexts[MAX_FILL_THREADS];
+
+	for (long i = 0; i < threadCount; i++) {
+		contexts[i].fd = fd;
+		contexts[i].start = start + (((chunks * i) / threadCount) * FILL_CHUNK_SIZE);
+		contexts[i].end = start + (((chunks * (i + 1)) / threadCount) * FILL_CHUNK_SIZE);
+		contexts[i].end = (contexts[i].end > end) ? (end) : (contexts[i].end);
+		seedRandom(contexts[i].randomState, (uint64_t)random());
+		errno = pthread_create(&threads[i], NULL, fillWorker, &contexts[i]);
+		VERIFY_ERRNO(0 == errno, "Failed to create a fill thread: %s\n", ECFailedToCreateThread);
+	}
+	for (long i = 0; i < threadCount; i++) {
+		pthread_join(threads[i], NULL);
 	}
 	close(fd);
 }
@@ -143,105 +506,998 @@ void makeFileSize(const char * path, off_t size) {
 	verifyFileExists(path);
 
 	off_t currentFileSize = getFileSize(path);
-	off_t dataToAdd = 0;
 	if (currentFileSize < size) {
-		dataToAdd = size - currentFileSize;
+		fillFileRandom(path, currentFileSize, size);
 	}
 	else if (currentFileSize > size) {
-		int fd = open(path, O_TRUNC | O_RDWR);
-		VERIFY_ERRNO(-1 != fd, "Failed to open the file for truncating: %s\n", ECFailedToOpenForTruncate);
-		close(fd);
-		dataToAdd = size;
+		// Note - What's left is already random, cutting the end off is enough
+		VERIFY_ERRNO(0 == truncate(path, size), "Failed to truncate the file: %s\n", ECFailedToOpenForTruncate);
 	}
 	else {
 		// Note - File is just the right size, we don't need to do anythig
 	}
+}
+
+double getElapsedMicroseconds(const struct timespec* start, const struct timespec* end) {
+	return ((end->tv_sec - start->tv_sec) * 1000000.0) + ((end->tv_nsec - start->tv_nsec) / 1000.0);
+}
+
+uint64_t getElapsedNanoseconds(const struct timespec* start, const struct timespec* end) {
+	return ((end->tv_sec - start->tv_sec) * 1000000000ULL) + end->tv_nsec - start->tv_nsec;
+}
+
+int getLatencyBucket(uint64_t nanoseconds) {
+	if (nanoseconds < 2 * LATENCY_SUB_BUCKETS) {
+		return (int)nanoseconds;
+	}
+	int magnitude = 63 - __builtin_clzll(nanoseconds) - LATENCY_SUB_BUCKET_BITS;
+	return ((magnitude + 1) * LATENCY_SUB_BUCKETS) + (int)(nanoseconds >> magnitude) - LATENCY_SUB_BUCKETS;
+}
+
+// The highest value that lands in the bucket
+uint64_t getLatencyBucketValue(int bucket) {
+	if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+	int magnitude = (bucket / LATENCY_SUB_BUCKETS) - 1;
+	uint64_t top = (bucket % LATENCY_SUB_BUCKETS) + LATENCY_SUB_BUCKETS;
+	return ((top + 1) << magnitude) - 1;
+}
 
-	if (size != 0) {
-		appendRandomDataToFile(path, dataToAdd);
+void recordLatency(LatencyHistogram* histogram, uint64_t nanoseconds) {
+	histogram->counts[getLatencyBucket(nanoseconds)]++;
+	if (nanoseconds > histogram->maxNanoseconds) {
+		histogram->maxNanoseconds = nanoseconds;
 	}
+	histogram->total++;
 }
 
-long rewriteFile(const char * path, bool useOdirect, size_t writeSize) {
-	struct timeval start = {0};
-	struct timeval end = {0};
-	int seekResult = 0;
-	ssize_t writeResult = 0;
+void mergeHistogram(LatencyHistogram* into, const LatencyHistogram* from) {
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		into->counts[i] += from->counts[i];
+	}
+	if (from->maxNanoseconds > into->maxNanoseconds) {
+		into->maxNanoseconds = from->maxNanoseconds;
+	}
+	into->total += from->total;
+}
 
-	int flags = (useOdirect) ? (O_RDWR | O_DIRECT) : (O_RDWR);
+// In microseconds
+double getPercentile(const LatencyHistogram* histogram, double percentile) {
+	uint64_t wanted = (uint64_t)((percentile / 100.0) * histogram->total);
+	wanted = (wanted < 1) ? (1) : (wanted);
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= wanted) {
+			uint64_t value = getLatencyBucketValue(i);
+			return ((value < histogram->maxNanoseconds) ? (value) : (histogram->maxNanoseconds)) / 1000.0;
+		}
+	}
+	return histogram->maxNanoseconds / 1000.0;
+}
 
-	VERIFY_ERRNO(0 == gettimeofday(&start, NULL), "Error getting start time: %s\n", ECFailedToGetTimeStart);
+IntervalSample* getIntervalSample(TimeSeries* series, size_t index) {
+	if (index >= series->capacity) {
+		size_t capacity = (0 == series->capacity) ? (INITIAL_SERIES_CAPACITY) : (series->capacity);
+		while (capacity <= index) {
+			capacity *= 2;
+		}
+		series->samples = realloc(series->samples, capacity * sizeof(IntervalSample));
+		VERIFY(NULL != series->samples, "Out of memory for the time series\n", ECOutOfMemory);
+		memset(series->samples + series->capacity, 0, (capacity - series->capacity) * sizeof(IntervalSample));
+		series->capacity = capacity;
+	}
+	if (index >= series->count) {
+		series->count = index + 1;
+	}
+	return &series->samples[index];
+}
 
-	size_t numberOfWrites = TARGET_FILE_SIZE / writeSize;
+void addIntervalSample(IntervalSample* into, const IntervalSample* from) {
+	into->operations += from->operations;
+	into->bytes += from->bytes;
+	into->totalNanoseconds += from->totalNanoseconds;
+	if (from->maxNanoseconds > into->maxNanoseconds) {
+		into->maxNanoseconds = from->maxNanoseconds;
+	}
+}
 
-	int fd = open(path, flags);
+// Records one operation of length bytes that took latency nanoseconds and ended at end
+void recordOperation(WorkerContext* context, size_t length, uint64_t latency, const struct timespec* end) {
+	recordLatency(&context->latencies, latency);
+	context->operations++;
+	context->bytes += length;
+	if (0 != config.intervalMilliseconds) {
+		size_t index = getElapsedNanoseconds(&context->runStart, end) / (uint64_t)(config.intervalMilliseconds * 1000000.0);
+		IntervalSample sample = {.operations = 1, .bytes = length, .totalNanoseconds = latency, .maxNanoseconds = latency};
+		addIntervalSample(getIntervalSample(&context->series, index), &sample);
+	}
+}
+
+void appendTraceRecord(Trace* trace, const TraceRecord* record) {
+	if (trace->count == trace->capacity) {
+		trace->capacity = (0 == trace->capacity) ? (INITIAL_TRACE_CAPACITY) : (trace->capacity * 2);
+		trace->records = realloc(trace->records, trace->capacity * sizeof(TraceRecord));
+		VERIFY(NULL != trace->records, "Out of memory for the trace\n", ECOutOfMemory);
+	}
+	trace->records[trace->count++] = *record;
+}
+
+int compareTraceRecords(const void* first, const void* second) {
+	const TraceRecord* firstRecord = first;
+	const TraceRecord* secondRecord = second;
+	if (firstRecord->timestampNanoseconds != secondRecord->timestampNanoseconds) {
+		return (firstRecord->timestampNanoseconds < secondRecord->timestampNanoseconds) ? (-1) : (1);
+	}
+	return 0;
+}
 
-	for (int i = 0; i < numberOfWrites; i++) {
-		off_t offsetInFile = getRandomOffsetInFile(writeSize);
-		seekResult = lseek(fd, offsetInFile, SEEK_SET);
-		VERIFY_ERRNO(-1 != seekResult, "Failed to seek to the correct location: %s\n", ECFailedToSeekRandomPosition);
+// Binary unless path ends with .csv
+void saveTrace(const char* path, const Trace* trace) {
+	size_t pathLength = strlen(path);
+	bool isCsv = (pathLength >= 4 && 0 == strcmp(path + pathLength - 4, ".csv"));
+	FILE* file = fopen(path, (isCsv) ? ("w") : ("wb"));
+	VERIFY_ERRNO(NULL != file, "Failed to create the trace: %s\n", ECFailedToWriteTrace);
 
-		writeResult = write(fd, buf, sizeof(buf));
+	if (isCsv) {
+		fprintf(file, "timestamp_ns,operation,offset,length\n");
+		for (size_t i = 0; i < trace->count; i++) {
+			const TraceRecord* record = &trace->records[i];
+			fprintf(file, "%llu,%s,%llu,%u\n", (unsigned long long)record->timestampNanoseconds, operationNames[record->operation],
+					(unsigned long long)record->offset, record->length);
+		}
+	}
+	else {
+		TraceHeader header = {.version = TRACE_VERSION, .recordSize = sizeof(TraceRecord)};
+		memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(trace->records, sizeof(TraceRecord), trace->count, file);
+	}
+	VERIFY(0 == ferror(file) && 0 == fclose(file), "Failed to write the trace\n", ECFailedToWriteTrace);
+}
+
+// The operationIndex'th operation of a thread, from its part of the trace when replaying - every thread takes every
+// threads'th record
+TraceRecord getOperation(WorkerContext* context, long long operationIndex) {
+	if (APReplay == config.pattern) {
+		return replayTrace.records[(operationIndex * config.threads) + context->index];
+	}
+	TraceRecord record = {.offset = getOffsetInRegion(context, operationIndex), .length = context->blockSize,
+						  .operation = config.operation};
+	return record;
+}
+
+// How long until a replayed record is due when keeping the trace's timing, 0 when it's due or timing isn't kept
+uint64_t getTimeUntilRecord(WorkerContext* context, const TraceRecord* record, const struct timespec* now) {
+	if (!config.shouldKeepTiming) {
+		return 0;
+	}
+	uint64_t elapsed = getElapsedNanoseconds(&context->runStart, now);
+	return (record->timestampNanoseconds > elapsed) ? (record->timestampNanoseconds - elapsed) : (0);
+}
+
+void sleepNanoseconds(uint64_t nanoseconds) {
+	struct timespec duration = {.tv_sec = nanoseconds / 1000000000ULL, .tv_nsec = nanoseconds % 1000000000ULL};
+	while (-1 == nanosleep(&duration, &duration) && EINTR == errno) {
+	}
+}
+
+void captureOperation(WorkerContext* context, const TraceRecord* record, const struct timespec* start) {
+	if (NULL != context->captured) {
+		TraceRecord captured = *record;
+		captured.timestampNanoseconds = getElapsedNanoseconds(&context->runStart, start);
+		appendTraceRecord(context->captured, &captured);
+	}
+}
+
+// One operation, mapping is the whole file in mmap mode
+void doOperation(int fd, char* mapping, char* buffer, const TraceRecord* record) {
+	if (NULL != mapping) {
+		if (OPWrite == record->operation) {
+			memcpy(mapping + record->offset, buffer, record->length);
+		}
+		else {
+			memcpy(buffer, mapping + record->offset, record->length);
+		}
+	}
+	else if (OPWrite == record->operation) {
+		ssize_t writeResult = pwrite(fd, buffer, record->length, record->offset);
 		VERIFY_ERRNO(-1 != writeResult, "Failed to write all the data to the file: %s\n", ECFailedToWriteAllData);
 	}
+	else {
+		ssize_t readResult = pread(fd, buffer, record->length, record->offset);
+		VERIFY_ERRNO(-1 != readResult, "Failed to read all the data from the file: %s\n", ECFailedToReadAllData);
+	}
+}
+
+void commitGroup(GroupCommit* group, int fd) {
+	pthread_mutex_lock(&group->lock);
+	long long ticket = group->writes;
+	while (group->syncedWrites < ticket) {
+		if (group->isSyncing) {
+			pthread_cond_wait(&group->synced, &group->lock);
+			continue;
+		}
+
+		// Note - Every write counted until now is done, so the sync covers all of them
+		long long target = group->writes;
+		group->isSyncing = true;
+		pthread_mutex_unlock(&group->lock);
+		VERIFY_ERRNO(0 == fdatasync(fd), "Failed to sync the file: %s\n", ECFailedToSync);
+		pthread_mutex_lock(&group->lock);
+		group->isSyncing = false;
+		group->syncedWrites = target;
+		pthread_cond_broadcast(&group->synced);
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+// Makes a thread's writes durable the way its durability mode says, isSyncPoint is every syncInterval writes and at
+// the end of the run, where there's no write and offset is -1
+void syncWrites(WorkerContext* context, off_t offset, size_t length, bool isSyncPoint) {
+	switch (context->durability) {
+		case DMFsync:
+			if (isSyncPoint) {
+				VERIFY_ERRNO(0 == fsync(context->fd), "Failed to sync the file: %s\n", ECFailedToSync);
+			}
+			break;
+		case DMFdatasync:
+			if (isSyncPoint) {
+				VERIFY_ERRNO(0 == fdatasync(context->fd), "Failed to sync the file: %s\n", ECFailedToSync);
+			}
+			break;
+		case DMSyncRange:
+			// Note - Writeback of every write starts right away and the sync point only waits for it. It doesn't flush
+			// the device's cache or the metadata, so it's durable only as far as the device's cache is
+			if (offset >= 0) {
+				VERIFY_ERRNO(0 == sync_file_range(context->fd, offset, length, SYNC_FILE_RANGE_WRITE),
+							 "Failed to start the writeback: %s\n", ECFailedToSync);
+			}
+			if (isSyncPoint) {
+				VERIFY_ERRNO(0 == sync_file_range(context->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+											   SYNC_FILE_RANGE_WAIT_AFTER), "Failed to wait for the writeback: %s\n", ECFailedToSync);
+			}
+			break;
+		case DMMsync:
+			if (isSyncPoint) {
+				// Note - msync needs a page aligned start
+				off_t start = context->regionStart & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+				VERIFY_ERRNO(0 == msync(context->mapping + start, context->regionStart + context->regionSize - start, MS_SYNC),
+							 "Failed to sync the mapping: %s\n", ECFailedToSync);
+			}
+			break;
+		case DMGroupCommit:
+			if (offset >= 0) {
+				pthread_mutex_lock(&context->groupCommit->lock);
+				context->groupCommit->writes++;
+				pthread_mutex_unlock(&context->groupCommit->lock);
+			}
+			if (isSyncPoint) {
+				commitGroup(context->groupCommit, context->fd);
+			}
+			break;
+		default:
+			// Note - O_DSYNC and O_SYNC make every write durable by themselves
+			break;
+	}
+}
+
+bool shouldStopWorker(WorkerContext* context, long long operationsStarted, const struct timespec* start, const struct timespec* now) {
+	if (APReplay == config.pattern && (size_t)((operationsStarted * config.threads) + context->index) >= replayTrace.count) {
+		return true;
+	}
+	if (0 != config.secondsPerRun) {
+		return (getElapsedMicroseconds(start, now) >= config.secondsPerRun * 1000000.0);
+	}
+	// Note - A replay without a time limit is all of its trace
+	return (APReplay != config.pattern && (operationsStarted * (long long)context->blockSize) >= context->bytesToMove);
+}
+
+// Queue depth 1, every operation waits for the previous one
+void runSyncOperations(WorkerContext* context, const struct timespec* start) {
+	struct timespec operationStart = {0};
+	struct timespec operationEnd = *start;
 
+	// Note - The end of the last operation is the current time, no need to ask for it again
+	while (!shouldStopWorker(context, context->operations, start, &operationEnd)) {
+		TraceRecord record = getOperation(context, context->operations);
+		uint64_t wait = getTimeUntilRecord(context, &record, &operationEnd);
+		if (0 != wait) {
+			sleepNanoseconds(wait);
+		}
+
+		clock_gettime(BENCHMARK_CLOCK, &operationStart);
+		doOperation(context->fd, context->mapping, context->buffers, &record);
+		if (OPWrite == record.operation) {
+			syncWrites(context, record.offset, record.length, 0 == ((context->operations + 1) % config.syncInterval));
+		}
+		clock_gettime(BENCHMARK_CLOCK, &operationEnd);
+
+		captureOperation(context, &record, &operationStart);
+		recordOperation(context, record.length, getElapsedNanoseconds(&operationStart, &operationEnd), &operationEnd);
+	}
+
+	// Note - The writes after the last sync point become durable too, in the run's time but no operation's latency
+	if (0 != (context->operations % config.syncInterval)) {
+		syncWrites(context, -1, 0, true);
+	}
+}
+
+// Keeps queueDepth operations in flight with the kernel's AIO, the latency of an operation is from its submission to
+// its completion. Note - AIO is only really asynchronous with O_DIRECT, buffered operations complete in io_submit
+void runAsyncOperations(WorkerContext* context, const struct timespec* start) {
+	int depth = config.queueDepth;
+	aio_context_t aioContext = 0;
+	struct iocb requests[depth];
+	struct iocb* toSubmit[depth];
+	struct timespec submitTimes[depth];
+	struct io_event events[depth];
+	int freeSlots[depth];
+	int freeCount = depth;
+	int inFlight = 0;
+	long long started = 0;
+	struct timespec now = *start;
+
+	VERIFY_ERRNO(0 == syscall(__NR_io_setup, depth, &aioContext), "Failed to set up AIO: %s\n", ECFailedToSetupAio);
+	for (int i = 0; i < depth; i++) {
+		freeSlots[i] = i;
+	}
+
+	while (true) {
+		int submitCount = 0;
+		// Note - When keeping a trace's timing, the time until its next record is due, that long is all the waiting
+		// for completions can take
+		uint64_t wait = 0;
+		while (freeCount > 0 && !shouldStopWorker(context, started, start, &now)) {
+			TraceRecord record = getOperation(context, started);
+			wait = getTimeUntilRecord(context, &record, &now);
+			if (0 != wait) {
+				break;
+			}
+
+			int slot = freeSlots[--freeCount];
+			struct iocb* request = &requests[slot];
+			memset(request, 0, sizeof(*request));
+			request->aio_lio_opcode = (OPWrite == record.operation) ? (IOCB_CMD_PWRITE) : (IOCB_CMD_PREAD);
+			request->aio_fildes = context->fd;
+			request->aio_buf = (uintptr_t)(context->buffers + ((size_t)slot * context->blockSize));
+			request->aio_nbytes = record.length;
+			request->aio_offset = record.offset;
+			request->aio_data = slot;
+			captureOperation(context, &record, &now);
+			toSubmit[submitCount++] = request;
+			started++;
+		}
+
+		clock_gettime(BENCHMARK_CLOCK, &now);
+		for (int submitted = 0; submitted < submitCount; ) {
+			long result = syscall(__NR_io_submit, aioContext, submitCount - submitted, &toSubmit[submitted]);
+			if (-1 == result && EINTR == errno) {
+				continue;
+			}
+			VERIFY_ERRNO(result > 0, "Failed to submit the AIO requests: %s\n", ECFailedToSubmitAio);
+			for (int i = submitted; i < submitted + result; i++) {
+				submitTimes[toSubmit[i]->aio_data] = now;
+			}
+			submitted += result;
+		}
+		inFlight += submitCount;
+
+		if (0 == inFlight && 0 == wait) {
+			break;
+		}
+		if (0 == inFlight) {
+			sleepNanoseconds(wait);
+			clock_gettime(BENCHMARK_CLOCK, &now);
+			continue;
+		}
+
+		struct timespec timeout = {.tv_sec = wait / 1000000000ULL, .tv_nsec = wait % 1000000000ULL};
+		long completed = syscall(__NR_io_getevents, aioContext, 1, depth, events, (0 != wait) ? (&timeout) : (NULL));
+		if (-1 == completed && EINTR == errno) {
+			continue;
+		}
+		VERIFY_ERRNO(completed >= 0, "Failed to get the AIO completions: %s\n", ECFailedToGetAioEvents);
+		clock_gettime(BENCHMARK_CLOCK, &now);
+
+		for (long i = 0; i < completed; i++) {
+			int slot = (int)events[i].data;
+			if (events[i].res < 0) {
+				errno = -events[i].res;
+				VERIFY_ERRNO(false, "An AIO request failed: %s\n", (IOCB_CMD_PWRITE == requests[slot].aio_lio_opcode) ?
+							 (ECFailedToWriteAllData) : (ECFailedToReadAllData));
+			}
+			recordOperation(context, events[i].res, getElapsedNanoseconds(&submitTimes[slot], &now), &now);
+			freeSlots[freeCount++] = slot;
+		}
+		inFlight -= completed;
+	}
+
+	syscall(__NR_io_destroy, aioContext);
+}
+
+void* benchmarkWorker(void* argument) {
+	WorkerContext* context = argument;
+	struct timespec start = {0};
+	struct timespec end = {0};
+
+	VERIFY_ERRNO(0 == clock_gettime(BENCHMARK_CLOCK, &start), "Error getting start time: %s\n", ECFailedToGetTimeStart);
+	if (config.queueDepth > 1) {
+		runAsyncOperations(context, &start);
+	}
+	else {
+		runSyncOperations(context, &start);
+	}
+	VERIFY_ERRNO(0 == clock_gettime(BENCHMARK_CLOCK, &end), "Error getting end time: %s\n", ECFailedToGetTimeEnd);
+
+	context->seconds = getElapsedMicroseconds(&start, &end) / 1000000.0;
+	return NULL;
+}
+
+// Runs the configured pattern once on the file with all the threads and adds what they measured to result
+void runBenchmark(const char * path, IOMode mode, size_t blockSize, BenchmarkResult* result) {
+	struct timespec start = {0};
+	struct timespec end = {0};
+	char* mapping = NULL;
+	struct rusage usageStart = {0};
+	struct rusage usageEnd = {0};
+	pthread_t threads[config.threads];
+	TimeSeries runSeries = {0};
+	// Note - Only the first run is captured, the rest have the same pattern
+	bool shouldCapture = (NULL != config.capturePath && !isTraceCaptured);
+	Trace* captured = NULL;
+
+	// Note - Every context has its own histogram, too much for the stack with many threads
+	WorkerContext* contexts = calloc(config.threads, sizeof(WorkerContext));
+	VERIFY(NULL != contexts, "Failed to allocate the thread contexts\n", ECOutOfMemory);
+	if (shouldCapture) {
+		captured = calloc(config.threads, sizeof(Trace));
+		VERIFY(NULL != captured, "Failed to allocate the captured traces\n", ECOutOfMemory);
+	}
+
+	GroupCommit groupCommit = {.lock = PTHREAD_MUTEX_INITIALIZER, .synced = PTHREAD_COND_INITIALIZER};
+
+	int flags = (IMDirect == mode) ? (O_RDWR | O_DIRECT) : (O_RDWR);
+	flags |= (DMDsync == result->durability) ? (O_DSYNC) : ((DMSync == result->durability) ? (O_SYNC) : (0));
+	int fd = open(path, flags);
+	VERIFY_ERRNO(-1 != fd, "Failed to open the file for the benchmark: %s\n", ECFailedToOpenForBenchmark);
+
+	if (IMMmap == mode) {
+		// Note - MAP_POPULATE faults all of the file in here, before the run, but maps the pages read only. Reads have no
+		// faults left, the first store to every page of the shared mapping still takes a (minor) write fault
+		int mapFlags = (config.shouldPopulate) ? (MAP_SHARED | MAP_POPULATE) : (MAP_SHARED);
+		mapping = mmap(NULL, config.fileSize, PROT_READ | PROT_WRITE, mapFlags, fd, 0);
+		VERIFY_ERRNO(MAP_FAILED != mapping, "Failed to map the file: %s\n", ECFailedToMapFile);
+		if (MANormal != config.mapAdvice) {
+			VERIFY_ERRNO(0 == madvise(mapping, config.fileSize, mapAdviceValues[config.mapAdvice]), "Failed to advise the mapping: %s\n",
+						 ECFailedToMapFile);
+		}
+	}
+
+	// Note - Disjoint regions give every thread its own slice of the file, shared ones let all of them use all of it.
+	// A replayed trace goes wherever it goes
+	off_t regionSize = (config.fileSize / blockSize) * blockSize;
+	if (RMDisjoint == config.regionMode && APReplay != config.pattern) {
+		regionSize = ((config.fileSize / config.threads) / blockSize) * blockSize;
+		VERIFY(regionSize >= (off_t)blockSize, "The file is too small to give every thread a block\n", ECBadArgument);
+	}
+
+	for (int i = 0; i < config.threads; i++) {
+		WorkerContext* context = &contexts[i];
+		context->index = i;
+		context->blockSize = blockSize;
+		context->durability = result->durability;
+		context->groupCommit = &groupCommit;
+		context->fd = fd;
+		context->mapping = mapping;
+		context->regionStart = (RMDisjoint == config.regionMode && APReplay != config.pattern) ? (i * regionSize) : (0);
+		context->regionSize = regionSize;
+		context->bytesToMove = config.bytesPerRun / config.threads;
+		seedRandom(context->randomState, (uint64_t)random());
+		context->captured = (shouldCapture) ? (&captured[i]) : (NULL);
+		context->buffers = aligned_alloc(BUFFER_ALIGNMENT, config.queueDepth * blockSize);
+		VERIFY(NULL != context->buffers, "Failed to allocate the thread's buffers\n", ECOutOfMemory);
+		for (int slot = 0; slot < config.queueDepth; slot++) {
+			memcpy(context->buffers + ((size_t)slot * blockSize), buf, blockSize);
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &usageStart);
+	VERIFY_ERRNO(0 == clock_gettime(BENCHMARK_CLOCK, &start), "Error getting start time: %s\n", ECFailedToGetTimeStart);
+	for (int i = 0; i < config.threads; i++) {
+		contexts[i].runStart = start;
+		errno = pthread_create(&threads[i], NULL, benchmarkWorker, &contexts[i]);
+		VERIFY_ERRNO(0 == errno, "Failed to create a benchmark thread: %s\n", ECFailedToCreateThread);
+	}
+	for (int i = 0; i < config.threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	getrusage(RUSAGE_SELF, &usageEnd);
+	result->minorFaults += usageEnd.ru_minflt - usageStart.ru_minflt;
+	result->majorFaults += usageEnd.ru_majflt - usageStart.ru_majflt;
+
+	if (NULL != mapping) {
+		munmap(mapping, config.fileSize);
+	}
 	close(fd);
 
-	VERIFY_ERRNO(0 == gettimeofday(&end, NULL), "Error getting end time: %s\n", ECFailedToGetTimeEnd);
+	VERIFY_ERRNO(0 == clock_gettime(BENCHMARK_CLOCK, &end), "Error getting end time: %s\n", ECFailedToGetTimeEnd);
 
-	long seconds  = end.tv_sec  - start.tv_sec;
-    long useconds = end.tv_usec - start.tv_usec;
-    long mtime = (seconds*1000 + useconds/1000.0);
-    return mtime;
+	for (int i = 0; i < config.threads; i++) {
+		result->operations += contexts[i].operations;
+		result->bytes += contexts[i].bytes;
+		result->threadOperations[i] += contexts[i].operations;
+		result->threadBytes[i] += contexts[i].bytes;
+		result->threadSeconds[i] += contexts[i].seconds;
+		mergeHistogram(&result->latencies, &contexts[i].latencies);
+		for (size_t interval = 0; interval < contexts[i].series.count; interval++) {
+			addIntervalSample(getIntervalSample(&runSeries, interval), &contexts[i].series.samples[interval]);
+		}
+		free(contexts[i].series.samples);
+		free(contexts[i].buffers);
+	}
+	free(contexts);
+
+	if (shouldCapture) {
+		Trace trace = {0};
+		for (int i = 0; i < config.threads; i++) {
+			for (size_t record = 0; record < captured[i].count; record++) {
+				appendTraceRecord(&trace, &captured[i].records[record]);
+			}
+			free(captured[i].records);
+		}
+		qsort(trace.records, trace.count, sizeof(TraceRecord), compareTraceRecords);
+		saveTrace(config.capturePath, &trace);
+		isTraceCaptured = true;
+		free(trace.records);
+		free(captured);
+	}
+
+	size_t firstInterval = result->series.count;
+	for (size_t interval = 0; interval < runSeries.count; interval++) {
+		addIntervalSample(getIntervalSample(&result->series, firstInterval + interval), &runSeries.samples[interval]);
+	}
+	free(runSeries.samples);
+	result->seconds += getElapsedMicroseconds(&start, &end) / 1000000.0;
 }
 
-void printWriteStatistics(const char* path, size_t writeSize) {
-	double timeWithDirect = 0;
-	double timeWithoutDirect = 0;
+void printThreadResults(const BenchmarkResult* result, const char* prefix) {
+	for (int i = 0; i < config.threads; i++) {
+		double seconds = result->threadSeconds[i];
+		double iops = (seconds > 0) ? (result->threadOperations[i] / seconds) : (0);
+		double throughput = (seconds > 0) ? ((result->threadBytes[i] / (double)MEGABYTE(1)) / seconds) : (0);
 
-	for (int i = 0; i < NUMBER_OF_TESTS_FOR_AVEREGE; i++) {
-		makeGlobalBufferRandom(writeSize);
-		timeWithDirect += rewriteFile(path, true, writeSize);
-		makeGlobalBufferRandom(writeSize);
-		timeWithoutDirect += rewriteFile(path, false, writeSize);
+		switch (config.format) {
+			case OFCsv:
+				printf("%s%d,%lld,%lld,%f,%f,%f,,,,,,,\n", prefix, i, result->threadOperations[i],
+					   result->threadBytes[i], seconds, iops, throughput);
+				break;
+			case OFJson:
+				printf("%s{\"thread\": %d, \"operations\": %lld, \"seconds\": %f, \"iops\": %f, \"mb_per_second\": %f}",
+					   (0 == i) ? ("") : (", "), i, result->threadOperations[i], seconds, iops, throughput);
+				break;
+			default:
+				printf("  thread %d: %.0f IOPS, %.2f MB/s\n", i, iops, throughput);
+				break;
+		}
 	}
+}
+
+// Every interval of the time series, the seconds of an interval are when it started
+void printTimeSeries(const BenchmarkResult* result, const char* prefix) {
+	double intervalSeconds = config.intervalMilliseconds / 1000.0;
 
-	double averageTimeDirect = timeWithDirect/NUMBER_OF_TESTS_FOR_AVEREGE;
-	double throughputDirect = MEGABYTE(256) / MEGABYTE(averageTimeDirect);
-	double averageTimeNoDirect = timeWithoutDirect/NUMBER_OF_TESTS_FOR_AVEREGE;
-	double throughputNoDirect = MEGABYTE(256) / MEGABYTE(averageTimeNoDirect);
-	printf("Average time for write size %d with direct is %f and thoughput is %f\n", writeSize, averageTimeDirect, throughputDirect);
-	printf("Average time for write size %d without direct is %f and thoughput is %f\n", writeSize, averageTimeNoDirect, throughputNoDirect);
+	for (size_t i = 0; i < result->series.count; i++) {
+		const IntervalSample* sample = &result->series.samples[i];
+		double iops = sample->operations / intervalSeconds;
+		double throughput = (sample->bytes / (double)MEGABYTE(1)) / intervalSeconds;
+		double average = (0 != sample->operations) ? ((sample->totalNanoseconds / 1000.0) / sample->operations) : (0);
+		double max = sample->maxNanoseconds / 1000.0;
+
+		switch (config.format) {
+			case OFCsv:
+				printf("%sinterval,%lld,%lld,%f,%f,%f,,,,,%f,,\n", prefix, sample->operations,
+					   sample->bytes, i * intervalSeconds, iops, throughput, max);
+				break;
+			case OFJson:
+				printf("%s{\"start_seconds\": %f, \"operations\": %lld, \"iops\": %f, \"mb_per_second\": %f, "
+					   "\"average_us\": %f, \"max_us\": %f}", (0 == i) ? ("") : (", "), i * intervalSeconds, sample->operations,
+					   iops, throughput, average, max);
+				break;
+			default:
+				printf("  at %.3fs: %.0f IOPS, %.2f MB/s, latency average %.1fus max %.1fus\n", i * intervalSeconds, iops,
+					   throughput, average, max);
+				break;
+		}
+	}
 }
 
-int main(int argc, char const *argv[])
+// Like "fdatasync every 8 writes", or just the mode's name for the ones that don't sync
+void describeDurability(DurabilityMode durability, char* description, size_t size) {
+	if (durability >= DMFsync) {
+		snprintf(description, size, "%s every %d writes", durabilityModeNames[durability], config.syncInterval);
+	}
+	else {
+		snprintf(description, size, "%s", durabilityModeNames[durability]);
+	}
+}
+
+void printResult(const BenchmarkResult* result, bool isFirst) {
+	double iops = (result->seconds > 0) ? (result->operations / result->seconds) : (0);
+	double throughput = (result->seconds > 0) ? ((result->bytes / (double)MEGABYTE(1)) / result->seconds) : (0);
+	double p50 = getPercentile(&result->latencies, 50);
+	double p90 = getPercentile(&result->latencies, 90);
+	double p99 = getPercentile(&result->latencies, 99);
+	double p999 = getPercentile(&result->latencies, 99.9);
+	double max = result->latencies.maxNanoseconds / 1000.0;
+	const char* pattern = accessPatternNames[config.pattern];
+	// Note - A trace can have both
+	const char* operation = (APReplay == config.pattern) ? ("mixed") : (operationNames[config.operation]);
+	const char* mode = ioModeNames[result->mode];
+	const char* durabilityName = durabilityModeNames[result->durability];
+	int syncInterval = (result->durability >= DMFsync) ? (config.syncInterval) : (0);
+	char durability[64] = {0};
+	char prefix[256] = {0};
+
+	describeDurability(result->durability, durability, sizeof(durability));
+
+	switch (config.format) {
+		case OFCsv:
+			if (isFirst) {
+				printf("pattern,operation,mode,durability,sync_interval,block_size,threads,queue_depth,thread,operations,bytes,seconds,iops,mb_per_second,"
+					   "p50_us,p90_us,p99_us,p99.9_us,max_us,minor_faults,major_faults\n");
+			}
+			snprintf(prefix, sizeof(prefix), "%s,%s,%s,%s,%d,%zu,%d,%d,", pattern, operation, mode, durabilityName, syncInterval,
+					 result->blockSize, config.threads, config.queueDepth);
+			printf("%sall,%lld,%lld,%f,%f,%f,%f,%f,%f,%f,%f,%ld,%ld\n", prefix, result->operations, result->bytes, result->seconds,
+				   iops, throughput, p50, p90, p99, p999, max, result->minorFaults, result->majorFaults);
+			if (config.threads > 1) {
+				printThreadResults(result, prefix);
+			}
+			printTimeSeries(result, prefix);
+			break;
+		case OFJson:
+			printf("%s\n  {\"pattern\": \"%s\", \"operation\": \"%s\", \"mode\": \"%s\", \"durability\": \"%s\", "
+				   "\"sync_interval\": %d, \"block_size\": %zu, \"threads\": %d, \"queue_depth\": %d, \"operations\": %lld, \"bytes\": %lld, \"seconds\": %f, \"iops\": %f, \"mb_per_second\": %f, "
+				   "\"p50_us\": %f, \"p90_us\": %f, \"p99_us\": %f, \"p99.9_us\": %f, \"max_us\": %f, \"minor_faults\": %ld, "
+				   "\"major_faults\": %ld, \"per_thread\": [",
+				   (isFirst) ? ("[") : (","), pattern, operation, mode, durabilityName, syncInterval, result->blockSize, config.threads, config.queueDepth,
+				   result->operations, result->bytes, result->seconds, iops, throughput, p50, p90, p99, p999, max, result->minorFaults,
+				   result->majorFaults);
+			printThreadResults(result, "");
+			printf("], \"time_series\": [");
+			printTimeSeries(result, "");
+			printf("]}");
+			break;
+		default:
+			printf("%s %s of %zu bytes with %s (%d threads, queue depth %d, durability %s): %.0f IOPS, %.2f MB/s, latency "
+				   "p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus, page faults %ld minor %ld major\n", pattern, operation,
+				   result->blockSize, mode, config.threads, config.queueDepth, durability, iops, throughput, p50, p90, p99, p999, max,
+				   result->minorFaults, result->majorFaults);
+			if (config.threads > 1) {
+				printThreadResults(result, "");
+			}
+			printTimeSeries(result, "");
+			break;
+	}
+	fflush(stdout);
+}
+
+// Note - The open flags don't apply to stores into a mapping and msync applies to nothing else
+bool isDurabilityForMode(IOMode mode, DurabilityMode durability) {
+	if (IMMmap == mode) {
+		return (DMDsync != durability && DMSync != durability);
+	}
+	return (DMMsync != durability);
+}
+
+void printStatistics(const char* path, size_t blockSize, bool isFirst) {
+	for (IOMode mode = 0; mode < IMCount; mode++) {
+		for (DurabilityMode durability = 0; durability < DMCount; durability++) {
+			if (!config.modes[mode] || !config.durabilityModes[durability] || !isDurabilityForMode(mode, durability)) {
+				continue;
+			}
+
+			BenchmarkResult result = {.blockSize = blockSize, .mode = mode, .durability = durability};
+			for (int i = 0; i < config.repetitions; i++) {
+				makeGlobalBufferRandom(blockSize);
+				runBenchmark(path, mode, blockSize, &result);
+			}
+
+			printResult(&result, isFirst);
+			isFirst = false;
+			free(result.series.samples);
+		}
+	}
+}
+
+// Parses a size like 4096, 4K or 16M
+size_t parseSize(const char* text) {
+	char* end = NULL;
+	size_t size = strtoull(text, &end, 10);
+	if ('K' == *end || 'k' == *end) {
+		size = KILOBYTE(size);
+	}
+	else if ('M' == *end || 'm' == *end) {
+		size = MEGABYTE(size);
+	}
+	else if ('G' == *end || 'g' == *end) {
+		size = MEGABYTE(size) * 1024;
+	}
+	return size;
+}
+
+// Finds text in names, exits with a usage error if it isn't there
+int parseName(const char* text, const char** names, int count, const char* what) {
+	for (int i = 0; i < count; i++) {
+		if (0 == strcmp(text, names[i])) {
+			return i;
+		}
+	}
+	printf("Unknown %s: %s\n", what, text);
+	exit((int)ECBadArgument);
+}
+
+void printUsage(const char* programPath) {
+	printf("Usage: %s [options] <file>\n", programPath);
+	printf("  -p pattern    sequential, random or strided (default random)\n");
+	printf("  -S stride     The distance between strided operations (default twice the block size)\n");
+	printf("  -o operation  write or read (default write)\n");
+	printf("  -b sizes      Comma separated block sizes from 512 to 16M (default 1M)\n");
+	printf("  -m modes      Comma separated modes out of direct, buffered and mmap (default direct,buffered)\n");
+	printf("  -d modes      Comma separated durability modes of writes out of none, dsync (O_DSYNC), sync (O_SYNC), fsync,\n"
+		   "                fdatasync, sync_range (sync_file_range), group (threads share fdatasyncs) and msync (default none).\n"
+		   "                Every mode runs with the ones that apply to it, dsync and sync aren't for mmap and msync is only for it\n");
+	printf("  -e writes     The writes between syncs of fsync, fdatasync, sync_range, group and msync (default 1)\n");
+	printf("  -P            Populate the mapping of mmap up front (MAP_POPULATE), writes still fault on every page\n");
+	printf("  -a advice     The madvise of the mapping of mmap, normal, random, sequential, willneed or hugepage\n");
+	printf("  -t seconds    Run every test for this long instead of a fixed amount of data\n");
+	printf("  -s size       The size of the file, made up of random data (default 256M)\n");
+	printf("  -n bytes      The data every test moves (default the file size)\n");
+	printf("  -r count      The repetitions of every test (default %d)\n", NUMBER_OF_TESTS_FOR_AVEREGE);
+	printf("  -T threads    The threads doing operations at the same time (default 1)\n");
+	printf("  -q depth      The operations every thread keeps in flight with AIO (default 1, best with direct)\n");
+	printf("  -R regions    disjoint (every thread has its own part of the file) or shared (default disjoint)\n");
+	printf("  -x trace      Replay the operations of a trace (binary or CSV of timestamp_ns,operation,offset,length) instead\n"
+		   "                of a pattern, its largest operation is the block size and the file grows to fit it. direct needs\n"
+		   "                the trace's offsets and lengths aligned to 512\n");
+	printf("  -k            Keep the timing of the replayed trace instead of replaying it as fast as possible\n");
+	printf("  -w trace      Capture the operations of the first run to a trace, CSV if its name ends with .csv\n");
+	printf("  -i ms         Also print a time series of the throughput and latency in intervals of this length\n");
+	printf("  -f format     text, csv or json (default text)\n");
+}
+
+// A trace file is binary if it starts with TRACE_MAGIC, otherwise it's CSV lines of timestamp_ns,operation,offset,length
+void loadTrace(const char* path, Trace* trace) {
+	FILE* file = fopen(path, "rb");
+	VERIFY_ERRNO(NULL != file, "Failed to open the trace: %s\n", ECFailedToReadTrace);
+
+	TraceHeader header = {0};
+	if (1 == fread(&header, sizeof(header), 1, file) && 0 == memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) {
+		VERIFY(TRACE_VERSION == header.version && sizeof(TraceRecord) == header.recordSize, "Unknown trace version\n",
+			   ECFailedToReadTrace);
+		TraceRecord record = {0};
+		while (1 == fread(&record, sizeof(record), 1, file)) {
+			appendTraceRecord(trace, &record);
+		}
+	}
+	else {
+		char line[256] = {0};
+		char operation[16] = {0};
+		unsigned long long timestamp = 0;
+		unsigned long long offset = 0;
+		unsigned int length = 0;
+
+		rewind(file);
+		while (NULL != fgets(line, sizeof(line), file)) {
+			// Note - The header line and anything else that isn't a record
+			if (4 != sscanf(line, "%llu,%15[^,],%llu,%u", &timestamp, operation, &offset, &length)) {
+				continue;
+			}
+			TraceRecord record = {.timestampNanoseconds = timestamp, .offset = offset, .length = length,
+								  .operation = parseName(operation, operationNames, OPCount, "trace operation")};
+			appendTraceRecord(trace, &record);
+		}
+	}
+	VERIFY(0 == ferror(file), "Failed to read the trace\n", ECFailedToReadTrace);
+	fclose(file);
+
+	VERIFY(trace->count > 0, "The trace has no operations\n", ECFailedToReadTrace);
+	for (size_t i = 0; i < trace->count; i++) {
+		VERIFY(trace->records[i].length > 0 && trace->records[i].length <= MAX_BLOCK_SIZE && trace->records[i].operation < OPCount,
+			   "The trace has an operation that isn't a read or write of 1 byte to 16M\n", ECFailedToReadTrace);
+	}
+}
+
+// Loads the trace and makes the block size its largest operation and the file big enough for all of them
+void useReplayTrace() {
+	size_t largest = 0;
+	off_t end = 0;
+
+	loadTrace(config.replayPath, &replayTrace);
+	for (size_t i = 0; i < replayTrace.count; i++) {
+		const TraceRecord* record = &replayTrace.records[i];
+		largest = (record->length > largest) ? (record->length) : (largest);
+		end = ((off_t)(record->offset + record->length) > end) ? ((off_t)(record->offset + record->length)) : (end);
+	}
+
+	config.blockSizes[0] = ((largest + MIN_BLOCK_SIZE - 1) / MIN_BLOCK_SIZE) * MIN_BLOCK_SIZE;
+	config.blockSizeCount = 1;
+	config.fileSize = (end > config.fileSize) ? (end) : (config.fileSize);
+}
+
+void parseArguments(int argc, char* const argv[]) {
+	int option = 0;
+	char* token = NULL;
+
+	while (-1 != (option = getopt(argc, argv, "p:S:o:b:m:d:e:Pa:t:s:n:r:T:q:R:x:kw:i:f:"))) {
+		switch (option) {
+			case 'p':
+				config.pattern = parseName(optarg, accessPatternNames, APCount, "pattern");
+				break;
+			case 'S':
+				config.stride = parseSize(optarg);
+				break;
+			case 'o':
+				config.operation = parseName(optarg, operationNames, OPCount, "operation");
+				break;
+			case 'b':
+				config.blockSizeCount = 0;
+				for (token = strtok(optarg, ","); NULL != token; token = strtok(NULL, ",")) {
+					VERIFY(config.blockSizeCount < MAX_BLOCK_SIZES, "Too many block sizes\n", ECBadArgument);
+					size_t blockSize = parseSize(token);
+					VERIFY(blockSize >= MIN_BLOCK_SIZE && blockSize <= MAX_BLOCK_SIZE && 0 == (blockSize % MIN_BLOCK_SIZE),
+						   "Block sizes must be multiples of 512 from 512 to 16M\n", ECBadArgument);
+					config.blockSizes[config.blockSizeCount++] = blockSize;
+				}
+				break;
+			case 'm':
+				memset(config.modes, 0, sizeof(config.modes));
+				for (token = strtok(optarg, ","); NULL != token; token = strtok(NULL, ",")) {
+					config.modes[parseName(token, ioModeNames, IMCount, "mode")] = true;
+				}
+				break;
+			case 'd':
+				memset(config.durabilityModes, 0, sizeof(config.durabilityModes));
+				for (token = strtok(optarg, ","); NULL != token; token = strtok(NULL, ",")) {
+					config.durabilityModes[parseName(token, durabilityModeNames, DMCount, "durability mode")] = true;
+				}
+				break;
+			case 'e':
+				config.syncInterval = atoi(optarg);
+				break;
+			case 'P':
+				config.shouldPopulate = true;
+				break;
+			case 'a':
+				config.mapAdvice = parseName(optarg, mapAdviceNames, MACount, "advice");
+				break;
+			case 't':
+				config.secondsPerRun = atof(optarg);
+				break;
+			case 's':
+				config.fileSize = parseSize(optarg);
+				break;
+			case 'n':
+				config.bytesPerRun = parseSize(optarg);
+				break;
+			case 'r':
+				config.repetitions = atoi(optarg);
+				break;
+			case 'T':
+				config.threads = atoi(optarg);
+				break;
+			case 'q':
+				config.queueDepth = atoi(optarg);
+				break;
+			case 'R':
+				config.regionMode = parseName(optarg, regionModeNames, RMCount, "region mode");
+				break;
+			case 'x':
+				config.replayPath = optarg;
+				config.pattern = APReplay;
+				break;
+			case 'k':
+				config.shouldKeepTiming = true;
+				break;
+			case 'w':
+				config.capturePath = optarg;
+				break;
+			case 'i':
+				config.intervalMilliseconds = atof(optarg);
+				break;
+			case 'f':
+				config.format = parseName(optarg, outputFormatNames, OFCount, "output format");
+				break;
+			default:
+				printUsage(argv[0]);
+				exit((int)ECBadArgument);
+		}
+	}
+
+	if (argc - optind != 1) {
+		printUsage(argv[0]);
+		exit((int)ECBadArgumentCount);
+	}
+	VERIFY((APReplay == config.pattern) == (NULL != config.replayPath), "The replay pattern is set by giving a trace\n", ECBadArgument);
+	VERIFY(!config.shouldKeepTiming || NULL != config.replayPath, "Only a replayed trace has timing to keep\n", ECBadArgument);
+	if (NULL != config.replayPath) {
+		useReplayTrace();
+	}
+	VERIFY(config.blockSizeCount > 0 && config.repetitions > 0, "Need at least one block size and repetition\n", ECBadArgument);
+	VERIFY(config.modes[IMDirect] || config.modes[IMBuffered] || config.modes[IMMmap], "Need at least one mode\n", ECBadArgument);
+	bool isDurable = false;
+	for (DurabilityMode durability = DMDsync; durability < DMCount; durability++) {
+		isDurable = isDurable || config.durabilityModes[durability];
+	}
+	VERIFY(!isDurable || OPWrite == config.operation, "Durability modes are only for writes\n", ECBadArgument);
+	VERIFY(config.syncInterval > 0, "The sync interval must be at least 1\n", ECBadArgument);
+	// Note - AIO has no syncs of its own here
+	VERIFY(1 == config.queueDepth || !(config.durabilityModes[DMFsync] || config.durabilityModes[DMFdatasync] ||
+		   config.durabilityModes[DMSyncRange] || config.durabilityModes[DMGroupCommit]),
+		   "Syncing durability modes need a queue depth of 1\n", ECBadArgument);
+	// Note - The interval is counted in whole nanoseconds, below one it would divide by zero
+	VERIFY(0 == config.intervalMilliseconds || config.intervalMilliseconds >= 0.001,
+		   "The time series interval must be 0 or at least 0.001 milliseconds\n", ECBadArgument);
+	VERIFY(config.threads > 0 && config.threads <= MAX_THREADS, "Threads must be from 1 to 256\n", ECBadArgument);
+	VERIFY(config.queueDepth > 0 && config.queueDepth <= MAX_QUEUE_DEPTH, "Queue depth must be from 1 to 1024\n", ECBadArgument);
+	VERIFY(1 == config.queueDepth || !config.modes[IMMmap], "mmap has no queue, it can't use a queue depth\n", ECBadArgument);
+	bool hasTest = false;
+	for (IOMode mode = 0; mode < IMCount; mode++) {
+		for (DurabilityMode durability = 0; durability < DMCount; durability++) {
+			hasTest = hasTest || (config.modes[mode] && config.durabilityModes[durability] && isDurabilityForMode(mode, durability));
+		}
+	}
+	VERIFY(hasTest, "None of the durability modes apply to the chosen modes\n", ECBadArgument);
+	for (int i = 0; i < config.blockSizeCount; i++) {
+		VERIFY(config.fileSize >= (off_t)config.blockSizes[i], "The file must fit every block size\n", ECBadArgument);
+	}
+	config.bytesPerRun = (0 != config.bytesPerRun) ? (config.bytesPerRun) : (config.fileSize);
+}
+
+void allocateGlobalBuffer() {
+	bufSize = MEGABYTE(1);
+	for (int i = 0; i < config.blockSizeCount; i++) {
+		bufSize = (config.blockSizes[i] > bufSize) ? (config.blockSizes[i]) : (bufSize);
+	}
+
+	// Note - O_DIRECT needs the buffer aligned to the device's block
+	buf = aligned_alloc(BUFFER_ALIGNMENT, bufSize);
+	VERIFY(NULL != buf, "Failed to allocate the data buffer\n", ECOutOfMemory);
+}
+
+int main(int argc, char *argv[])
 {
-	VERIFY(argc == ParameterCount, "Bad parameter count\n", ECBadArgumentCount);
+	parseArguments(argc, argv);
+	allocateGlobalBuffer();
+	seedRandom(globalRandomState, (uint64_t)random());
+	statusOutput = (OFText == config.format) ? (stdout) : (stderr);
 
-	const char * filePath = argv[TargetFile];
+	const char * filePath = argv[optind];
 
 	if (doesFileExist(filePath)) {
-		printf("Input file exists\n");
+		fprintf(statusOutput, "Input file exists\n");
 		FileType fileType = getFileType(filePath);
 		printFileType(fileType);
 		VERIFY(FTDir != fileType, "Can't add data to a directory\n", ECFileIsADirectory);
-		makeFileSize(filePath, TARGET_FILE_SIZE);
+		makeFileSize(filePath, config.fileSize);
 	}
 	else {
-		printf("Input file does not exist\n");
-		makeFileSize(filePath, TARGET_FILE_SIZE);
+		fprintf(statusOutput, "Input file does not exist\n");
+		makeFileSize(filePath, config.fileSize);
+	}
+
+	// Note - The graph's sweep is now just -b 1M,256K,64K,16K,4K
+	for (int i = 0; i < config.blockSizeCount; i++) {
+		printStatistics(filePath, config.blockSizes[i], 0 == i);
 	}
 
-	/* This is the code used for making the graph
-	size_t writeSizes[] = {MEGABYTE(1),KILOBYTE(256), KILOBYTE(64), KILOBYTE(16), KILOBYTE(4)};
-	for (int i = 0; i < ARRAYSIZE(writeSizes); i++) {
-		printWriteStatistics(filePath, writeSizes[i]);
+	if (OFJson == config.format) {
+		printf("\n]\n");
 	}
-	
-	printf("**************\n");
-	*/
-	
-	printWriteStatistics(filePath, WRITE_SIZE);
 
+	free(buf);
+	free(replayTrace.records);
 	return 0;
 }
\ No newline at end of file
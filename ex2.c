@@ -1,7 +1,11 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h> // for open flags
 #include <unistd.h>
 #include <time.h> // for time measurement
@@ -11,19 +15,94 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 
-#define SECTORS_PER_BLOCK (4)
-#define SECTOR_SIZE (4 * 1024)
-#define IO_SIZE (SECTOR_SIZE)
+#define DEFAULT_SECTORS_PER_BLOCK (4)
+#define DEFAULT_SECTOR_SIZE (4 * 1024)
+#define MIN_SECTOR_SIZE (512)
 #define INVALID_DEVICE (-1)
+#define INVALID_POOL_BUFFER (-1)
+#define IN
+#define OUT
+
 #define ARRAYSIZE(arr) (sizeof(arr)/sizeof(arr[0]))
 
+#define PTHREAD_ASSERT(value)	  							\
+	if (0 != (value)) {										\
+		printf("%d -  %s\n", __LINE__, strerror(value));	\
+		exit(-1);											\
+	}
+
+// The hot xor loops are compiled for AVX2 as well and the right version is picked at load time
+#if defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+typedef uint64_t WideWord __attribute__((vector_size(32)));
+#define STREAM_BUFFER_SIZE (4 * 1024 * 1024)
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+#define MAX_WORKSPACE_SIZE (16 * 1024 * 1024)
+#define MAX_RECORD_SECTORS (4096)
+#define DEFAULT_REGION_STRIPES (1024)
+#define CHECKPOINT_INTERVAL (4096)
+#define JOURNAL_MAX_SIZE (64 * 1024 * 1024)
+#define SCRUB_WINDOW_SIZE (4 * 1024 * 1024)
+#define SCRUB_BUFFERS (2)
+#define STRIPE_LOCK_COUNT (1024)
+#define MAX_QUEUED_JOBS (1024)
+#define SERVER_BACKLOG (64)
+#define LATENCY_SUB_BUCKET_BITS (5)
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+#define ZIPF_MAX_SLOTS (1 << 20)
+#define DIRECT_IO_ALIGNMENT (4096)
+#define IO_BUFFER_POOL_SIZE (64)
+#define DEFAULT_WORKLOAD_OPERATIONS (20000)
+#define DEFAULT_READ_PERCENT (70)
+#define BITMAP_MAGIC (0x42495452)
+#define JOURNAL_MAGIC (0x4a524e4c)
+
+// The placement of the parity block in every stripe, named like the md driver names them.
+// Left/right is the direction the parity moves in from one stripe to the next, in the symmetric layouts the
+// data of a stripe starts right after its parity (wrapping around) and in the asymmetric ones it starts at device 0.
+typedef enum ParityLayout_e {
+	PL_LeftAsymmetric = 0,
+	PL_LeftSymmetric,
+	PL_RightAsymmetric,
+	PL_RightSymmetric,
+} ParityLayout;
+
+const char* g_layout_names[] = {
+	[PL_LeftAsymmetric] = "left-asymmetric",
+	[PL_LeftSymmetric] = "left-symmetric",
+	[PL_RightAsymmetric] = "right-asymmetric",
+	[PL_RightSymmetric] = "right-symmetric",
+};
+
 int		g_num_dev;
 int*	g_dev_status;
-char 	g_io_buffer[IO_SIZE];
+char* 	g_io_buffer;
+char* 	g_parity_buffer;
+char* 	g_payload_buffer;
 char**	g_argv;
 int 	g_argc;
-int 	g_last_bad_device;
+// Every thread reports its own last bad device
+__thread int g_last_bad_device;
+bool 	g_trace = true;
+// Open the devices with O_DIRECT (-d), so the page cache doesn't hide how the devices behave
+bool 	g_direct_io = false;
+int 	g_sectors_per_block = DEFAULT_SECTORS_PER_BLOCK;
+int 	g_sector_size = DEFAULT_SECTOR_SIZE;
+ParityLayout g_layout = PL_LeftAsymmetric;
+// 1 for RAID5 (P), 2 for RAID6 (P+Q)
+int 	g_parity_count = 1;
 
 typedef struct {
 	int device_index;
@@ -36,24 +115,61 @@ char* device_string(int device_index) {
 	return g_argv[device_index + 1];
 }
 
+int get_data_devices_in_stripe() {
+	return (g_num_dev - g_parity_count);
+}
+
 int get_logical_sector_stripe(int logical_sector) {
-	return ((logical_sector / (g_num_dev - 1)) / SECTORS_PER_BLOCK);
+	return ((logical_sector / get_data_devices_in_stripe()) / g_sectors_per_block);
 }
 
 int get_parity_index_in_stripe(int logical_stripe) {
+	if (PL_RightAsymmetric == g_layout || PL_RightSymmetric == g_layout) {
+		return (logical_stripe % g_num_dev);
+	}
 	return (g_num_dev - 1 - (logical_stripe % g_num_dev));
 }
 
-int get_sector_index_in_stripe(int logical_sector, int parity_in_stripe) {
-	logical_sector /= SECTORS_PER_BLOCK;
-	int index_in_logical_stripe = logical_sector % (g_num_dev - 1);
+// The Q block of RAID6 always sits on the device right after P
+int get_q_index_in_stripe(int logical_stripe) {
+	return ((get_parity_index_in_stripe(logical_stripe) + 1) % g_num_dev);
+}
+
+int get_device_of_data_index(int index_in_logical_stripe, int parity_in_stripe) {
+	// The last parity device of the stripe (P for RAID5, Q for RAID6)
+	int last_parity = (parity_in_stripe + g_parity_count - 1) % g_num_dev;
+	if (PL_LeftSymmetric == g_layout || PL_RightSymmetric == g_layout) {
+		return ((last_parity + 1 + index_in_logical_stripe) % g_num_dev);
+	}
+
 	int device_index = index_in_logical_stripe;
-	if (index_in_logical_stripe >= parity_in_stripe) {
-		device_index++;
+	if (last_parity < parity_in_stripe) {
+		// Note - Q wrapped around to device 0, so the data starts after it and ends before P
+		return device_index + 1;
+	}
+	if (device_index >= parity_in_stripe) {
+		device_index += g_parity_count;
 	}
 	return device_index;
 }
 
+int get_sector_index_in_stripe(int logical_sector, int parity_in_stripe) {
+	logical_sector /= g_sectors_per_block;
+	int index_in_logical_stripe = logical_sector % get_data_devices_in_stripe();
+	return get_device_of_data_index(index_in_logical_stripe, parity_in_stripe);
+}
+
+// Fills data_index_of_device with the index in the stripe of the data on every device, or -1 for parity devices
+void get_stripe_map(int logical_stripe, OUT int* data_index_of_device) {
+	int parity_in_stripe = get_parity_index_in_stripe(logical_stripe);
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		data_index_of_device[dev] = -1;
+	}
+	for (int i = 0; i < get_data_devices_in_stripe(); i++) {
+		data_index_of_device[get_device_of_data_index(i, parity_in_stripe)] = i;
+	}
+}
+
 PhysicalLocation get_physical_sector(int logical_sector) {
 	PhysicalLocation location = {0};
 	int logical_stripe = get_logical_sector_stripe(logical_sector);
@@ -61,7 +177,7 @@ PhysicalLocation get_physical_sector(int logical_sector) {
 	int device_index = get_sector_index_in_stripe(logical_sector, parity_in_stripe);
 	location.device_index = device_index;
 	location.stripe_number = logical_stripe;
-	location.place_in_block = logical_sector % SECTORS_PER_BLOCK;
+	location.place_in_block = logical_sector % g_sectors_per_block;
 	location.is_parity = false;
 	return location;
 }
@@ -91,66 +207,415 @@ void get_backup_sectors(PhysicalLocation bad_sector, PhysicalLocation* backup_da
 }
 
 int physical_location_to_sector(PhysicalLocation location) {
-	return ((location.stripe_number * SECTORS_PER_BLOCK) + location.place_in_block);
+	return ((location.stripe_number * g_sectors_per_block) + location.place_in_block);
 }
 
 off_t physical_location_to_offset(PhysicalLocation location) {
-	return (physical_location_to_sector(location) * SECTOR_SIZE);
+	return ((off_t)physical_location_to_sector(location) * g_sector_size);
+}
+
+// Commands hold g_devices_lock shared while they do I/O and KILL/REPAIR hold it exclusively, so a device's fd
+// is never closed or replaced while someone may be using it. A device that fails in the middle of an I/O is
+// only marked bad right away, its fd is retired and closed the next time the lock is held exclusively.
+pthread_rwlock_t g_devices_lock;
+int* 	g_retired_fds;
+
+int get_device_fd(int device_index) {
+	return __atomic_load_n(&g_dev_status[device_index], __ATOMIC_ACQUIRE);
 }
 
 void close_device(int device_index) {
 	assert(device_index >= 0 && device_index < g_num_dev);
 
-	if (INVALID_DEVICE != g_dev_status[device_index]) {
-		close(g_dev_status[device_index]);
-		g_dev_status[device_index] = INVALID_DEVICE;
+	int fd = __atomic_exchange_n(&g_dev_status[device_index], INVALID_DEVICE, __ATOMIC_ACQ_REL);
+	if (INVALID_DEVICE != fd) {
+		__atomic_store_n(&g_retired_fds[device_index], fd, __ATOMIC_RELEASE);
+	}
+}
+
+// Must only be called with g_devices_lock held exclusively
+void close_retired_devices() {
+	for (int i = 0; i < g_num_dev; i++) {
+		if (INVALID_DEVICE != g_retired_fds[i]) {
+			close(g_retired_fds[i]);
+			g_retired_fds[i] = INVALID_DEVICE;
+		}
 	}
 }
 
+void lock_devices(IN bool exclusive) {
+	int result = exclusive ? pthread_rwlock_wrlock(&g_devices_lock) : pthread_rwlock_rdlock(&g_devices_lock);
+	PTHREAD_ASSERT(result);
+}
+
+void unlock_devices() {
+	int result = pthread_rwlock_unlock(&g_devices_lock);
+	PTHREAD_ASSERT(result);
+}
+
+void init_devices_lock() {
+	pthread_rwlockattr_t attributes;
+	int result = pthread_rwlockattr_init(&attributes);
+	PTHREAD_ASSERT(result);
+	// Note - Otherwise a steady stream of I/O commands would keep a KILL or REPAIR waiting forever
+	result = pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	PTHREAD_ASSERT(result);
+	result = pthread_rwlock_init(&g_devices_lock, &attributes);
+	PTHREAD_ASSERT(result);
+	pthread_rwlockattr_destroy(&attributes);
+}
+
+// Sectors moved to and from every device, to measure how much device I/O each requested sector costs
+typedef struct {
+	uint64_t sectors_read;
+	uint64_t sectors_written;
+} DeviceStats;
+
+DeviceStats* g_device_stats;
+
+void count_device_io(IN int device_index, IN int sectors, IN bool is_write) {
+	uint64_t* counter = is_write ? (&g_device_stats[device_index].sectors_written) : (&g_device_stats[device_index].sectors_read);
+	__atomic_fetch_add(counter, sectors, __ATOMIC_RELAXED);
+}
+
 void print_operated_on_device(PhysicalLocation real_sector) {
-	printf("Operation on device %d, sector %d\n", real_sector.device_index, physical_location_to_sector(real_sector));
+	if (g_trace) {
+		printf("Operation on device %d, sector %d\n", real_sector.device_index, physical_location_to_sector(real_sector));
+	}
 }
 
 void print_bad_operation_on_device() {
 		printf("Operation on bad device %d\n", g_last_bad_device);
 }
 
-typedef ssize_t (*io_func)(int fd, void* buf, size_t count);
-bool io_operation(PhysicalLocation io_position, io_func operation, char* operation_name) {
+// Note - Sector sizes are multiples of MIN_SECTOR_SIZE, so every block here is a whole number of WideWords
+SIMD_CLONES
+void xor_block(IN OUT char* dst, IN const char* src, IN size_t size) {
+	for (size_t i = 0; i < size; i += sizeof(WideWord)) {
+		WideWord a;
+		WideWord b;
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		a ^= b;
+		memcpy(dst + i, &a, sizeof(a));
+	}
+}
+
+// Returns true if the xor of all the blocks is zero, without writing anything
+SIMD_CLONES
+bool xor_is_zero(IN char* const* blocks, IN int block_count, IN size_t size) {
+	for (size_t i = 0; i < size; i += sizeof(WideWord)) {
+		WideWord accumulator = {0};
+		for (int j = 0; j < block_count; j++) {
+			WideWord word;
+			memcpy(&word, blocks[j] + i, sizeof(word));
+			accumulator ^= word;
+		}
+		uint64_t folded = accumulator[0] | accumulator[1] | accumulator[2] | accumulator[3];
+		if (0 != folded) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// GF(2^8) arithmetic for the RAID6 Q syndrome, over the polynomial x^8 + x^4 + x^3 + x^2 + 1 with generator 2.
+// Q = sum(2^i * D_i) for every data block D_i in the stripe.
+#define GF_POLYNOMIAL (0x11d)
+uint8_t g_gf_exp[2 * 255];
+uint8_t g_gf_log[256];
+// g_gf_mul_table[a][b] == a * b, multiplying a block by a constant is then a single lookup per byte in one row
+uint8_t g_gf_mul_table[256][256];
+
+void init_gf_tables() {
+	int value = 1;
+	for (int i = 0; i < 255; i++) {
+		g_gf_exp[i] = value;
+		g_gf_exp[i + 255] = value;
+		g_gf_log[value] = i;
+		value <<= 1;
+		if (value & 0x100) {
+			value ^= GF_POLYNOMIAL;
+		}
+	}
+
+	for (int a = 0; a < 256; a++) {
+		for (int b = 0; b < 256; b++) {
+			g_gf_mul_table[a][b] = (0 == a || 0 == b) ? (0) : (g_gf_exp[g_gf_log[a] + g_gf_log[b]]);
+		}
+	}
+}
+
+uint8_t gf_pow2(int exponent) {
+	return g_gf_exp[((exponent % 255) + 255) % 255];
+}
+
+uint8_t gf_inverse(uint8_t value) {
+	assert(0 != value);
+	return g_gf_exp[255 - g_gf_log[value]];
+}
+
+// dst ^= coefficient * src
+void gf_mul_xor_block(IN OUT char* dst, IN const char* src, IN uint8_t coefficient, IN size_t size) {
+	const uint8_t* row = g_gf_mul_table[coefficient];
+	uint8_t* dst_bytes = (uint8_t*)dst;
+	const uint8_t* src_bytes = (const uint8_t*)src;
+	for (size_t i = 0; i < size; i++) {
+		dst_bytes[i] ^= row[src_bytes[i]];
+	}
+}
+
+void gf_scale_block(IN OUT char* block, IN uint8_t coefficient, IN size_t size) {
+	const uint8_t* row = g_gf_mul_table[coefficient];
+	uint8_t* bytes = (uint8_t*)block;
+	for (size_t i = 0; i < size; i++) {
+		bytes[i] = row[bytes[i]];
+	}
+}
+
+typedef ssize_t (*io_func)(int fd, void* buf, size_t count, off_t offset);
+bool io_operation(PhysicalLocation io_position, io_func operation, char* operation_name, char* buffer) {
 	// Saving the last bad device is based on answers from the forum that say to print only the last device that was bad
 	int dev_num = io_position.device_index;
-	if (g_dev_status[dev_num] < 0) {
+	int fd = get_device_fd(dev_num);
+	if (fd < 0) {
 		g_last_bad_device = dev_num;
 		return false;
 	}
 
+	// Note - Positional I/O saves the lseek syscall we used to make before every sector
 	off_t offset_in_device = physical_location_to_offset(io_position);
-	off_t resulting_offset = lseek(g_dev_status[dev_num], offset_in_device, SEEK_SET);
-	if (resulting_offset != offset_in_device) {
-		printf("Seek operation failed on bad device %d with error %s\n", dev_num, strerror(errno));
-		g_last_bad_device = dev_num;
-		close_device(io_position.device_index);
-		return false;
-	}
-
-	ssize_t result = operation(g_dev_status[dev_num], g_io_buffer, IO_SIZE);
-	if (result != IO_SIZE) {
+	ssize_t result = operation(fd, buffer, g_sector_size, offset_in_device);
+	if (result != g_sector_size) {
 		printf("%s operation failed on bad device %s (index %d) with error %s\n", operation_name, device_string(dev_num), dev_num, strerror(errno));
 		g_last_bad_device = dev_num;
 		close_device(io_position.device_index);
 		return false;
 	}
 
+	count_device_io(dev_num, 1, ((io_func)pwrite == operation));
 	print_operated_on_device(io_position);
 	return true;	
 }
 
+bool read_physical_buffer(PhysicalLocation to_read, OUT char* buffer) {
+	return io_operation(to_read, (io_func)pread, "Read", buffer);
+}
+
+bool write_physical_buffer(PhysicalLocation to_write, IN const char* buffer) {
+	return io_operation(to_write, (io_func)pwrite, "Write", (char*)buffer);
+}
+
 bool read_physical(PhysicalLocation to_read) {
-	return io_operation(to_read, (io_func)read, "Read");
+	return read_physical_buffer(to_read, g_io_buffer);
 }
 
 bool write_physical(PhysicalLocation to_write) {
-	return io_operation(to_write, (io_func)write, "Write");
+	return write_physical_buffer(to_write, g_io_buffer);
+}
+
+// The allocation map keeps one bit per stripe that may hold data. Stripes that were never written (holes in every
+// device when we start) or were discarded since read as zeros, so the ranged paths don't read them from the
+// devices at all. The bits of a stripe only change with its stripe lock held (or the devices held exclusively),
+// and a stripe past the end of the map counts as allocated.
+typedef struct {
+	uint8_t* bits;
+	int stripe_count;
+} AllocationMap;
+
+AllocationMap g_allocation = {0};
+
+bool is_stripe_allocated(IN int stripe) {
+	if (stripe >= g_allocation.stripe_count) {
+		return true;
+	}
+	return (__atomic_load_n(&g_allocation.bits[stripe / 8], __ATOMIC_ACQUIRE) & (1 << (stripe % 8)));
+}
+
+void set_stripes_allocated(IN int first_stripe, IN int last_stripe, IN bool allocated) {
+	last_stripe = (last_stripe < g_allocation.stripe_count) ? (last_stripe) : (g_allocation.stripe_count - 1);
+	for (int stripe = first_stripe; stripe <= last_stripe; stripe++) {
+		// Note - A byte holds the bits of 8 stripes that may be locked by different threads
+		if (allocated) {
+			__atomic_fetch_or(&g_allocation.bits[stripe / 8], (uint8_t)(1 << (stripe % 8)), __ATOMIC_RELEASE);
+		}
+		else {
+			__atomic_fetch_and(&g_allocation.bits[stripe / 8], (uint8_t)~(1 << (stripe % 8)), __ATOMIC_RELEASE);
+		}
+	}
+}
+
+// The write-intent bitmap keeps one bit per region of stripes that may have been written without its parity
+// (the RAID5 write hole). A bit is made durable before the first write to its region, and bits are only
+// cleared at a checkpoint, once everything written so far is synced to the devices, so after a crash only
+// the regions still marked need their parity resynced.
+typedef struct {
+	uint32_t magic;
+	uint32_t region_stripes;
+} BitmapHeader;
+
+typedef struct {
+	int fd;
+	int region_stripes;
+	int region_count;
+	uint8_t* bits;
+} WriteIntentBitmap;
+
+// The journal is an optional write-ahead log of the data and parity of every write, so a crash between the
+// data and parity writes can be redone exactly instead of resynced. It's reset at every checkpoint.
+typedef struct {
+	int fd;
+	off_t size;
+} WriteAheadJournal;
+
+WriteIntentBitmap g_bitmap = {.fd = INVALID_DEVICE, .region_stripes = DEFAULT_REGION_STRIPES};
+WriteAheadJournal g_journal = {.fd = INVALID_DEVICE};
+int g_writes_since_checkpoint = 0;
+bool g_checkpoint_pending = false;
+// With -f every device is fdatasynced once every g_sync_interval writes, so a whole batch of writes shares a
+// single flush (0 leaves the flushing to the OS)
+int g_sync_interval = 0;
+int g_writes_since_sync = 0;
+bool g_sync_pending = false;
+// Guards the bitmap, the journal and the checkpoint counters between concurrent commands
+pthread_mutex_t g_durability_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool is_bitmap_bit_set(IN int region) {
+	return (region < g_bitmap.region_count) && (g_bitmap.bits[region / 8] & (1 << (region % 8)));
+}
+
+void grow_bitmap(IN int region_count) {
+	if (region_count <= g_bitmap.region_count) {
+		return;
+	}
+	int old_bytes = (g_bitmap.region_count + 7) / 8;
+	int new_bytes = (region_count + 7) / 8;
+	g_bitmap.bits = realloc(g_bitmap.bits, new_bytes);
+	assert(NULL != g_bitmap.bits);
+	memset(g_bitmap.bits + old_bytes, 0, new_bytes - old_bytes);
+	g_bitmap.region_count = new_bytes * 8;
+}
+
+bool write_bitmap_bytes(IN int first_byte, IN int last_byte) {
+	off_t offset = sizeof(BitmapHeader) + first_byte;
+	ssize_t length = last_byte - first_byte + 1;
+	if (length != pwrite(g_bitmap.fd, g_bitmap.bits + first_byte, length, offset)) {
+		printf("Failed writing the write-intent bitmap with error %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void sync_devices() {
+	for (int i = 0; i < g_num_dev; i++) {
+		int fd = get_device_fd(i);
+		if (INVALID_DEVICE != fd) {
+			fdatasync(fd);
+		}
+	}
+}
+
+// Syncs everything written so far to the devices, after which no region is dirty and no journal record is needed
+void checkpoint() {
+	if (INVALID_DEVICE == g_bitmap.fd && INVALID_DEVICE == g_journal.fd) {
+		return;
+	}
+
+	sync_devices();
+
+	if (INVALID_DEVICE != g_bitmap.fd && g_bitmap.region_count > 0) {
+		memset(g_bitmap.bits, 0, g_bitmap.region_count / 8);
+		if (write_bitmap_bytes(0, (g_bitmap.region_count / 8) - 1)) {
+			fdatasync(g_bitmap.fd);
+		}
+	}
+
+	if (INVALID_DEVICE != g_journal.fd && g_journal.size > 0) {
+		if (0 == ftruncate(g_journal.fd, 0)) {
+			fdatasync(g_journal.fd);
+		}
+		g_journal.size = 0;
+	}
+
+	g_writes_since_checkpoint = 0;
+}
+
+// Called before writing to the stripes [first_stripe, last_stripe], makes sure their regions are marked on disk
+// (and the stripes in the allocation map)
+void begin_stripe_write(IN int first_stripe, IN int last_stripe) {
+	set_stripes_allocated(first_stripe, last_stripe, true);
+	if (INVALID_DEVICE == g_bitmap.fd) {
+		return;
+	}
+
+	int result = pthread_mutex_lock(&g_durability_lock);
+	PTHREAD_ASSERT(result);
+
+	int first_region = first_stripe / g_bitmap.region_stripes;
+	int last_region = last_stripe / g_bitmap.region_stripes;
+	grow_bitmap(last_region + 1);
+
+	int first_changed = INT_MAX;
+	int last_changed = -1;
+	for (int region = first_region; region <= last_region; region++) {
+		if (!is_bitmap_bit_set(region)) {
+			g_bitmap.bits[region / 8] |= (1 << (region % 8));
+			first_changed = (region / 8 < first_changed) ? (region / 8) : (first_changed);
+			last_changed = region / 8;
+		}
+	}
+
+	// Note - Only a region's first write since the last checkpoint pays for the bitmap sync
+	if (last_changed >= 0 && write_bitmap_bytes(first_changed, last_changed)) {
+		fdatasync(g_bitmap.fd);
+	}
+
+	result = pthread_mutex_unlock(&g_durability_lock);
+	PTHREAD_ASSERT(result);
+}
+
+// Note - The checkpoint itself can't run here since other commands may still be writing, it runs from
+// Note - run_pending_checkpoint once the caller let go of its locks
+void end_stripe_write() {
+	if (INVALID_DEVICE == g_bitmap.fd && INVALID_DEVICE == g_journal.fd && 0 == g_sync_interval) {
+		return;
+	}
+
+	int result = pthread_mutex_lock(&g_durability_lock);
+	PTHREAD_ASSERT(result);
+	g_writes_since_checkpoint++;
+	if (g_writes_since_checkpoint >= CHECKPOINT_INTERVAL || g_journal.size >= JOURNAL_MAX_SIZE) {
+		__atomic_store_n(&g_checkpoint_pending, true, __ATOMIC_RELEASE);
+	}
+	g_writes_since_sync++;
+	if (g_sync_interval > 0 && g_writes_since_sync >= g_sync_interval) {
+		g_writes_since_sync = 0;
+		__atomic_store_n(&g_sync_pending, true, __ATOMIC_RELEASE);
+	}
+	result = pthread_mutex_unlock(&g_durability_lock);
+	PTHREAD_ASSERT(result);
+}
+
+// Must be called with the devices held (shared is enough), whoever gets here first syncs for the whole batch
+void run_pending_sync() {
+	if (__atomic_load_n(&g_sync_pending, __ATOMIC_ACQUIRE) && __atomic_exchange_n(&g_sync_pending, false, __ATOMIC_ACQ_REL)) {
+		sync_devices();
+	}
+}
+
+void run_pending_checkpoint() {
+	if (!__atomic_load_n(&g_checkpoint_pending, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	// Holding the devices exclusively means no write is in flight while the bitmap is cleared
+	lock_devices(true);
+	if (g_checkpoint_pending) {
+		checkpoint();
+		g_checkpoint_pending = false;
+	}
+	close_retired_devices();
+	unlock_devices();
 }
 
 bool read_backup(PhysicalLocation sector_to_read) {
@@ -170,6 +635,13 @@ bool read_backup(PhysicalLocation sector_to_read) {
 void read_operation(int sector) {
 	PhysicalLocation real_sector = get_physical_sector(sector);
 
+	// Note - Like the ranged reads, a stripe that was never written (or was discarded) reads as zeros without touching
+	// Note - any device, which matters most when degraded since the backup read would read every surviving device
+	if (!is_stripe_allocated(real_sector.stripe_number)) {
+		memset(g_io_buffer, 0, g_sector_size);
+		return;
+	}
+
 	bool read_ok = read_physical(real_sector);
 	if (!read_ok) {
 		read_ok = read_backup(real_sector);
@@ -253,6 +725,8 @@ void write_operation(int sector) {
 	PhysicalLocation real_sector = get_physical_sector(sector);
 	PhysicalLocation parity_sector = get_relevant_parity_sector(real_sector);
 
+	begin_stripe_write(real_sector.stripe_number, real_sector.stripe_number);
+
 	bool write_succeeded = false;
 	if (INVALID_DEVICE != g_dev_status[real_sector.device_index]) {
 		write_succeeded = standard_write(real_sector, parity_sector);
@@ -264,90 +738,2952 @@ void write_operation(int sector) {
 	if (!write_succeeded) {
 		print_bad_operation_on_device();
 	}
+
+	end_stripe_write();
 }
 
-void open_device(int device_index) {
-	assert(device_index <= g_num_dev && device_index >= 0);
+bool payload_standard_write(PhysicalLocation real_sector, PhysicalLocation parity_sector, IN const char* data) {
+	if (INVALID_DEVICE == g_dev_status[parity_sector.device_index]) {
+		return write_physical_buffer(real_sector, data);
+	}
 
-	g_dev_status[device_index] = open(device_string(device_index), O_RDWR );
-	// TODO - Should check if we need to print an error here in case of failure
-	if (INVALID_DEVICE == g_dev_status[device_index]) {
-		printf("Failed to open device %s index %d with error %s\n", device_string(device_index), device_index, strerror(errno));
+	// Note - Unlike the simulated write above, here the new parity really is old_parity ^ old_data ^ new_data,
+	// Note - so both old sectors have to be read before anything is written
+	bool io_ok = read_physical(real_sector);
+	if (!io_ok) return false;
+	io_ok = read_physical_buffer(parity_sector, g_parity_buffer);
+	if (!io_ok) {
+		// The parity device just went bad, the data itself is all we can still keep
+		return write_physical_buffer(real_sector, data);
 	}
+
+	xor_block(g_parity_buffer, g_io_buffer, g_sector_size);
+	xor_block(g_parity_buffer, data, g_sector_size);
+
+	io_ok = write_physical_buffer(real_sector, data);
+	if (!io_ok) return false;
+
+	// Note - If only the parity write fails the data is already on disk and the stripe is just degraded
+	write_physical_buffer(parity_sector, g_parity_buffer);
+	return true;
 }
 
-void repair_device(int device_index) {
-	// Based on answers here http://moodle.tau.ac.il/mod/forum/discuss.php?d=50752
-	assert(device_index <= g_num_dev && device_index >= 0);
+bool payload_error_state_write(PhysicalLocation real_sector, IN const char* data) {
+	int backup_sector_count = g_num_dev - 1;
+	PhysicalLocation backup_locations[backup_sector_count];
+	get_backup_sectors(real_sector, backup_locations);
 
-	int old_device = g_dev_status[device_index];
-	open_device(device_index);
-	if (INVALID_DEVICE == g_dev_status[device_index]) {
-		g_dev_status[device_index] == old_device;
-	} 
-	else {
-		close(old_device);
+	// The new parity is the new data xored with the data from all the other (working) devices in the stripe
+	memcpy(g_parity_buffer, data, g_sector_size);
+	PhysicalLocation parity_location = {0};
+	for (int i = 0; i < backup_sector_count; i++) {
+		if (backup_locations[i].is_parity) {
+			parity_location = backup_locations[i];
+			continue;
+		}
+		bool io_ok = read_physical(backup_locations[i]);
+		if (!io_ok) {
+			return false;
+		}
+		xor_block(g_parity_buffer, g_io_buffer, g_sector_size);
 	}
 
+	return write_physical_buffer(parity_location, g_parity_buffer);
 }
 
-void open_devices() {
-	for (int i = 0; i < g_num_dev; i++) {
-		open_device(i);
+void write_operation_with_data(int sector, IN const char* data) {
+	PhysicalLocation real_sector = get_physical_sector(sector);
+	PhysicalLocation parity_sector = get_relevant_parity_sector(real_sector);
+
+	begin_stripe_write(real_sector.stripe_number, real_sector.stripe_number);
+
+	bool write_succeeded = false;
+	if (INVALID_DEVICE != g_dev_status[real_sector.device_index]) {
+		write_succeeded = payload_standard_write(real_sector, parity_sector, data);
+	}
+	if (!write_succeeded) {
+		write_succeeded = payload_error_state_write(real_sector, data);
+	}
+
+	if (!write_succeeded) {
+		print_bad_operation_on_device();
 	}
+
+	end_stripe_write();
 }
 
-void close_devices() {
-	for (int i = 0; i < g_num_dev; i++) {
-		close_device(i);
+// Ranged operations work on whole stripes at a time. Every stripe gets a workspace of one block per device,
+// the reads and writes planned for the stripes are collected in batches and each batch is sorted so sectors
+// that are adjacent on the same device go down as a single preadv/pwritev.
+typedef struct {
+	PhysicalLocation location;
+	char* buffer;
+} SectorIo;
+
+typedef struct {
+	SectorIo* entries;
+	int count;
+	int capacity;
+} IoBatch;
+
+#define SECTOR_TOUCHED 		(0x1)
+#define SECTOR_READ_PLANNED (0x2)
+#define SECTOR_FAILED 		(0x4)
+
+typedef struct {
+	int first_stripe;
+	int stripe_count;
+	char* buffer;
+	int buffer_index;
+	unsigned char* state;
+	// Two sectors for the syndromes while reconstructing
+	char* scratch;
+	IoBatch reads;
+	IoBatch writes;
+} StripeWorkspace;
+
+// Every buffer that devices are read into or written from is DIRECT_IO_ALIGNMENT aligned (and a multiple of
+// it long), so it works with devices opened with O_DIRECT
+char* allocate_io_buffer(IN size_t size) {
+	size_t aligned_size = ((size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT) * DIRECT_IO_ALIGNMENT;
+	char* buffer = aligned_alloc(DIRECT_IO_ALIGNMENT, aligned_size);
+	assert(NULL != buffer);
+	return buffer;
+}
+
+// The workspace buffers are kept in a pool instead of being allocated (and faulted in) for every operation.
+// The free list is a lock-free stack of buffer indices, its head packs the top index (plus 1, so 0 is an empty
+// stack) with a tag that changes on every update, so a pop can't be fooled by its top having been popped and
+// pushed back in the meantime (ABA). Buffers are only allocated the first time they're handed out.
+typedef struct {
+	char* buffers[IO_BUFFER_POOL_SIZE];
+	uint32_t next[IO_BUFFER_POOL_SIZE];
+	uint64_t head;
+	size_t buffer_size;
+} IoBufferPool;
+
+IoBufferPool g_io_buffer_pool;
+
+void init_io_buffer_pool(IN size_t buffer_size) {
+	memset(&g_io_buffer_pool, 0, sizeof(g_io_buffer_pool));
+	g_io_buffer_pool.buffer_size = buffer_size;
+	for (int i = 0; i < IO_BUFFER_POOL_SIZE; i++) {
+		g_io_buffer_pool.next[i] = (i + 1 < IO_BUFFER_POOL_SIZE) ? (i + 2) : (0);
 	}
+	g_io_buffer_pool.head = 1;
 }
 
-struct {
-	char* op_name;
-	void (*func)(int param);
-} functions[] = {
-	{"READ", read_operation},
-	{"WRITE", write_operation},
-	{"REPAIR", repair_device},
-	{"KILL", close_device},
-};
+void free_io_buffer_pool() {
+	for (int i = 0; i < IO_BUFFER_POOL_SIZE; i++) {
+		free(g_io_buffer_pool.buffers[i]);
+		g_io_buffer_pool.buffers[i] = NULL;
+	}
+}
 
-int main(int argc, char** argv)
-{
-	assert(argc >= 4);
-	
-	// number of devices == number of arguments (ignore 1st)
-	g_argc = argc;
-	g_argv = argv;
-	g_num_dev = argc - 1;
-	int _dev_status[g_num_dev];
-	g_dev_status = _dev_status;
-	open_devices(argv+1);
-	
-	// vars for parsing input line
-	char input_line[1024];
-	char given_command[0x20];
-	int command_param;
-	
-	// read input lines to get command of type "<CMD> <PARAM>"
-	while (fgets(input_line, 1024, stdin) != NULL) {
-		sscanf(input_line, "%s %d", given_command, &command_param);
+// Returns the index of the buffer in the pool, or INVALID_POOL_BUFFER when all of them are in use (then the
+// buffer is a fresh allocation)
+int acquire_io_buffer(OUT char** buffer) {
+	uint64_t head = __atomic_load_n(&g_io_buffer_pool.head, __ATOMIC_ACQUIRE);
+	while (true) {
+		uint32_t top = (uint32_t)head;
+		if (0 == top) {
+			*buffer = allocate_io_buffer(g_io_buffer_pool.buffer_size);
+			return INVALID_POOL_BUFFER;
+		}
+		uint32_t next = __atomic_load_n(&g_io_buffer_pool.next[top - 1], __ATOMIC_RELAXED);
+		uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+		if (__atomic_compare_exchange_n(&g_io_buffer_pool.head, &head, new_head, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+
+	int index = (int)(uint32_t)head - 1;
+	// Note - Only the thread that popped an index touches its buffer, until it pushes it back
+	if (NULL == g_io_buffer_pool.buffers[index]) {
+		g_io_buffer_pool.buffers[index] = allocate_io_buffer(g_io_buffer_pool.buffer_size);
+	}
+	*buffer = g_io_buffer_pool.buffers[index];
+	return index;
+}
 
-		bool found = false;
+void release_io_buffer(IN int index, IN char* buffer) {
+	if (INVALID_POOL_BUFFER == index) {
+		free(buffer);
+		return;
+	}
 
-		for (int i = 0; i < ARRAYSIZE(functions); i++) {
-			if (!strcmp(given_command, functions[i].op_name)) {
-				found = true;
-				functions[i].func(command_param);
+	uint64_t head = __atomic_load_n(&g_io_buffer_pool.head, __ATOMIC_ACQUIRE);
+	do {
+		__atomic_store_n(&g_io_buffer_pool.next[index], (uint32_t)head, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&g_io_buffer_pool.head, &head, (((head >> 32) + 1) << 32) | (uint32_t)(index + 1),
+										  false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+void batch_add(IN OUT IoBatch* batch, IN PhysicalLocation location, IN char* buffer) {
+	if (batch->count == batch->capacity) {
+		batch->capacity = (0 == batch->capacity) ? (64) : (batch->capacity * 2);
+		batch->entries = realloc(batch->entries, batch->capacity * sizeof(SectorIo));
+		assert(NULL != batch->entries);
+	}
+	batch->entries[batch->count].location = location;
+	batch->entries[batch->count].buffer = buffer;
+	batch->count++;
+}
+
+int compare_sector_io(const void* first, const void* second) {
+	const SectorIo* a = first;
+	const SectorIo* b = second;
+	if (a->location.device_index != b->location.device_index) {
+		return a->location.device_index - b->location.device_index;
+	}
+	return physical_location_to_sector(a->location) - physical_location_to_sector(b->location);
+}
+
+// Runs every I/O in the batch and returns false if any device failed along the way.
+// A failing device is closed and the rest of its entries are skipped, the other devices are still
+// completed so a write batch leaves as much of the stripe on disk as it can.
+bool submit_batch(IN OUT IoBatch* batch, IN bool is_write) {
+	qsort(batch->entries, batch->count, sizeof(SectorIo), compare_sector_io);
+
+	bool all_ok = true;
+	struct iovec vectors[IOV_MAX];
+	int i = 0;
+	while (i < batch->count) {
+		PhysicalLocation first = batch->entries[i].location;
+		int dev_num = first.device_index;
+		int run_length = 1;
+		vectors[0].iov_base = batch->entries[i].buffer;
+		vectors[0].iov_len = g_sector_size;
+		while (i + run_length < batch->count && run_length < IOV_MAX) {
+			PhysicalLocation next = batch->entries[i + run_length].location;
+			if (next.device_index != dev_num ||
+				physical_location_to_sector(next) != physical_location_to_sector(first) + run_length) {
 				break;
 			}
+			vectors[run_length].iov_base = batch->entries[i + run_length].buffer;
+			vectors[run_length].iov_len = g_sector_size;
+			run_length++;
 		}
 
-		if (!found) {
-			printf("Invalid command: %s\n", given_command);
+		int fd = get_device_fd(dev_num);
+		bool run_ok = (fd >= 0);
+		if (run_ok) {
+			off_t offset_in_device = physical_location_to_offset(first);
+			ssize_t expected = (ssize_t)run_length * g_sector_size;
+			ssize_t result = is_write ? pwritev(fd, vectors, run_length, offset_in_device)
+									  : preadv(fd, vectors, run_length, offset_in_device);
+			if (result != expected) {
+				printf("%s operation failed on bad device %s (index %d) with error %s\n", is_write ? "Write" : "Read", device_string(dev_num), dev_num, strerror(errno));
+				close_device(dev_num);
+				run_ok = false;
+			}
 		}
-	}
 
-	close_devices();
-}
\ No newline at end of file
+		if (run_ok) {
+			count_device_io(dev_num, run_length, is_write);
+			for (int j = 0; j < run_length; j++) {
+				print_operated_on_device(batch->entries[i + j].location);
+			}
+			i += run_length;
+		}
+		else {
+			g_last_bad_device = dev_num;
+			all_ok = false;
+			while (i < batch->count && batch->entries[i].location.device_index == dev_num) {
+				i++;
+			}
+		}
+	}
+
+	batch->count = 0;
+	return all_ok;
+}
+
+typedef struct {
+	uint32_t magic;
+	uint32_t sector_size;
+	uint32_t entry_count;
+	uint32_t reserved;
+	uint64_t checksum;
+} JournalRecordHeader;
+
+typedef struct {
+	uint32_t device_index;
+	uint32_t sector;
+} JournalEntry;
+
+uint64_t checksum_block(IN uint64_t checksum, IN const char* data, IN size_t size) {
+	const uint64_t* words = (const uint64_t*)data;
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		checksum = (checksum ^ words[i]) * 0x100000001b3ULL;
+	}
+	return checksum;
+}
+
+// Logs every write of the batch (data and parity) to the journal and syncs it before the batch goes to the devices
+bool journal_batch(IN IoBatch* batch) {
+	if (INVALID_DEVICE == g_journal.fd || 0 == batch->count) {
+		return true;
+	}
+
+	size_t entries_size = batch->count * sizeof(JournalEntry);
+	size_t record_size = sizeof(JournalRecordHeader) + entries_size + ((size_t)batch->count * g_sector_size);
+	char* record = aligned_alloc(sizeof(uint64_t), record_size);
+	assert(NULL != record);
+
+	JournalRecordHeader* header = (JournalRecordHeader*)record;
+	JournalEntry* entries = (JournalEntry*)(record + sizeof(JournalRecordHeader));
+	char* data = record + sizeof(JournalRecordHeader) + entries_size;
+	for (int i = 0; i < batch->count; i++) {
+		entries[i].device_index = batch->entries[i].location.device_index;
+		entries[i].sector = physical_location_to_sector(batch->entries[i].location);
+		memcpy(data + ((size_t)i * g_sector_size), batch->entries[i].buffer, g_sector_size);
+	}
+	header->magic = JOURNAL_MAGIC;
+	header->sector_size = g_sector_size;
+	header->entry_count = batch->count;
+	header->reserved = 0;
+	header->checksum = checksum_block(0xcbf29ce484222325ULL, record + sizeof(JournalRecordHeader), record_size - sizeof(JournalRecordHeader));
+
+	int lock_result = pthread_mutex_lock(&g_durability_lock);
+	PTHREAD_ASSERT(lock_result);
+	bool result = (ssize_t)record_size == pwrite(g_journal.fd, record, record_size, g_journal.size);
+	if (result) {
+		g_journal.size += record_size;
+	}
+	lock_result = pthread_mutex_unlock(&g_durability_lock);
+	PTHREAD_ASSERT(lock_result);
+
+	// Note - Syncing outside the lock lets the syncs of concurrent writers be batched by the file system
+	if (result) {
+		result = (0 == fdatasync(g_journal.fd));
+	}
+	if (!result) {
+		printf("Failed writing to the journal with error %s\n", strerror(errno));
+	}
+
+	free(record);
+	return result;
+}
+
+// Stripe locks make every workspace read-modify-write atomic against other commands on the same stripes.
+// Stripe s is guarded by g_stripe_locks[s % STRIPE_LOCK_COUNT], and the locks of a range are always taken
+// in ascending lock order so two commands never deadlock.
+pthread_mutex_t g_stripe_locks[STRIPE_LOCK_COUNT];
+
+void init_stripe_locks() {
+	for (int i = 0; i < STRIPE_LOCK_COUNT; i++) {
+		int result = pthread_mutex_init(&g_stripe_locks[i], NULL);
+		PTHREAD_ASSERT(result);
+	}
+}
+
+void set_stripe_locks(IN int first_stripe, IN int stripe_count, IN bool lock) {
+	int first_lock = first_stripe % STRIPE_LOCK_COUNT;
+	int lock_count = (stripe_count < STRIPE_LOCK_COUNT) ? (stripe_count) : (STRIPE_LOCK_COUNT);
+	// A range that wraps around the table is the locks [0, wrapped) and then [first_lock, STRIPE_LOCK_COUNT)
+	int wrapped = first_lock + lock_count - STRIPE_LOCK_COUNT;
+	for (int i = 0; i < wrapped; i++) {
+		int result = lock ? pthread_mutex_lock(&g_stripe_locks[i]) : pthread_mutex_unlock(&g_stripe_locks[i]);
+		PTHREAD_ASSERT(result);
+	}
+	int end_lock = (wrapped > 0) ? (STRIPE_LOCK_COUNT) : (first_lock + lock_count);
+	for (int i = first_lock; i < end_lock; i++) {
+		int result = lock ? pthread_mutex_lock(&g_stripe_locks[i]) : pthread_mutex_unlock(&g_stripe_locks[i]);
+		PTHREAD_ASSERT(result);
+	}
+}
+
+int stripes_per_workspace() {
+	int stripe_size = g_num_dev * g_sectors_per_block * g_sector_size;
+	int stripes = MAX_WORKSPACE_SIZE / stripe_size;
+	return (stripes > 0) ? (stripes) : (1);
+}
+
+void init_workspace(OUT StripeWorkspace* ws) {
+	memset(ws, 0, sizeof(*ws));
+	int sectors = stripes_per_workspace() * g_num_dev * g_sectors_per_block;
+	ws->buffer_index = acquire_io_buffer(&ws->buffer);
+	ws->state = malloc(sectors);
+	ws->scratch = malloc(2 * (size_t)g_sector_size);
+	assert(NULL != ws->state && NULL != ws->scratch);
+}
+
+void free_workspace(IN OUT StripeWorkspace* ws) {
+	release_io_buffer(ws->buffer_index, ws->buffer);
+	free(ws->state);
+	free(ws->scratch);
+	free(ws->reads.entries);
+	free(ws->writes.entries);
+	memset(ws, 0, sizeof(*ws));
+}
+
+int workspace_index(IN StripeWorkspace* ws, IN int stripe, IN int device_index, IN int place_in_block) {
+	return (((stripe - ws->first_stripe) * g_num_dev + device_index) * g_sectors_per_block) + place_in_block;
+}
+
+char* workspace_sector(IN StripeWorkspace* ws, IN int stripe, IN int device_index, IN int place_in_block) {
+	return ws->buffer + ((size_t)workspace_index(ws, stripe, device_index, place_in_block) * g_sector_size);
+}
+
+bool is_parity_device(IN int stripe, IN int device_index) {
+	return (get_parity_index_in_stripe(stripe) == device_index ||
+			(g_parity_count > 1 && get_q_index_in_stripe(stripe) == device_index));
+}
+
+PhysicalLocation column_location(IN int stripe, IN int device_index, IN int place_in_block) {
+	PhysicalLocation location = {0};
+	location.device_index = device_index;
+	location.stripe_number = stripe;
+	location.place_in_block = place_in_block;
+	location.is_parity = is_parity_device(stripe, device_index);
+	return location;
+}
+
+bool is_device_alive(IN int device_index) {
+	return (INVALID_DEVICE != get_device_fd(device_index));
+}
+
+// A device being rebuilt (REBUILD) is only in sync in the stripes below g_rebuild_stripe, in the ones above it
+// we treat it as still failed. The cursor only moves past stripes whose locks the rebuild holds, so it can't
+// move over a stripe in the middle of someone else's operation.
+int g_rebuild_device = INVALID_DEVICE;
+int g_rebuild_stripe = 0;
+
+bool is_device_in_sync(IN int device_index, IN int stripe) {
+	if (!is_device_alive(device_index)) {
+		return false;
+	}
+	return (device_index != __atomic_load_n(&g_rebuild_device, __ATOMIC_ACQUIRE) ||
+			stripe < __atomic_load_n(&g_rebuild_stripe, __ATOMIC_ACQUIRE));
+}
+
+int count_alive_parities(IN int stripe) {
+	int alive = is_device_in_sync(get_parity_index_in_stripe(stripe), stripe) ? (1) : (0);
+	if (g_parity_count > 1 && is_device_in_sync(get_q_index_in_stripe(stripe), stripe)) {
+		alive++;
+	}
+	return alive;
+}
+
+void plan_column_read(IN OUT StripeWorkspace* ws, IN int stripe, IN int place_in_block, IN int device_index) {
+	int index = workspace_index(ws, stripe, device_index, place_in_block);
+	if (ws->state[index] & SECTOR_READ_PLANNED) {
+		return;
+	}
+	ws->state[index] |= SECTOR_READ_PLANNED;
+	batch_add(&ws->reads, column_location(stripe, device_index, place_in_block), workspace_sector(ws, stripe, device_index, place_in_block));
+}
+
+void plan_column_read_all_alive(IN OUT StripeWorkspace* ws, IN int stripe, IN int place_in_block) {
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		if (is_device_in_sync(dev, stripe)) {
+			plan_column_read(ws, stripe, place_in_block, dev);
+		}
+	}
+}
+
+// Computes P (and Q for RAID6) of a column from the data sectors in the workspace
+void compute_column_parity(IN OUT StripeWorkspace* ws, IN int stripe, IN int place_in_block, IN int* data_index_of_device) {
+	char* p = workspace_sector(ws, stripe, get_parity_index_in_stripe(stripe), place_in_block);
+	char* q = (g_parity_count > 1) ? (workspace_sector(ws, stripe, get_q_index_in_stripe(stripe), place_in_block)) : (NULL);
+	memset(p, 0, g_sector_size);
+	if (NULL != q) {
+		memset(q, 0, g_sector_size);
+	}
+
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		int data_index = data_index_of_device[dev];
+		if (data_index < 0) {
+			continue;
+		}
+		char* data = workspace_sector(ws, stripe, dev, place_in_block);
+		xor_block(p, data, g_sector_size);
+		if (NULL != q) {
+			gf_mul_xor_block(q, data, gf_pow2(data_index), g_sector_size);
+		}
+	}
+}
+
+// Rebuilds the data sectors of the failed devices in a column from everything else in it, which must already
+// be in the workspace. Returns false when more data devices failed than we have parities left to rebuild them.
+bool reconstruct_column(IN OUT StripeWorkspace* ws, IN int stripe, IN int place_in_block) {
+	int data_index_of_device[g_num_dev];
+	get_stripe_map(stripe, data_index_of_device);
+
+	int failed[2] = {0};
+	int failed_count = 0;
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		if (data_index_of_device[dev] >= 0 && !is_device_in_sync(dev, stripe)) {
+			if (failed_count == ARRAYSIZE(failed)) {
+				return false;
+			}
+			failed[failed_count++] = dev;
+		}
+	}
+	if (0 == failed_count) {
+		return true;
+	}
+
+	int p_device = get_parity_index_in_stripe(stripe);
+	int q_device = (g_parity_count > 1) ? (get_q_index_in_stripe(stripe)) : (INVALID_DEVICE);
+	bool p_alive = is_device_in_sync(p_device, stripe);
+	bool q_alive = (INVALID_DEVICE != q_device) && is_device_in_sync(q_device, stripe);
+	if (failed_count > (p_alive ? 1 : 0) + (q_alive ? 1 : 0)) {
+		return false;
+	}
+
+	// The syndromes of the failed data: P and Q with the data we still have taken out of them
+	char* p_syndrome = ws->scratch;
+	char* q_syndrome = ws->scratch + g_sector_size;
+	memset(p_syndrome, 0, g_sector_size);
+	memset(q_syndrome, 0, g_sector_size);
+	if (p_alive) {
+		memcpy(p_syndrome, workspace_sector(ws, stripe, p_device, place_in_block), g_sector_size);
+	}
+	if (q_alive) {
+		memcpy(q_syndrome, workspace_sector(ws, stripe, q_device, place_in_block), g_sector_size);
+	}
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		int data_index = data_index_of_device[dev];
+		if (data_index < 0 || !is_device_in_sync(dev, stripe)) {
+			continue;
+		}
+		char* data = workspace_sector(ws, stripe, dev, place_in_block);
+		xor_block(p_syndrome, data, g_sector_size);
+		if (q_alive) {
+			gf_mul_xor_block(q_syndrome, data, gf_pow2(data_index), g_sector_size);
+		}
+	}
+
+	char* x = workspace_sector(ws, stripe, failed[0], place_in_block);
+	int x_index = data_index_of_device[failed[0]];
+	if (1 == failed_count) {
+		if (p_alive) {
+			memcpy(x, p_syndrome, g_sector_size);
+		}
+		else {
+			// Q syndrome == 2^x * Dx
+			memcpy(x, q_syndrome, g_sector_size);
+			gf_scale_block(x, gf_inverse(gf_pow2(x_index)), g_sector_size);
+		}
+		return true;
+	}
+
+	// With Pxy = Dx + Dy and Qxy = 2^x * Dx + 2^y * Dy (and a = 2^(y-x)) we get Dx = (a * Pxy + 2^-x * Qxy) / (a + 1)
+	char* y = workspace_sector(ws, stripe, failed[1], place_in_block);
+	int y_index = data_index_of_device[failed[1]];
+	uint8_t a = gf_pow2(y_index - x_index);
+	uint8_t denominator_inverse = gf_inverse(a ^ 1);
+	memset(x, 0, g_sector_size);
+	gf_mul_xor_block(x, p_syndrome, g_gf_mul_table[a][denominator_inverse], g_sector_size);
+	gf_mul_xor_block(x, q_syndrome, g_gf_mul_table[gf_inverse(gf_pow2(x_index))][denominator_inverse], g_sector_size);
+	memcpy(y, p_syndrome, g_sector_size);
+	xor_block(y, x, g_sector_size);
+	return true;
+}
+
+void zero_workspace_stripe(IN OUT StripeWorkspace* ws, IN int stripe) {
+	memset(workspace_sector(ws, stripe, 0, 0), 0, (size_t)g_num_dev * g_sectors_per_block * g_sector_size);
+}
+
+int first_logical_sector_of_stripe(IN int stripe) {
+	return stripe * get_data_devices_in_stripe() * g_sectors_per_block;
+}
+
+// Clips [sector, sector + count) to the logical sectors that live in the workspace stripes
+void clip_to_workspace(IN StripeWorkspace* ws, IN int sector, IN int count, OUT int* first, OUT int* end) {
+	int workspace_start = first_logical_sector_of_stripe(ws->first_stripe);
+	int workspace_end = first_logical_sector_of_stripe(ws->first_stripe + ws->stripe_count);
+	*first = (sector > workspace_start) ? (sector) : (workspace_start);
+	*end = (sector + count < workspace_end) ? (sector + count) : (workspace_end);
+}
+
+void mark_touched_sectors(IN OUT StripeWorkspace* ws, IN int sector, IN int count) {
+	memset(ws->state, 0, (size_t)ws->stripe_count * g_num_dev * g_sectors_per_block);
+	int first = 0;
+	int end = 0;
+	clip_to_workspace(ws, sector, count, &first, &end);
+	for (int i = first; i < end; i++) {
+		PhysicalLocation location = get_physical_sector(i);
+		ws->state[workspace_index(ws, location.stripe_number, location.device_index, location.place_in_block)] |= SECTOR_TOUCHED;
+	}
+}
+
+bool is_touched(IN StripeWorkspace* ws, IN int stripe, IN int device_index, IN int place_in_block) {
+	return (ws->state[workspace_index(ws, stripe, device_index, place_in_block)] & SECTOR_TOUCHED);
+}
+
+// Copies the request's data between the caller's buffer and the workspace, data holds the whole request
+void copy_request_data(IN StripeWorkspace* ws, IN int sector, IN int count, IN OUT char* data, IN bool to_workspace) {
+	int first = 0;
+	int end = 0;
+	clip_to_workspace(ws, sector, count, &first, &end);
+	for (int i = first; i < end; i++) {
+		PhysicalLocation location = get_physical_sector(i);
+		char* in_workspace = workspace_sector(ws, location.stripe_number, location.device_index, location.place_in_block);
+		char* in_request = data + ((size_t)(i - sector) * g_sector_size);
+		if (to_workspace) {
+			memcpy(in_workspace, in_request, g_sector_size);
+		}
+		else {
+			memcpy(in_request, in_workspace, g_sector_size);
+		}
+	}
+}
+
+// Plans the reads needed to get every touched sector of the workspace, returns false if a touched sector
+// can't be read or reconstructed with the devices we have left
+bool plan_workspace_read(IN OUT StripeWorkspace* ws) {
+	for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+		if (!is_stripe_allocated(stripe)) {
+			zero_workspace_stripe(ws, stripe);
+			continue;
+		}
+
+		int data_index_of_device[g_num_dev];
+		get_stripe_map(stripe, data_index_of_device);
+		int failed_data = 0;
+		for (int dev = 0; dev < g_num_dev; dev++) {
+			if (data_index_of_device[dev] >= 0 && !is_device_in_sync(dev, stripe)) {
+				failed_data++;
+			}
+		}
+
+		for (int place = 0; place < g_sectors_per_block; place++) {
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				if (!is_touched(ws, stripe, dev, place)) {
+					continue;
+				}
+				if (is_device_in_sync(dev, stripe)) {
+					plan_column_read(ws, stripe, place, dev);
+					continue;
+				}
+
+				if (failed_data > count_alive_parities(stripe)) {
+					g_last_bad_device = dev;
+					return false;
+				}
+				ws->state[workspace_index(ws, stripe, dev, place)] |= SECTOR_FAILED;
+				plan_column_read_all_alive(ws, stripe, place);
+			}
+		}
+	}
+	return true;
+}
+
+void reconstruct_failed_sectors(IN OUT StripeWorkspace* ws) {
+	for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+		for (int place = 0; place < g_sectors_per_block; place++) {
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				if (ws->state[workspace_index(ws, stripe, dev, place)] & SECTOR_FAILED) {
+					// Note - This rebuilds every failed sector of the column at once
+					reconstruct_column(ws, stripe, place);
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Reads the touched sectors of the workspace, retrying with a new plan whenever a device fails mid-way
+bool read_workspace(IN OUT StripeWorkspace* ws, IN int sector, IN int count) {
+	for (int attempt = 0; attempt <= g_num_dev; attempt++) {
+		mark_touched_sectors(ws, sector, count);
+		if (!plan_workspace_read(ws)) {
+			ws->reads.count = 0;
+			return false;
+		}
+		if (submit_batch(&ws->reads, false)) {
+			reconstruct_failed_sectors(ws);
+			return true;
+		}
+	}
+	return false;
+}
+
+typedef enum ColumnWriteMode_e {
+	CWM_DataOnly,
+	CWM_ReadModifyWrite,
+	CWM_ReconstructWrite,
+	CWM_FullReconstruct,
+	CWM_Failed,
+} ColumnWriteMode;
+
+// Picks how to update one column (the sectors at the same place in block on every device of a stripe).
+// A read-modify-write reads the old data and parities of the written sectors, a reconstruct-write reads the
+// data we don't write and computes the parities from scratch - a full stripe write needs no reads at all.
+// A full reconstruct (RAID6 only) is for when both a written and an unwritten data device are down, so the
+// old data of the unwritten one has to be rebuilt before the parities can be recomputed.
+ColumnWriteMode choose_column_write_mode(IN StripeWorkspace* ws, IN int stripe, IN int place_in_block, IN int* data_index_of_device) {
+	int touched = 0;
+	int failed_count = 0;
+	int failed_device = INVALID_DEVICE;
+	bool failed_touched_data = false;
+	bool failed_untouched_data = false;
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		bool is_data = (data_index_of_device[dev] >= 0);
+		bool dev_touched = is_data && is_touched(ws, stripe, dev, place_in_block);
+		if (dev_touched) {
+			touched++;
+		}
+		if (!is_device_in_sync(dev, stripe)) {
+			failed_device = dev;
+			failed_count++;
+			failed_touched_data |= dev_touched;
+			failed_untouched_data |= (is_data && !dev_touched);
+		}
+	}
+
+	if (0 == touched) {
+		return CWM_DataOnly;
+	}
+	if (failed_count > g_parity_count) {
+		g_last_bad_device = failed_device;
+		return CWM_Failed;
+	}
+
+	int alive_parities = count_alive_parities(stripe);
+	if (0 == alive_parities) {
+		return CWM_DataOnly;
+	}
+	if (failed_touched_data) {
+		return failed_untouched_data ? (CWM_FullReconstruct) : (CWM_ReconstructWrite);
+	}
+	if (failed_untouched_data) {
+		return CWM_ReadModifyWrite;
+	}
+
+	int untouched = get_data_devices_in_stripe() - touched;
+	return (touched + alive_parities <= untouched) ? (CWM_ReadModifyWrite) : (CWM_ReconstructWrite);
+}
+
+bool plan_workspace_write(IN OUT StripeWorkspace* ws, OUT ColumnWriteMode* modes) {
+	for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+		int data_index_of_device[g_num_dev];
+		get_stripe_map(stripe, data_index_of_device);
+		bool allocated = is_stripe_allocated(stripe);
+		if (!allocated) {
+			zero_workspace_stripe(ws, stripe);
+		}
+		for (int place = 0; place < g_sectors_per_block; place++) {
+			ColumnWriteMode mode = choose_column_write_mode(ws, stripe, place, data_index_of_device);
+			if (CWM_Failed == mode) {
+				modes[((stripe - ws->first_stripe) * g_sectors_per_block) + place] = mode;
+				return false;
+			}
+			// Note - Everything we don't write in an unallocated stripe is zeros, so we know it without reading
+			if (!allocated && CWM_DataOnly != mode) {
+				mode = CWM_ReconstructWrite;
+				modes[((stripe - ws->first_stripe) * g_sectors_per_block) + place] = mode;
+				continue;
+			}
+			modes[((stripe - ws->first_stripe) * g_sectors_per_block) + place] = mode;
+			if (CWM_FullReconstruct == mode) {
+				plan_column_read_all_alive(ws, stripe, place);
+				continue;
+			}
+
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				bool is_data = (data_index_of_device[dev] >= 0);
+				bool touched = is_data && is_touched(ws, stripe, dev, place);
+				if (CWM_ReadModifyWrite == mode && (touched || !is_data) && is_device_in_sync(dev, stripe)) {
+					plan_column_read(ws, stripe, place, dev);
+				}
+				else if (CWM_ReconstructWrite == mode && !touched && is_data) {
+					plan_column_read(ws, stripe, place, dev);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Folds the data of the touched sectors in or out of the parities of a read-modify-write column
+void fold_touched_data_into_parity(IN OUT StripeWorkspace* ws, IN int stripe, IN int place_in_block, IN int* data_index_of_device) {
+	char* p = workspace_sector(ws, stripe, get_parity_index_in_stripe(stripe), place_in_block);
+	char* q = (g_parity_count > 1) ? (workspace_sector(ws, stripe, get_q_index_in_stripe(stripe), place_in_block)) : (NULL);
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		int data_index = data_index_of_device[dev];
+		if (data_index < 0 || !is_touched(ws, stripe, dev, place_in_block)) {
+			continue;
+		}
+		char* data = workspace_sector(ws, stripe, dev, place_in_block);
+		xor_block(p, data, g_sector_size);
+		if (NULL != q) {
+			gf_mul_xor_block(q, data, gf_pow2(data_index), g_sector_size);
+		}
+	}
+}
+
+// Computes the new parities of every column and queues the writes of the new data and parities
+void apply_workspace_write(IN OUT StripeWorkspace* ws, IN ColumnWriteMode* modes, IN char* new_data, IN int sector, IN int count) {
+	for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+		int data_index_of_device[g_num_dev];
+		get_stripe_map(stripe, data_index_of_device);
+		for (int place = 0; place < g_sectors_per_block; place++) {
+			ColumnWriteMode mode = modes[((stripe - ws->first_stripe) * g_sectors_per_block) + place];
+			if (CWM_ReadModifyWrite == mode) {
+				// Take the old data out of the parities now, the new data is folded in once it's copied in below
+				fold_touched_data_into_parity(ws, stripe, place, data_index_of_device);
+			}
+			else if (CWM_FullReconstruct == mode) {
+				reconstruct_column(ws, stripe, place);
+			}
+		}
+	}
+
+	copy_request_data(ws, sector, count, new_data, true);
+
+	for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+		int data_index_of_device[g_num_dev];
+		get_stripe_map(stripe, data_index_of_device);
+		for (int place = 0; place < g_sectors_per_block; place++) {
+			ColumnWriteMode mode = modes[((stripe - ws->first_stripe) * g_sectors_per_block) + place];
+			if (CWM_ReadModifyWrite == mode) {
+				fold_touched_data_into_parity(ws, stripe, place, data_index_of_device);
+			}
+			else if (CWM_ReconstructWrite == mode || CWM_FullReconstruct == mode) {
+				compute_column_parity(ws, stripe, place, data_index_of_device);
+			}
+
+			bool column_touched = false;
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				if (data_index_of_device[dev] < 0) {
+					continue;
+				}
+				bool touched = is_touched(ws, stripe, dev, place);
+				column_touched |= touched;
+				if (touched && is_device_in_sync(dev, stripe)) {
+					batch_add(&ws->writes, column_location(stripe, dev, place), workspace_sector(ws, stripe, dev, place));
+				}
+			}
+
+			if (!column_touched || CWM_DataOnly == mode) {
+				continue;
+			}
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				if (data_index_of_device[dev] < 0 && is_device_in_sync(dev, stripe)) {
+					batch_add(&ws->writes, column_location(stripe, dev, place), workspace_sector(ws, stripe, dev, place));
+				}
+			}
+		}
+	}
+}
+
+bool write_workspace(IN OUT StripeWorkspace* ws, IN char* new_data, IN int sector, IN int count) {
+	ColumnWriteMode modes[ws->stripe_count * g_sectors_per_block];
+
+	bool reads_ok = false;
+	for (int attempt = 0; attempt <= g_num_dev && !reads_ok; attempt++) {
+		mark_touched_sectors(ws, sector, count);
+		if (!plan_workspace_write(ws, modes)) {
+			ws->reads.count = 0;
+			return false;
+		}
+		reads_ok = submit_batch(&ws->reads, false);
+	}
+	if (!reads_ok) {
+		return false;
+	}
+
+	apply_workspace_write(ws, modes, new_data, sector, count);
+
+	begin_stripe_write(ws->first_stripe, ws->first_stripe + ws->stripe_count - 1);
+	if (!journal_batch(&ws->writes)) {
+		ws->writes.count = 0;
+		return false;
+	}
+
+	// Note - A device failing here only degrades the stripes, the parity we write already covers its new data
+	submit_batch(&ws->writes, true);
+	end_stripe_write();
+	return true;
+}
+
+typedef enum RangedMode_e {
+	RM_Read = 0,
+	RM_Write,
+	// Reads the range and writes it back, under the same stripe locks so no other write can slip in between
+	RM_Rewrite,
+} RangedMode;
+
+// Runs a ranged operation one workspace worth of stripes at a time, data is the caller's buffer for the
+// whole range (count sectors) and holds the data to write or receives the data read
+bool ranged_operation(IN int sector, IN int count, IN OUT char* data, IN RangedMode mode) {
+	StripeWorkspace ws = {0};
+	init_workspace(&ws);
+
+	bool result = true;
+	int first_stripe = get_physical_sector(sector).stripe_number;
+	int last_stripe = get_physical_sector(sector + count - 1).stripe_number;
+	for (int stripe = first_stripe; stripe <= last_stripe && result; stripe += ws.stripe_count) {
+		ws.first_stripe = stripe;
+		ws.stripe_count = stripes_per_workspace();
+		if (ws.first_stripe + ws.stripe_count > last_stripe + 1) {
+			ws.stripe_count = last_stripe + 1 - ws.first_stripe;
+		}
+
+		set_stripe_locks(ws.first_stripe, ws.stripe_count, true);
+		if (RM_Write != mode) {
+			result = read_workspace(&ws, sector, count);
+			if (result) {
+				copy_request_data(&ws, sector, count, data, false);
+			}
+		}
+		if (RM_Read != mode && result) {
+			result = write_workspace(&ws, data, sector, count);
+		}
+		set_stripe_locks(ws.first_stripe, ws.stripe_count, false);
+	}
+
+	free_workspace(&ws);
+	return result;
+}
+
+bool ranged_read_operation_with_data(int sector, int count, OUT char* data) {
+	bool result = ranged_operation(sector, count, data, RM_Read);
+	if (!result) {
+		print_bad_operation_on_device();
+	}
+	return result;
+}
+
+bool ranged_read_operation(int sector, int count) {
+	char* data = malloc((size_t)count * g_sector_size);
+	assert(NULL != data);
+	bool result = ranged_read_operation_with_data(sector, count, data);
+	free(data);
+	return result;
+}
+
+bool ranged_write_operation_with_data(int sector, int count, IN char* data) {
+	bool result = ranged_operation(sector, count, data, RM_Write);
+	if (!result) {
+		print_bad_operation_on_device();
+	}
+	return result;
+}
+
+bool ranged_write_operation(int sector, int count) {
+	// Note - A write without data rewrites what's already there, so we read the range (reconstructing what
+	// Note - lives on failed devices) and write it back through the normal ranged write
+	char* data = malloc((size_t)count * g_sector_size);
+	assert(NULL != data);
+	bool result = ranged_operation(sector, count, data, RM_Rewrite);
+	if (!result) {
+		print_bad_operation_on_device();
+	}
+	free(data);
+	return result;
+}
+
+int get_device_stripe_count() {
+	off_t smallest = -1;
+	for (int i = 0; i < g_num_dev; i++) {
+		struct stat st = {0};
+		if (INVALID_DEVICE != g_dev_status[i] && 0 == fstat(g_dev_status[i], &st)) {
+			smallest = (smallest < 0 || st.st_size < smallest) ? (st.st_size) : (smallest);
+		}
+	}
+	return (smallest < 0) ? (0) : (int)(smallest / ((off_t)g_sectors_per_block * g_sector_size));
+}
+
+// Recomputes the parities of every allocated stripe in the workspace from its data, all the data devices must be working
+bool resync_workspace(IN OUT StripeWorkspace* ws) {
+	bool reads_ok = false;
+	for (int attempt = 0; attempt <= g_num_dev && !reads_ok; attempt++) {
+		memset(ws->state, 0, (size_t)ws->stripe_count * g_num_dev * g_sectors_per_block);
+		for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+			for (int dev = 0; dev < g_num_dev && is_stripe_allocated(stripe); dev++) {
+				if (is_parity_device(stripe, dev)) {
+					continue;
+				}
+				if (!is_device_in_sync(dev, stripe)) {
+					g_last_bad_device = dev;
+					ws->reads.count = 0;
+					return false;
+				}
+				for (int place = 0; place < g_sectors_per_block; place++) {
+					plan_column_read(ws, stripe, place, dev);
+				}
+			}
+		}
+		reads_ok = submit_batch(&ws->reads, false);
+	}
+	if (!reads_ok) {
+		return false;
+	}
+
+	for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+		int data_index_of_device[g_num_dev];
+		get_stripe_map(stripe, data_index_of_device);
+		for (int place = 0; place < g_sectors_per_block && is_stripe_allocated(stripe); place++) {
+			compute_column_parity(ws, stripe, place, data_index_of_device);
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				if (data_index_of_device[dev] < 0 && is_device_in_sync(dev, stripe)) {
+					batch_add(&ws->writes, column_location(stripe, dev, place), workspace_sector(ws, stripe, dev, place));
+				}
+			}
+		}
+	}
+	submit_batch(&ws->writes, true);
+	return true;
+}
+
+bool resync_stripes(IN int first_stripe, IN int stripe_count) {
+	StripeWorkspace ws = {0};
+	init_workspace(&ws);
+
+	bool result = true;
+	int end_stripe = first_stripe + stripe_count;
+	for (int stripe = first_stripe; stripe < end_stripe && result; stripe += ws.stripe_count) {
+		ws.first_stripe = stripe;
+		ws.stripe_count = stripes_per_workspace();
+		if (ws.first_stripe + ws.stripe_count > end_stripe) {
+			ws.stripe_count = end_stripe - ws.first_stripe;
+		}
+		set_stripe_locks(ws.first_stripe, ws.stripe_count, true);
+		result = resync_workspace(&ws);
+		set_stripe_locks(ws.first_stripe, ws.stripe_count, false);
+	}
+
+	free_workspace(&ws);
+	return result;
+}
+
+// Redoes every complete record in the journal, a torn record at the end is one whose writes never started
+void replay_journal() {
+	int replayed = 0;
+	off_t offset = 0;
+	JournalRecordHeader header = {0};
+	while (sizeof(header) == pread(g_journal.fd, &header, sizeof(header), offset)) {
+		if (JOURNAL_MAGIC != header.magic || (uint32_t)g_sector_size != header.sector_size || 0 == header.entry_count) {
+			break;
+		}
+
+		size_t entries_size = header.entry_count * sizeof(JournalEntry);
+		size_t body_size = entries_size + ((size_t)header.entry_count * g_sector_size);
+		char* body = aligned_alloc(sizeof(uint64_t), body_size);
+		assert(NULL != body);
+		bool record_ok = ((ssize_t)body_size == pread(g_journal.fd, body, body_size, offset + sizeof(header))) &&
+						 (header.checksum == checksum_block(0xcbf29ce484222325ULL, body, body_size));
+		if (record_ok) {
+			JournalEntry* entries = (JournalEntry*)body;
+			char* data = body + entries_size;
+			for (uint32_t i = 0; i < header.entry_count; i++) {
+				int dev_num = entries[i].device_index;
+				if (dev_num < g_num_dev && INVALID_DEVICE != g_dev_status[dev_num]) {
+					// Note - The data in the record isn't aligned for O_DIRECT devices
+					memcpy(g_io_buffer, data + ((size_t)i * g_sector_size), g_sector_size);
+					pwrite(g_dev_status[dev_num], g_io_buffer, g_sector_size, (off_t)entries[i].sector * g_sector_size);
+				}
+			}
+			replayed++;
+		}
+		free(body);
+		if (!record_ok) {
+			break;
+		}
+		offset += sizeof(header) + body_size;
+	}
+
+	if (replayed > 0) {
+		printf("Replayed %d journal records\n", replayed);
+	}
+	g_journal.size = offset;
+}
+
+void resync_dirty_regions() {
+	int stripe_count = get_device_stripe_count();
+	for (int region = 0; region < g_bitmap.region_count; region++) {
+		if (!is_bitmap_bit_set(region)) {
+			continue;
+		}
+		int first_stripe = region * g_bitmap.region_stripes;
+		if (first_stripe >= stripe_count) {
+			continue;
+		}
+		int region_stripes = (first_stripe + g_bitmap.region_stripes > stripe_count) ? (stripe_count - first_stripe) : (g_bitmap.region_stripes);
+		printf("Resyncing dirty region %d (stripes %d to %d)\n", region, first_stripe, first_stripe + region_stripes - 1);
+		if (!resync_stripes(first_stripe, region_stripes)) {
+			printf("Can't resync region %d, device %d is bad\n", region, g_last_bad_device);
+		}
+	}
+}
+
+bool open_bitmap(IN const char* path) {
+	g_bitmap.fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (INVALID_DEVICE == g_bitmap.fd) {
+		printf("Failed to open the write-intent bitmap %s with error %s\n", path, strerror(errno));
+		return false;
+	}
+
+	BitmapHeader header = {0};
+	ssize_t result = pread(g_bitmap.fd, &header, sizeof(header), 0);
+	if (0 == result) {
+		header.magic = BITMAP_MAGIC;
+		header.region_stripes = g_bitmap.region_stripes;
+		result = pwrite(g_bitmap.fd, &header, sizeof(header), 0);
+		return (sizeof(header) == result);
+	}
+	if (sizeof(header) != result || BITMAP_MAGIC != header.magic || 0 == header.region_stripes) {
+		printf("%s is not a write-intent bitmap\n", path);
+		return false;
+	}
+
+	// Note - The regions of an existing bitmap are whatever they were when it was written
+	g_bitmap.region_stripes = header.region_stripes;
+	struct stat st = {0};
+	fstat(g_bitmap.fd, &st);
+	int bytes = st.st_size - sizeof(header);
+	grow_bitmap(bytes * 8);
+	return (bytes == pread(g_bitmap.fd, g_bitmap.bits, bytes, sizeof(header)));
+}
+
+bool open_journal(IN const char* path) {
+	g_journal.fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (INVALID_DEVICE == g_journal.fd) {
+		printf("Failed to open the journal %s with error %s\n", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Brings the stripes back to a consistent state after an unclean shutdown
+void recover_after_crash() {
+	if (INVALID_DEVICE != g_journal.fd) {
+		replay_journal();
+	}
+	if (INVALID_DEVICE != g_bitmap.fd) {
+		resync_dirty_regions();
+	}
+	checkpoint();
+}
+
+void close_durability_files() {
+	checkpoint();
+	if (INVALID_DEVICE != g_bitmap.fd) {
+		close(g_bitmap.fd);
+		free(g_bitmap.bits);
+	}
+	if (INVALID_DEVICE != g_journal.fd) {
+		close(g_journal.fd);
+	}
+}
+
+// Scrubbing streams every device from start to end in big sequential windows (one reader thread per device,
+// double buffered, or mmap with readahead) and checks the parities of every column against its data.
+typedef struct {
+	int device_index;
+	int window_count;
+	size_t window_size;
+	char* buffers[SCRUB_BUFFERS];
+	bool filled[SCRUB_BUFFERS];
+	// Note - Per slot, a window that failed mustn't make the windows read into the slot after it look failed
+	bool failed[SCRUB_BUFFERS];
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t thread;
+} ScrubReader;
+
+typedef struct {
+	bool repair;
+	// Bytes per second over all the devices, 0 for no limit
+	double bandwidth_limit;
+	long columns;
+	long mismatches;
+	long repaired;
+} ScrubContext;
+
+void* scrub_reader_logic(void* param) {
+	ScrubReader* reader = param;
+	for (int window = 0; window < reader->window_count; window++) {
+		int slot = window % SCRUB_BUFFERS;
+		int result = pthread_mutex_lock(&reader->lock);
+		PTHREAD_ASSERT(result);
+		while (reader->filled[slot]) {
+			result = pthread_cond_wait(&reader->changed, &reader->lock);
+			PTHREAD_ASSERT(result);
+		}
+		result = pthread_mutex_unlock(&reader->lock);
+		PTHREAD_ASSERT(result);
+
+		off_t offset = (off_t)window * reader->window_size;
+		size_t done = 0;
+		reader->failed[slot] = false;
+		while (done < reader->window_size) {
+			ssize_t read_size = pread(g_dev_status[reader->device_index], reader->buffers[slot] + done, reader->window_size - done, offset + done);
+			if (read_size <= 0) {
+				reader->failed[slot] = true;
+				break;
+			}
+			done += read_size;
+		}
+
+		result = pthread_mutex_lock(&reader->lock);
+		PTHREAD_ASSERT(result);
+		reader->filled[slot] = true;
+		result = pthread_cond_broadcast(&reader->changed);
+		PTHREAD_ASSERT(result);
+		result = pthread_mutex_unlock(&reader->lock);
+		PTHREAD_ASSERT(result);
+	}
+	return NULL;
+}
+
+// Waits for the slot to hold the reader's window
+void wait_for_scrub_slot(IN OUT ScrubReader* reader, IN int slot) {
+	int result = pthread_mutex_lock(&reader->lock);
+	PTHREAD_ASSERT(result);
+	while (!reader->filled[slot]) {
+		result = pthread_cond_wait(&reader->changed, &reader->lock);
+		PTHREAD_ASSERT(result);
+	}
+	result = pthread_mutex_unlock(&reader->lock);
+	PTHREAD_ASSERT(result);
+}
+
+// Hands the slot back to the reader so it can read the window after next into it
+void release_scrub_slot(IN OUT ScrubReader* reader, IN int slot) {
+	int result = pthread_mutex_lock(&reader->lock);
+	PTHREAD_ASSERT(result);
+	reader->filled[slot] = false;
+	result = pthread_cond_broadcast(&reader->changed);
+	PTHREAD_ASSERT(result);
+	result = pthread_mutex_unlock(&reader->lock);
+	PTHREAD_ASSERT(result);
+}
+
+// Checks (and optionally repairs) every column of the stripes in a window, device_windows[dev] points at the
+// start of the window in each device
+void scrub_window(IN OUT ScrubContext* context, IN char** device_windows, IN int first_stripe, IN int stripe_count) {
+	char* column[g_num_dev];
+	char* q_syndrome = allocate_io_buffer(g_sector_size);
+
+	for (int stripe = first_stripe; stripe < first_stripe + stripe_count; stripe++) {
+		int data_index_of_device[g_num_dev];
+		get_stripe_map(stripe, data_index_of_device);
+		int p_device = get_parity_index_in_stripe(stripe);
+		int q_device = (g_parity_count > 1) ? (get_q_index_in_stripe(stripe)) : (INVALID_DEVICE);
+
+		for (int place = 0; place < g_sectors_per_block; place++) {
+			size_t offset_in_window = ((size_t)((stripe - first_stripe) * g_sectors_per_block) + place) * g_sector_size;
+			int column_size = 0;
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				if (dev != q_device) {
+					column[column_size++] = device_windows[dev] + offset_in_window;
+				}
+			}
+
+			// P is fine when the xor of the data and P is zero, Q when it matches the Q we compute from the data
+			bool p_ok = xor_is_zero(column, column_size, g_sector_size);
+			bool q_ok = true;
+			if (INVALID_DEVICE != q_device) {
+				memset(q_syndrome, 0, g_sector_size);
+				for (int dev = 0; dev < g_num_dev; dev++) {
+					if (data_index_of_device[dev] >= 0) {
+						gf_mul_xor_block(q_syndrome, device_windows[dev] + offset_in_window, gf_pow2(data_index_of_device[dev]), g_sector_size);
+					}
+				}
+				q_ok = (0 == memcmp(q_syndrome, device_windows[q_device] + offset_in_window, g_sector_size));
+			}
+
+			context->columns++;
+			if (p_ok && q_ok) {
+				continue;
+			}
+
+			context->mismatches++;
+			printf("Parity mismatch in stripe %d, place in block %d (%s)\n", stripe, place,
+				   !p_ok && !q_ok ? "P and Q" : (!p_ok ? "P" : "Q"));
+			if (!context->repair) {
+				continue;
+			}
+
+			// Note - Like md we trust the data and rewrite the parities from it
+			PhysicalLocation location = column_location(stripe, p_device, place);
+			char* p = allocate_io_buffer(g_sector_size);
+			memset(p, 0, g_sector_size);
+			for (int dev = 0; dev < g_num_dev; dev++) {
+				if (data_index_of_device[dev] >= 0) {
+					xor_block(p, device_windows[dev] + offset_in_window, g_sector_size);
+				}
+			}
+			bool repaired = (g_sector_size == pwrite(g_dev_status[p_device], p, g_sector_size, physical_location_to_offset(location)));
+			if (INVALID_DEVICE != q_device) {
+				location = column_location(stripe, q_device, place);
+				repaired &= (g_sector_size == pwrite(g_dev_status[q_device], q_syndrome, g_sector_size, physical_location_to_offset(location)));
+			}
+			context->repaired += repaired ? (1) : (0);
+			free(p);
+		}
+	}
+
+	free(q_syndrome);
+}
+
+double get_elapsed_seconds(IN struct timespec* start) {
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+// Sleeps for as long as we are ahead of the bandwidth limit
+void throttle_scrub(IN ScrubContext* context, IN struct timespec* start, IN double bytes_done) {
+	if (context->bandwidth_limit <= 0) {
+		return;
+	}
+	double ahead = (bytes_done / context->bandwidth_limit) - get_elapsed_seconds(start);
+	if (ahead > 0) {
+		usleep((useconds_t)(ahead * 1000000));
+	}
+}
+
+void scrub_with_readers(IN OUT ScrubContext* context, IN int stripe_count, IN int stripes_per_window, IN struct timespec* start) {
+	int window_count = (stripe_count + stripes_per_window - 1) / stripes_per_window;
+	size_t window_size = (size_t)stripes_per_window * g_sectors_per_block * g_sector_size;
+	ScrubReader readers[g_num_dev];
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		ScrubReader* reader = &readers[dev];
+		memset(reader, 0, sizeof(*reader));
+		reader->device_index = dev;
+		// Note - The last window may be partial, the readers stop at the last whole window and we read the tail below
+		reader->window_count = stripe_count / stripes_per_window;
+		reader->window_size = window_size;
+		for (int slot = 0; slot < SCRUB_BUFFERS; slot++) {
+			reader->buffers[slot] = allocate_io_buffer(window_size);
+			assert(NULL != reader->buffers[slot]);
+		}
+		int result = pthread_mutex_init(&reader->lock, NULL);
+		PTHREAD_ASSERT(result);
+		result = pthread_cond_init(&reader->changed, NULL);
+		PTHREAD_ASSERT(result);
+		result = pthread_create(&reader->thread, NULL, scrub_reader_logic, reader);
+		PTHREAD_ASSERT(result);
+	}
+
+	char* device_windows[g_num_dev];
+	double bytes_done = 0;
+	for (int window = 0; window < window_count; window++) {
+		int slot = window % SCRUB_BUFFERS;
+		int first_stripe = window * stripes_per_window;
+		int window_stripes = (first_stripe + stripes_per_window > stripe_count) ? (stripe_count - first_stripe) : (stripes_per_window);
+		bool window_ok = true;
+		for (int dev = 0; dev < g_num_dev; dev++) {
+			if (window_stripes == stripes_per_window) {
+				wait_for_scrub_slot(&readers[dev], slot);
+				window_ok &= !readers[dev].failed[slot];
+			}
+			else {
+				size_t tail_size = (size_t)window_stripes * g_sectors_per_block * g_sector_size;
+				window_ok &= ((ssize_t)tail_size == pread(g_dev_status[dev], readers[dev].buffers[slot], tail_size, (off_t)window * window_size));
+			}
+			device_windows[dev] = readers[dev].buffers[slot];
+		}
+
+		if (window_ok) {
+			scrub_window(context, device_windows, first_stripe, window_stripes);
+		}
+		else {
+			printf("Failed reading stripes %d to %d, skipping them\n", first_stripe, first_stripe + window_stripes - 1);
+		}
+
+		for (int dev = 0; dev < g_num_dev && window_stripes == stripes_per_window; dev++) {
+			release_scrub_slot(&readers[dev], slot);
+		}
+		bytes_done += (double)window_stripes * g_sectors_per_block * g_sector_size * g_num_dev;
+		throttle_scrub(context, start, bytes_done);
+	}
+
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		int result = pthread_join(readers[dev].thread, NULL);
+		PTHREAD_ASSERT(result);
+		pthread_mutex_destroy(&readers[dev].lock);
+		pthread_cond_destroy(&readers[dev].changed);
+		for (int slot = 0; slot < SCRUB_BUFFERS; slot++) {
+			free(readers[dev].buffers[slot]);
+		}
+	}
+}
+
+void scrub_with_mmap(IN OUT ScrubContext* context, IN int stripe_count, IN int stripes_per_window, IN struct timespec* start) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t window_size = (size_t)stripes_per_window * g_sectors_per_block * g_sector_size;
+	char* mappings[g_num_dev];
+	size_t mapping_sizes[g_num_dev];
+	char* device_windows[g_num_dev];
+	double bytes_done = 0;
+
+	for (int first_stripe = 0; first_stripe < stripe_count; first_stripe += stripes_per_window) {
+		int window_stripes = (first_stripe + stripes_per_window > stripe_count) ? (stripe_count - first_stripe) : (stripes_per_window);
+		off_t offset = (off_t)first_stripe * g_sectors_per_block * g_sector_size;
+		// Note - mmap offsets must be page aligned while windows only have to be sector aligned
+		off_t mapping_offset = offset & ~((off_t)page_size - 1);
+		size_t size = (size_t)window_stripes * g_sectors_per_block * g_sector_size;
+		bool window_ok = true;
+
+		for (int dev = 0; dev < g_num_dev; dev++) {
+			mapping_sizes[dev] = size + (offset - mapping_offset);
+			mappings[dev] = mmap(NULL, mapping_sizes[dev], PROT_READ, MAP_SHARED, g_dev_status[dev], mapping_offset);
+			if (MAP_FAILED == mappings[dev]) {
+				window_ok = false;
+				continue;
+			}
+			madvise(mappings[dev], mapping_sizes[dev], MADV_SEQUENTIAL);
+			// Start the readahead of the next window while we check this one
+			posix_fadvise(g_dev_status[dev], offset + size, window_size, POSIX_FADV_WILLNEED);
+			device_windows[dev] = mappings[dev] + (offset - mapping_offset);
+		}
+
+		if (window_ok) {
+			scrub_window(context, device_windows, first_stripe, window_stripes);
+		}
+		else {
+			printf("Failed mapping stripes %d to %d with error %s, skipping them\n", first_stripe, first_stripe + window_stripes - 1, strerror(errno));
+		}
+
+		for (int dev = 0; dev < g_num_dev; dev++) {
+			if (MAP_FAILED != mappings[dev]) {
+				munmap(mappings[dev], mapping_sizes[dev]);
+			}
+		}
+		bytes_done += (double)size * g_num_dev;
+		throttle_scrub(context, start, bytes_done);
+	}
+}
+
+void run_scrub(IN bool repair, IN bool use_mmap, IN double megabytes_per_second) {
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		if (!is_device_alive(dev)) {
+			printf("Can't scrub with bad device %d\n", dev);
+			return;
+		}
+	}
+
+	ScrubContext context = {0};
+	context.repair = repair;
+	context.bandwidth_limit = megabytes_per_second * 1024 * 1024;
+
+	int stripe_count = get_device_stripe_count();
+	int stripes_per_window = SCRUB_WINDOW_SIZE / (g_sectors_per_block * g_sector_size);
+	stripes_per_window = (stripes_per_window > 0) ? (stripes_per_window) : (1);
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (use_mmap) {
+		scrub_with_mmap(&context, stripe_count, stripes_per_window, &start);
+	}
+	else {
+		scrub_with_readers(&context, stripe_count, stripes_per_window, &start);
+	}
+	if (repair) {
+		sync_devices();
+	}
+	double elapsed = get_elapsed_seconds(&start);
+
+	double megabytes = (double)stripe_count * g_sectors_per_block * g_sector_size * g_num_dev / (1024 * 1024);
+	printf("Scrubbed %d stripes (%.1f MB) in %.2f seconds (%.1f MB/s): %ld columns, %ld mismatched, %ld repaired\n",
+		   stripe_count, megabytes, elapsed, megabytes / elapsed, context.columns, context.mismatches, context.repaired);
+}
+
+// Returns false if the device can't do O_DIRECT I/O of our sector size (it's smaller than the device's block)
+bool probe_direct_io(IN int fd) {
+	char* buffer = allocate_io_buffer(g_sector_size);
+	bool result = (-1 != pread(fd, buffer, g_sector_size, 0) || EINVAL != errno);
+	free(buffer);
+	return result;
+}
+
+void open_device(int device_index) {
+	assert(device_index <= g_num_dev && device_index >= 0);
+
+	int fd = open(device_string(device_index), O_RDWR | (g_direct_io ? O_DIRECT : 0));
+	if (g_direct_io && ((INVALID_DEVICE == fd && EINVAL == errno) || (INVALID_DEVICE != fd && !probe_direct_io(fd)))) {
+		// Note - Some file systems (tmpfs for one) don't do O_DIRECT at all, those devices go through the page cache
+		printf("Device %s doesn't support O_DIRECT, using buffered I/O for it\n", device_string(device_index));
+		if (INVALID_DEVICE != fd) {
+			close(fd);
+		}
+		fd = open(device_string(device_index), O_RDWR);
+	}
+	g_dev_status[device_index] = fd;
+	// TODO - Should check if we need to print an error here in case of failure
+	if (INVALID_DEVICE == g_dev_status[device_index]) {
+		printf("Failed to open device %s index %d with error %s\n", device_string(device_index), device_index, strerror(errno));
+	}
+}
+
+void repair_device(int device_index) {
+	// Based on answers here http://moodle.tau.ac.il/mod/forum/discuss.php?d=50752
+	assert(device_index <= g_num_dev && device_index >= 0);
+
+	int old_device = g_dev_status[device_index];
+	open_device(device_index);
+	if (INVALID_DEVICE == g_dev_status[device_index]) {
+		g_dev_status[device_index] = old_device;
+	} 
+	else if (INVALID_DEVICE != old_device) {
+		close(old_device);
+	}
+
+}
+
+void open_devices() {
+	for (int i = 0; i < g_num_dev; i++) {
+		open_device(i);
+	}
+}
+
+void close_devices() {
+	for (int i = 0; i < g_num_dev; i++) {
+		close_device(i);
+	}
+	close_retired_devices();
+}
+
+// Makes the stripes read as zeros on the device, by punching a hole over them (or writing zeros if the file
+// system can't punch holes). Every device's blocks of a range of stripes are a single range in the device.
+bool discard_device_stripes(IN int device_index, IN int first_stripe, IN int stripe_count) {
+	int fd = get_device_fd(device_index);
+	if (INVALID_DEVICE == fd) {
+		g_last_bad_device = device_index;
+		return false;
+	}
+
+	off_t stripe_size = (off_t)g_sectors_per_block * g_sector_size;
+	off_t offset = first_stripe * stripe_size;
+	off_t length = stripe_count * stripe_size;
+	bool result = (0 == fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length));
+	if (!result && EOPNOTSUPP == errno) {
+		char* zeros = allocate_io_buffer(stripe_size);
+		memset(zeros, 0, stripe_size);
+		result = true;
+		for (off_t done = 0; done < length && result; done += stripe_size) {
+			result = (stripe_size == pwrite(fd, zeros, stripe_size, offset + done));
+		}
+		free(zeros);
+	}
+	if (!result) {
+		printf("Discard operation failed on bad device %s (index %d) with error %s\n", device_string(device_index), device_index, strerror(errno));
+		g_last_bad_device = device_index;
+		close_device(device_index);
+		return false;
+	}
+
+	if (g_trace) {
+		printf("Discard on device %d, sectors %d to %d\n", device_index, first_stripe * g_sectors_per_block,
+			   (first_stripe + stripe_count) * g_sectors_per_block - 1);
+	}
+	return true;
+}
+
+// Discards the whole stripes in the range from every device, the partial stripes at its ends are left as they
+// are. Must be called with the devices held exclusively.
+bool ranged_discard_operation(int sector, int count) {
+	int stripe_sectors = get_data_devices_in_stripe() * g_sectors_per_block;
+	int first_stripe = (sector + stripe_sectors - 1) / stripe_sectors;
+	int end_stripe = (sector + count) / stripe_sectors;
+	if (end_stripe <= first_stripe) {
+		return true;
+	}
+
+	// Note - Replaying journal records of these stripes after we discard them would leave their parities wrong
+	checkpoint();
+	begin_stripe_write(first_stripe, end_stripe - 1);
+	bool result = true;
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		// Note - A bad device is left as it is, it reads as zeros here once it's rebuilt
+		if (is_device_alive(dev) && !discard_device_stripes(dev, first_stripe, end_stripe - first_stripe)) {
+			result = false;
+		}
+	}
+	if (result) {
+		set_stripes_allocated(first_stripe, end_stripe - 1, false);
+	}
+	end_stripe_write();
+
+	if (!result) {
+		print_bad_operation_on_device();
+	}
+	return result;
+}
+
+// Builds the allocation map from the holes of the devices, a stripe is allocated if any device has data in it
+void init_allocation_map() {
+	g_allocation.stripe_count = get_device_stripe_count();
+	g_allocation.bits = calloc((g_allocation.stripe_count + 7) / 8 + 1, 1);
+	assert(NULL != g_allocation.bits);
+
+	off_t stripe_size = (off_t)g_sectors_per_block * g_sector_size;
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		if (!is_device_alive(dev)) {
+			continue;
+		}
+		off_t data = 0;
+		off_t hole = 0;
+		while (-1 != (data = lseek(g_dev_status[dev], hole, SEEK_DATA))) {
+			hole = lseek(g_dev_status[dev], data, SEEK_HOLE);
+			if (-1 == hole) {
+				break;
+			}
+			set_stripes_allocated(data / stripe_size, (hole - 1) / stripe_size, true);
+		}
+		// Note - ENXIO is the end of the data, anything else means we can't tell where the holes are
+		if (ENXIO != errno) {
+			set_stripes_allocated(0, g_allocation.stripe_count - 1, true);
+		}
+	}
+}
+
+void free_allocation_map() {
+	free(g_allocation.bits);
+	g_allocation.bits = NULL;
+	g_allocation.stripe_count = 0;
+}
+
+// Rewrites every column of device_index in the workspace stripes from the rest of its stripe, and only
+// discards it in the stripes that aren't allocated
+bool rebuild_workspace(IN OUT StripeWorkspace* ws, IN int device_index) {
+	bool reads_ok = false;
+	for (int attempt = 0; attempt <= g_num_dev && !reads_ok; attempt++) {
+		memset(ws->state, 0, (size_t)ws->stripe_count * g_num_dev * g_sectors_per_block);
+		for (int stripe = ws->first_stripe; stripe < ws->first_stripe + ws->stripe_count; stripe++) {
+			for (int place = 0; place < g_sectors_per_block && is_stripe_allocated(stripe); place++) {
+				plan_column_read_all_alive(ws, stripe, place);
+			}
+		}
+		reads_ok = submit_batch(&ws->reads, false);
+	}
+	if (!reads_ok) {
+		return false;
+	}
+
+	int end_stripe = ws->first_stripe + ws->stripe_count;
+	for (int stripe = ws->first_stripe; stripe < end_stripe; stripe++) {
+		if (!is_stripe_allocated(stripe)) {
+			int unallocated = 1;
+			while (stripe + unallocated < end_stripe && !is_stripe_allocated(stripe + unallocated)) {
+				unallocated++;
+			}
+			// Note - The replaced device may have anything there, but it has to read as zeros like the others
+			if (!discard_device_stripes(device_index, stripe, unallocated)) {
+				ws->writes.count = 0;
+				return false;
+			}
+			stripe += unallocated - 1;
+			continue;
+		}
+
+		int data_index_of_device[g_num_dev];
+		get_stripe_map(stripe, data_index_of_device);
+		for (int place = 0; place < g_sectors_per_block; place++) {
+			// Note - The device isn't in sync in these stripes yet, so this also rebuilds its data sectors
+			if (!reconstruct_column(ws, stripe, place)) {
+				ws->writes.count = 0;
+				return false;
+			}
+			if (data_index_of_device[device_index] < 0) {
+				compute_column_parity(ws, stripe, place, data_index_of_device);
+			}
+			batch_add(&ws->writes, column_location(stripe, device_index, place), workspace_sector(ws, stripe, device_index, place));
+		}
+	}
+	return submit_batch(&ws->writes, true);
+}
+
+// Reopens a replaced device and rewrites its whole content from the other devices. Commands keep running
+// meanwhile (in the server or the workload), the devices are only held one workspace at a time.
+bool rebuild_device(IN int device_index) {
+	lock_devices(true);
+	bool started = (INVALID_DEVICE == g_rebuild_device);
+	if (started) {
+		repair_device(device_index);
+		close_retired_devices();
+		started = is_device_alive(device_index);
+	}
+	if (started) {
+		__atomic_store_n(&g_rebuild_stripe, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&g_rebuild_device, device_index, __ATOMIC_RELEASE);
+	}
+	unlock_devices();
+	if (!started) {
+		printf("Can't rebuild device %d\n", device_index);
+		return false;
+	}
+
+	StripeWorkspace ws = {0};
+	init_workspace(&ws);
+
+	bool result = true;
+	int stripe_count = get_device_stripe_count();
+	for (int stripe = 0; stripe < stripe_count && result; stripe += ws.stripe_count) {
+		ws.first_stripe = stripe;
+		ws.stripe_count = stripes_per_workspace();
+		if (ws.first_stripe + ws.stripe_count > stripe_count) {
+			ws.stripe_count = stripe_count - ws.first_stripe;
+		}
+
+		lock_devices(false);
+		set_stripe_locks(ws.first_stripe, ws.stripe_count, true);
+		g_last_bad_device = device_index;
+		result = is_device_alive(device_index) && rebuild_workspace(&ws, device_index);
+		if (result) {
+			__atomic_store_n(&g_rebuild_stripe, ws.first_stripe + ws.stripe_count, __ATOMIC_RELEASE);
+		}
+		set_stripe_locks(ws.first_stripe, ws.stripe_count, false);
+		unlock_devices();
+	}
+	free_workspace(&ws);
+
+	__atomic_store_n(&g_rebuild_device, INVALID_DEVICE, __ATOMIC_RELEASE);
+	if (!result) {
+		printf("Rebuilding device %d stopped, device %d is bad\n", device_index, g_last_bad_device);
+	}
+	return result;
+}
+
+typedef enum Opcode_e {
+	OP_INVALID = 0,
+	OP_READ,
+	OP_WRITE,
+	OP_REPAIR,
+	OP_KILL,
+	OP_REBUILD,
+	OP_DISCARD,
+	OP_COUNT,
+} Opcode;
+
+// Commands that take a range ("<CMD> <SECTOR> <COUNT>") go through ranged_func when the count isn't 1,
+// a single sector keeps going through func so its device operations stay exactly as they were.
+// The single sector paths only know about a single parity, so RAID6 (and the journal) run everything through ranged_func.
+struct {
+	char* op_name;
+	void (*func)(int param);
+	bool (*ranged_func)(int sector, int count);
+} functions[] = {
+	[OP_READ] = {"READ", read_operation, ranged_read_operation},
+	[OP_WRITE] = {"WRITE", write_operation, ranged_write_operation},
+	[OP_REPAIR] = {"REPAIR", repair_device, NULL},
+	[OP_KILL] = {"KILL", close_device, NULL},
+	// Note - REBUILD runs next to the other commands instead of stopping them, execute_command calls it directly
+	[OP_REBUILD] = {"REBUILD", NULL, NULL},
+	// Note - DISCARD only works on whole stripes, so it has no single sector path
+	[OP_DISCARD] = {"DISCARD", NULL, ranged_discard_operation},
+};
+
+// The commands whose parameter is a device index
+bool is_device_command(IN Opcode opcode) {
+	return (OP_REPAIR == opcode || OP_KILL == opcode || OP_REBUILD == opcode);
+}
+
+// Set while commands may run concurrently (the server), the single sector paths share the global buffers
+// and take no stripe locks so they can't be used then
+bool g_concurrent_commands = false;
+
+bool use_single_sector_path(IN int count) {
+	// Note - Journaling needs the data and parity of a write up front, which only the ranged paths have
+	return (1 == count && 1 == g_parity_count && INVALID_DEVICE == g_journal.fd && !g_concurrent_commands);
+}
+
+// Runs a single command, every command stream (text, binary, benchmark, workload and server) goes through here.
+// payload is the data of a WRITE (or NULL to rewrite what's there), or receives the data of a READ.
+// Returns false if the command was invalid or failed on a bad device (the single sector paths print their own
+// errors and always return true).
+bool execute_command(IN Opcode opcode, IN int param, IN int count, IN OUT char* payload) {
+	if (is_device_command(opcode)) {
+		if (param < 0 || param >= g_num_dev) {
+			printf("Invalid device index: %d\n", param);
+			return false;
+		}
+		if (OP_REBUILD == opcode) {
+			return rebuild_device(param);
+		}
+		// Note - KILL and REPAIR wait for the commands in flight, so no command has a device's fd closed under it
+		lock_devices(true);
+		functions[opcode].func(param);
+		close_retired_devices();
+		unlock_devices();
+		return true;
+	}
+
+	if (count < 1) {
+		printf("Invalid sector count: %d\n", count);
+		return false;
+	}
+	// Note - The ranged paths work on sector + count - 1, which mustn't overflow
+	if (param < 0 || param > INT_MAX - count) {
+		printf("Invalid sector: %d\n", param);
+		return false;
+	}
+
+	bool result = true;
+	if (OP_DISCARD == opcode) {
+		lock_devices(true);
+		result = ranged_discard_operation(param, count);
+		close_retired_devices();
+		unlock_devices();
+		return result;
+	}
+
+	// Note - Reads and writes buffer all of their range, so they're capped like the records of the binary stream
+	if (count > MAX_RECORD_SECTORS) {
+		printf("Invalid sector count: %d\n", count);
+		return false;
+	}
+
+	lock_devices(false);
+	if (use_single_sector_path(count) && (NULL == payload || OP_WRITE == opcode)) {
+		if (NULL != payload) {
+			write_operation_with_data(param, payload);
+		}
+		else {
+			functions[opcode].func(param);
+		}
+	}
+	else if (NULL != payload) {
+		result = (OP_WRITE == opcode) ? (ranged_write_operation_with_data(param, count, payload))
+									  : (ranged_read_operation_with_data(param, count, payload));
+	}
+	else {
+		result = functions[opcode].ranged_func(param, count);
+	}
+	run_pending_sync();
+	unlock_devices();
+
+	run_pending_checkpoint();
+	return result;
+}
+
+// Parses a "<CMD> <PARAM>" or "<CMD> <SECTOR> <COUNT>" line, returns OP_INVALID for an unknown command.
+// name gets the command's name and must hold 0x20 chars.
+Opcode parse_text_command(IN const char* line, OUT char* name, OUT int* param, OUT int* count) {
+	name[0] = '\0';
+	*param = 0;
+	*count = 1;
+	sscanf(line, "%31s %d %d", name, param, count);
+
+	for (int i = OP_INVALID + 1; i < OP_COUNT; i++) {
+		if (!strcmp(name, functions[i].op_name)) {
+			return (Opcode)i;
+		}
+	}
+	return OP_INVALID;
+}
+
+// The binary command stream is a sequence of these records (in native byte order), each WRITE record with
+// RECORD_HAS_PAYLOAD set is followed by length * g_sector_size bytes of data to write.
+// For REPAIR, KILL and REBUILD the sector field holds the device index and length is ignored.
+#define RECORD_HAS_PAYLOAD (0x1)
+typedef struct {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t length;
+	uint64_t sector;
+} __attribute__((packed)) CommandRecord;
+
+typedef struct {
+	int fd;
+	char* buffer;
+	size_t start;
+	size_t end;
+} InputStream;
+
+void init_stream(OUT InputStream* stream, IN int fd) {
+	stream->fd = fd;
+	stream->buffer = malloc(STREAM_BUFFER_SIZE);
+	assert(NULL != stream->buffer);
+	stream->start = 0;
+	stream->end = 0;
+}
+
+void free_stream(IN OUT InputStream* stream) {
+	free(stream->buffer);
+	stream->buffer = NULL;
+}
+
+// Copies the next length bytes of the stream to destination, returns false if the stream ended first
+bool stream_read(IN OUT InputStream* stream, OUT void* destination, IN size_t length) {
+	char* output = destination;
+	while (length > 0) {
+		if (stream->start == stream->end) {
+			ssize_t result = read(stream->fd, stream->buffer, STREAM_BUFFER_SIZE);
+			if (-1 == result && EINTR == errno) {
+				continue;
+			}
+			if (result <= 0) {
+				return false;
+			}
+			stream->start = 0;
+			stream->end = result;
+		}
+
+		size_t available = stream->end - stream->start;
+		size_t to_copy = (available < length) ? (available) : (length);
+		memcpy(output, stream->buffer + stream->start, to_copy);
+		stream->start += to_copy;
+		output += to_copy;
+		length -= to_copy;
+	}
+	return true;
+}
+
+bool execute_record(IN CommandRecord* record, IN OUT InputStream* stream) {
+	if (OP_INVALID == record->opcode || record->opcode >= OP_COUNT) {
+		printf("Invalid command opcode: %d\n", record->opcode);
+		return false;
+	}
+
+	bool has_payload = (record->flags & RECORD_HAS_PAYLOAD);
+	if (has_payload && OP_WRITE != record->opcode) {
+		printf("Payload given for non WRITE opcode %d\n", record->opcode);
+		return false;
+	}
+
+	if (is_device_command(record->opcode)) {
+		if (record->sector >= (uint64_t)g_num_dev) {
+			printf("Invalid device index: %llu\n", (unsigned long long)record->sector);
+			return true;
+		}
+		execute_command(record->opcode, (int)record->sector, 1, NULL);
+		return true;
+	}
+
+	uint32_t length = (0 == record->length) ? (1) : (record->length);
+	if (length > MAX_RECORD_SECTORS) {
+		printf("Record length %u is over the maximum of %d sectors\n", length, MAX_RECORD_SECTORS);
+		return false;
+	}
+
+	int sector = (int)record->sector;
+	if (!has_payload) {
+		execute_command(record->opcode, sector, length, NULL);
+		return true;
+	}
+
+	char* payload = (1 == length) ? (g_payload_buffer) : (malloc((size_t)length * g_sector_size));
+	assert(NULL != payload);
+	bool payload_ok = stream_read(stream, payload, (size_t)length * g_sector_size);
+	if (!payload_ok) {
+		printf("Command stream ended in the middle of a payload\n");
+	}
+	else {
+		execute_command(record->opcode, sector, length, payload);
+	}
+
+	if (payload != g_payload_buffer) {
+		free(payload);
+	}
+	return payload_ok;
+}
+
+void run_binary_commands() {
+	InputStream stream = {0};
+	init_stream(&stream, STDIN_FILENO);
+
+	CommandRecord record = {0};
+	while (stream_read(&stream, &record, sizeof(record))) {
+		if (!execute_record(&record, &stream)) {
+			break;
+		}
+	}
+
+	free_stream(&stream);
+}
+
+void run_text_commands() {
+	// vars for parsing input line
+	char input_line[1024];
+	char given_command[0x20];
+	int command_param;
+	int command_count;
+	
+	// read input lines to get command of type "<CMD> <PARAM>" or "<CMD> <SECTOR> <COUNT>"
+	while (fgets(input_line, 1024, stdin) != NULL) {
+		Opcode opcode = parse_text_command(input_line, given_command, &command_param, &command_count);
+		if (OP_INVALID == opcode) {
+			printf("Invalid command: %s\n", given_command);
+			continue;
+		}
+		execute_command(opcode, command_param, command_count, NULL);
+	}
+}
+
+uint64_t next_pseudo_random(IN OUT uint64_t* state) {
+	// xorshift64
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+void fill_pseudo_random(OUT char* buffer, IN size_t size, IN OUT uint64_t* state) {
+	uint64_t* words = (uint64_t*)buffer;
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		words[i] = next_pseudo_random(state);
+	}
+}
+
+// Times random single sector writes (with real data) over the whole array, run it with and without
+// -w and -j to see what closing the write hole costs
+void run_write_benchmark(IN int writes) {
+	int sector_count = get_device_stripe_count() * get_data_devices_in_stripe() * g_sectors_per_block;
+	if (0 == sector_count) {
+		printf("The devices are too small for a single stripe\n");
+		return;
+	}
+
+	uint64_t random_state = 0x2545f4914f6cdd1dULL;
+	struct timespec start = {0};
+	struct timespec end = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < writes; i++) {
+		fill_pseudo_random(g_payload_buffer, g_sector_size, &random_state);
+		int sector = (int)(random_state % sector_count);
+		execute_command(OP_WRITE, sector, 1, g_payload_buffer);
+	}
+	// Note - The final checkpoint is part of the cost, otherwise the last syncs would be left out of the time
+	checkpoint();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed_ms = ((end.tv_sec - start.tv_sec) * 1000.0) + ((end.tv_nsec - start.tv_nsec) / 1000000.0);
+	printf("%d random %d byte writes (bitmap %s, journal %s) in %.1f ms: %.0f writes/sec, %.1f us per write\n",
+		   writes, g_sector_size, (INVALID_DEVICE != g_bitmap.fd) ? "on" : "off", (INVALID_DEVICE != g_journal.fd) ? "on" : "off",
+		   elapsed_ms, writes / (elapsed_ms / 1000.0), (elapsed_ms * 1000.0) / writes);
+}
+
+// The workload (-W) drives the engine with generated requests from a number of threads and measures it
+// healthy, with a device KILLed and while that device is rebuilt. Requests are request_sectors long and start
+// at a multiple of request_sectors (a slot), sequential requests walk the slots in order, uniform ones pick
+// any slot and zipf ones follow Zipf's law over the slots (the k-th hottest slot is picked with a weight of 1/k).
+typedef enum WorkloadPattern_e {
+	WP_Sequential = 0,
+	WP_Uniform,
+	WP_Zipf,
+} WorkloadPattern;
+
+const char* g_pattern_names[] = {
+	[WP_Sequential] = "sequential",
+	[WP_Uniform] = "uniform",
+	[WP_Zipf] = "zipf",
+};
+
+typedef struct {
+	WorkloadPattern pattern;
+	int read_percent;
+	int request_sectors;
+	int operations;
+	int thread_count;
+	int failed_device;
+	int slot_count;
+	// The cumulative weights of the hottest slots for zipf
+	double* zipf_weights;
+	int zipf_slots;
+} WorkloadConfig;
+
+// Latencies are kept HDR style - exact below 2 * LATENCY_SUB_BUCKETS ns and from there LATENCY_SUB_BUCKETS
+// buckets for every power of 2, so every value is kept to within 1 / LATENCY_SUB_BUCKETS of itself
+typedef struct {
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t total;
+	uint64_t min_ns;
+	uint64_t max_ns;
+} LatencyHistogram;
+
+int latency_bucket(IN uint64_t nanoseconds) {
+	if (nanoseconds < 2 * LATENCY_SUB_BUCKETS) {
+		return (int)nanoseconds;
+	}
+	int magnitude = 63 - __builtin_clzll(nanoseconds) - LATENCY_SUB_BUCKET_BITS;
+	return ((magnitude + 1) * LATENCY_SUB_BUCKETS) + (int)(nanoseconds >> magnitude) - LATENCY_SUB_BUCKETS;
+}
+
+// The highest value that lands in the bucket
+uint64_t latency_bucket_value(IN int bucket) {
+	if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+	int magnitude = (bucket / LATENCY_SUB_BUCKETS) - 1;
+	uint64_t top = (bucket % LATENCY_SUB_BUCKETS) + LATENCY_SUB_BUCKETS;
+	return ((top + 1) << magnitude) - 1;
+}
+
+void record_latency(IN OUT LatencyHistogram* histogram, IN uint64_t nanoseconds) {
+	histogram->counts[latency_bucket(nanoseconds)]++;
+	if (0 == histogram->total || nanoseconds < histogram->min_ns) {
+		histogram->min_ns = nanoseconds;
+	}
+	if (nanoseconds > histogram->max_ns) {
+		histogram->max_ns = nanoseconds;
+	}
+	histogram->total++;
+}
+
+void merge_histogram(IN OUT LatencyHistogram* into, IN LatencyHistogram* from) {
+	if (0 == from->total) {
+		return;
+	}
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		into->counts[i] += from->counts[i];
+	}
+	if (0 == into->total || from->min_ns < into->min_ns) {
+		into->min_ns = from->min_ns;
+	}
+	if (from->max_ns > into->max_ns) {
+		into->max_ns = from->max_ns;
+	}
+	into->total += from->total;
+}
+
+uint64_t latency_percentile(IN LatencyHistogram* histogram, IN double percentile) {
+	uint64_t wanted = (uint64_t)((percentile / 100.0) * histogram->total);
+	wanted = (wanted < 1) ? (1) : (wanted);
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= wanted) {
+			uint64_t value = latency_bucket_value(i);
+			return (value < histogram->max_ns) ? (value) : (histogram->max_ns);
+		}
+	}
+	return histogram->max_ns;
+}
+
+void print_latencies(IN const char* name, IN LatencyHistogram* histogram) {
+	if (0 == histogram->total) {
+		return;
+	}
+	printf("  %-5s latency (us): min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", name,
+		   histogram->min_ns / 1000.0, latency_percentile(histogram, 50) / 1000.0, latency_percentile(histogram, 90) / 1000.0,
+		   latency_percentile(histogram, 99) / 1000.0, latency_percentile(histogram, 99.9) / 1000.0, histogram->max_ns / 1000.0);
+}
+
+void init_zipf_weights(IN OUT WorkloadConfig* config) {
+	config->zipf_slots = (config->slot_count < ZIPF_MAX_SLOTS) ? (config->slot_count) : (ZIPF_MAX_SLOTS);
+	config->zipf_weights = malloc(config->zipf_slots * sizeof(double));
+	assert(NULL != config->zipf_weights);
+	double total = 0;
+	for (int i = 0; i < config->zipf_slots; i++) {
+		total += 1.0 / (i + 1);
+		config->zipf_weights[i] = total;
+	}
+}
+
+int pick_zipf_slot(IN WorkloadConfig* config, IN OUT uint64_t* random_state) {
+	double target = (next_pseudo_random(random_state) >> 11) * (1.0 / (1ULL << 53)) * config->zipf_weights[config->zipf_slots - 1];
+	int low = 0;
+	int high = config->zipf_slots - 1;
+	while (low < high) {
+		int middle = low + (high - low) / 2;
+		if (config->zipf_weights[middle] < target) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	// Note - Scatter the hot slots over the array, otherwise they'd all sit in its first stripes
+	return (int)(((uint64_t)low * 0x9e3779b97f4a7c15ULL) % config->slot_count);
+}
+
+typedef struct {
+	WorkloadConfig* config;
+	uint64_t random_state;
+	char* data;
+	long failures;
+	LatencyHistogram reads;
+	LatencyHistogram writes;
+} WorkloadThread;
+
+// Shared by the workload threads of a phase
+int g_workload_next_operation = 0;
+bool g_workload_until_rebuilt = false;
+bool g_rebuild_finished = false;
+
+bool is_workload_phase_over(IN WorkloadConfig* config, IN int operation) {
+	if (g_workload_until_rebuilt) {
+		return __atomic_load_n(&g_rebuild_finished, __ATOMIC_ACQUIRE);
+	}
+	return (operation >= config->operations);
+}
+
+void* workload_thread_logic(void* argument) {
+	WorkloadThread* thread = argument;
+	WorkloadConfig* config = thread->config;
+	while (true) {
+		int operation = __atomic_fetch_add(&g_workload_next_operation, 1, __ATOMIC_RELAXED);
+		if (is_workload_phase_over(config, operation)) {
+			break;
+		}
+
+		int slot = 0;
+		switch (config->pattern) {
+			case WP_Sequential: slot = operation % config->slot_count; break;
+			case WP_Uniform: slot = (int)(next_pseudo_random(&thread->random_state) % config->slot_count); break;
+			case WP_Zipf: slot = pick_zipf_slot(config, &thread->random_state); break;
+		}
+		bool is_read = (int)(next_pseudo_random(&thread->random_state) % 100) < config->read_percent;
+		if (!is_read) {
+			fill_pseudo_random(thread->data, (size_t)config->request_sectors * g_sector_size, &thread->random_state);
+		}
+
+		struct timespec start = {0};
+		struct timespec end = {0};
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		bool result = execute_command(is_read ? OP_READ : OP_WRITE, slot * config->request_sectors, config->request_sectors, thread->data);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		uint64_t nanoseconds = ((end.tv_sec - start.tv_sec) * 1000000000ULL) + end.tv_nsec - start.tv_nsec;
+		record_latency(is_read ? &thread->reads : &thread->writes, nanoseconds);
+		thread->failures += result ? 0 : 1;
+	}
+	return NULL;
+}
+
+typedef struct {
+	const char* name;
+	long operations;
+	long failures;
+	double seconds;
+	LatencyHistogram reads;
+	LatencyHistogram writes;
+	uint64_t device_sectors;
+} WorkloadPhase;
+
+void* rebuild_thread_logic(void* argument) {
+	int device_index = *(int*)argument;
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool result = execute_command(OP_REBUILD, device_index, 1, NULL);
+	double seconds = get_elapsed_seconds(&start);
+	double megabytes = (double)get_device_stripe_count() * g_sectors_per_block * g_sector_size / (1024 * 1024);
+	printf("Rebuild of device %d %s after %.2f seconds (%.1f MB/s)\n", device_index, result ? "finished" : "failed", seconds, megabytes / seconds);
+	__atomic_store_n(&g_rebuild_finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void run_workload_phase(IN WorkloadConfig* config, IN OUT WorkloadPhase* phase, IN bool during_rebuild) {
+	WorkloadThread threads[config->thread_count];
+	pthread_t handles[config->thread_count];
+	pthread_t rebuild_handle;
+	DeviceStats before[g_num_dev];
+	memcpy(before, g_device_stats, sizeof(before));
+
+	g_workload_next_operation = 0;
+	g_workload_until_rebuilt = during_rebuild;
+	g_rebuild_finished = false;
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (during_rebuild) {
+		int result = pthread_create(&rebuild_handle, NULL, rebuild_thread_logic, &config->failed_device);
+		PTHREAD_ASSERT(result);
+	}
+	for (int i = 0; i < config->thread_count; i++) {
+		memset(&threads[i], 0, sizeof(threads[i]));
+		threads[i].config = config;
+		threads[i].random_state = 0x2545f4914f6cdd1dULL * (i + 1);
+		threads[i].data = aligned_alloc(sizeof(uint64_t), (size_t)config->request_sectors * g_sector_size);
+		assert(NULL != threads[i].data);
+		int result = pthread_create(&handles[i], NULL, workload_thread_logic, &threads[i]);
+		PTHREAD_ASSERT(result);
+	}
+
+	for (int i = 0; i < config->thread_count; i++) {
+		int result = pthread_join(handles[i], NULL);
+		PTHREAD_ASSERT(result);
+		merge_histogram(&phase->reads, &threads[i].reads);
+		merge_histogram(&phase->writes, &threads[i].writes);
+		phase->failures += threads[i].failures;
+		free(threads[i].data);
+	}
+	phase->seconds = get_elapsed_seconds(&start);
+	if (during_rebuild) {
+		int result = pthread_join(rebuild_handle, NULL);
+		PTHREAD_ASSERT(result);
+	}
+	phase->operations = phase->reads.total + phase->writes.total;
+
+	long requested_sectors = phase->operations * config->request_sectors;
+	printf("Phase %s: %ld operations (%ld failed) in %.2f seconds, %.0f IOPS, %.1f MB/s\n", phase->name,
+		   phase->operations, phase->failures, phase->seconds, phase->operations / phase->seconds,
+		   ((double)requested_sectors * g_sector_size) / (1024 * 1024) / phase->seconds);
+	print_latencies("READ", &phase->reads);
+	print_latencies("WRITE", &phase->writes);
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		uint64_t read = g_device_stats[dev].sectors_read - before[dev].sectors_read;
+		uint64_t written = g_device_stats[dev].sectors_written - before[dev].sectors_written;
+		phase->device_sectors += read + written;
+		printf("  Device %d: %llu sectors read, %llu sectors written\n", dev, (unsigned long long)read, (unsigned long long)written);
+	}
+	printf("  I/O amplification: %.2f device sectors per requested sector\n",
+		   (requested_sectors > 0) ? ((double)phase->device_sectors / requested_sectors) : (0.0));
+}
+
+void run_workload(IN OUT WorkloadConfig* config) {
+	int sector_count = get_device_stripe_count() * get_data_devices_in_stripe() * g_sectors_per_block;
+	config->slot_count = sector_count / config->request_sectors;
+	if (0 == config->slot_count) {
+		printf("The devices are too small for a single request\n");
+		return;
+	}
+	for (int dev = 0; dev < g_num_dev; dev++) {
+		if (!is_device_alive(dev)) {
+			printf("Can't run the workload with bad device %d\n", dev);
+			return;
+		}
+	}
+	if (WP_Zipf == config->pattern) {
+		init_zipf_weights(config);
+	}
+
+	// Note - Tracing every operation would measure printf, and the threads need the concurrent paths anyway
+	g_trace = false;
+	g_concurrent_commands = true;
+	printf("Workload: %s, %d%% reads, %d sectors per request, %d threads, device %d fails\n",
+		   g_pattern_names[config->pattern], config->read_percent, config->request_sectors, config->thread_count, config->failed_device);
+
+	WorkloadPhase phases[] = {{.name = "healthy"}, {.name = "degraded"}, {.name = "rebuilding"}};
+	run_workload_phase(config, &phases[0], false);
+	execute_command(OP_KILL, config->failed_device, 1, NULL);
+	run_workload_phase(config, &phases[1], false);
+	run_workload_phase(config, &phases[2], true);
+
+	printf("%-12s %10s %10s %10s %10s %10s %14s\n", "Phase", "IOPS", "MB/s", "read p50", "read p99", "write p99", "amplification");
+	for (size_t i = 0; i < ARRAYSIZE(phases); i++) {
+		long requested_sectors = phases[i].operations * config->request_sectors;
+		printf("%-12s %10.0f %10.1f %10.1f %10.1f %10.1f %14.2f\n", phases[i].name, phases[i].operations / phases[i].seconds,
+			   ((double)requested_sectors * g_sector_size) / (1024 * 1024) / phases[i].seconds,
+			   latency_percentile(&phases[i].reads, 50) / 1000.0, latency_percentile(&phases[i].reads, 99) / 1000.0,
+			   latency_percentile(&phases[i].writes, 99) / 1000.0,
+			   (requested_sectors > 0) ? ((double)phases[i].device_sectors / requested_sectors) : (0.0));
+	}
+
+	g_concurrent_commands = false;
+	free(config->zipf_weights);
+	config->zipf_weights = NULL;
+}
+
+// Translates text commands from stdin to a binary command stream on stdout, so a trace can be converted
+// once and then replayed with -b as many times as needed
+void convert_text_commands(IN bool attach_payload) {
+	char input_line[1024];
+	char given_command[0x20];
+	int command_param;
+	uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+	while (fgets(input_line, 1024, stdin) != NULL) {
+		int command_count = 1;
+		if (sscanf(input_line, "%s %d %d", given_command, &command_param, &command_count) < 2) {
+			continue;
+		}
+
+		CommandRecord record = {0};
+		for (int i = OP_INVALID + 1; i < OP_COUNT; i++) {
+			if (!strcmp(given_command, functions[i].op_name)) {
+				record.opcode = i;
+				break;
+			}
+		}
+		if (OP_INVALID == record.opcode) {
+			fprintf(stderr, "Invalid command: %s\n", given_command);
+			continue;
+		}
+		if (command_count < 1 || command_count > MAX_RECORD_SECTORS) {
+			fprintf(stderr, "Invalid sector count: %d\n", command_count);
+			continue;
+		}
+
+		record.sector = command_param;
+		record.length = command_count;
+		if (attach_payload && OP_WRITE == record.opcode) {
+			record.flags |= RECORD_HAS_PAYLOAD;
+		}
+		fwrite(&record, sizeof(record), 1, stdout);
+		for (uint32_t i = 0; (record.flags & RECORD_HAS_PAYLOAD) && i < record.length; i++) {
+			fill_pseudo_random(g_payload_buffer, g_sector_size, &random_state);
+			fwrite(g_payload_buffer, g_sector_size, 1, stdout);
+		}
+	}
+}
+
+// The server (-u) takes text commands from any number of clients over a Unix socket. Every client has a reader
+// thread that queues its commands for a pool of workers, so commands on different stripes run in parallel (and
+// the stripe locks serialize the ones that share stripes). Since replies can come out of order, every command
+// is answered with its line number in the client's stream: "<line> OK", "<line> FAILED <bad device>" or
+// "<line> INVALID". KILL, REPAIR and REBUILD are barriers for their client - they run once its earlier commands
+// finish (so a REBUILD only holds up the client that sent it while the others keep going).
+typedef struct ServerClient_s {
+	int fd;
+	// The reader thread and every queued command of the client hold a reference, the last one frees the client
+	int references;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	struct ServerClient_s* next;
+	struct ServerClient_s* prev;
+} ServerClient;
+
+typedef struct ServerJob_s {
+	ServerClient* client;
+	long line;
+	Opcode opcode;
+	int param;
+	int count;
+	struct ServerJob_s* next;
+} ServerJob;
+
+ServerJob* g_job_queue_front = NULL;
+ServerJob* g_job_queue_end = NULL;
+int g_queued_jobs = 0;
+// Tells the workers to exit once the queue is empty, guarded by g_job_queue_lock
+bool g_workers_should_exit = false;
+pthread_mutex_t g_job_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_job_queue_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t g_job_queue_not_full = PTHREAD_COND_INITIALIZER;
+
+// The connected clients, so shutting down can wake up their readers
+ServerClient* g_clients = NULL;
+int g_client_count = 0;
+pthread_mutex_t g_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_clients_gone = PTHREAD_COND_INITIALIZER;
+
+volatile sig_atomic_t g_stop_requested = 0;
+
+void handle_stop_signal(int signal_number) {
+	(void)signal_number;
+	g_stop_requested = 1;
+}
+
+void send_reply(IN ServerClient* client, IN long line, IN const char* status) {
+	char reply[64];
+	int length = snprintf(reply, sizeof(reply), "%ld %s\n", line, status);
+
+	int result = pthread_mutex_lock(&client->lock);
+	PTHREAD_ASSERT(result);
+	// Note - A client that went away just doesn't get its replies, MSG_NOSIGNAL keeps that from killing us
+	for (int sent = 0; sent < length; ) {
+		ssize_t written = send(client->fd, reply + sent, length - sent, MSG_NOSIGNAL);
+		if (-1 == written && EINTR == errno) {
+			continue;
+		}
+		if (written <= 0) {
+			break;
+		}
+		sent += written;
+	}
+	result = pthread_mutex_unlock(&client->lock);
+	PTHREAD_ASSERT(result);
+}
+
+void reply_with_result(IN ServerClient* client, IN long line, IN bool succeeded) {
+	char status[32] = "OK";
+	if (!succeeded) {
+		snprintf(status, sizeof(status), "FAILED %d", g_last_bad_device);
+	}
+	send_reply(client, line, status);
+}
+
+void release_client(IN ServerClient* client) {
+	int result = pthread_mutex_lock(&client->lock);
+	PTHREAD_ASSERT(result);
+	int references = --client->references;
+	// Note - The reader waits for references to drop to its own one before a KILL or REPAIR
+	pthread_cond_broadcast(&client->idle);
+	result = pthread_mutex_unlock(&client->lock);
+	PTHREAD_ASSERT(result);
+
+	if (0 == references) {
+		close(client->fd);
+		pthread_cond_destroy(&client->idle);
+		pthread_mutex_destroy(&client->lock);
+		free(client);
+	}
+}
+
+// Returns false if the server is shutting down and the job wasn't queued
+bool enqueue_job(IN ServerJob* job) {
+	int result = pthread_mutex_lock(&g_job_queue_lock);
+	PTHREAD_ASSERT(result);
+	// Note - A bounded queue makes a fast client wait instead of piling up unbounded memory
+	while (g_queued_jobs >= MAX_QUEUED_JOBS && !g_workers_should_exit) {
+		result = pthread_cond_wait(&g_job_queue_not_full, &g_job_queue_lock);
+		PTHREAD_ASSERT(result);
+	}
+	bool queued = !g_workers_should_exit;
+	if (queued) {
+		job->next = NULL;
+		if (NULL == g_job_queue_end) {
+			g_job_queue_front = job;
+		}
+		else {
+			g_job_queue_end->next = job;
+		}
+		g_job_queue_end = job;
+		g_queued_jobs++;
+		result = pthread_cond_signal(&g_job_queue_not_empty);
+		PTHREAD_ASSERT(result);
+	}
+	result = pthread_mutex_unlock(&g_job_queue_lock);
+	PTHREAD_ASSERT(result);
+	return queued;
+}
+
+// Returns NULL once the workers should exit and the queue is empty
+ServerJob* dequeue_job() {
+	int result = pthread_mutex_lock(&g_job_queue_lock);
+	PTHREAD_ASSERT(result);
+	while (NULL == g_job_queue_front && !g_workers_should_exit) {
+		result = pthread_cond_wait(&g_job_queue_not_empty, &g_job_queue_lock);
+		PTHREAD_ASSERT(result);
+	}
+	ServerJob* job = g_job_queue_front;
+	if (NULL != job) {
+		g_job_queue_front = job->next;
+		if (NULL == g_job_queue_front) {
+			g_job_queue_end = NULL;
+		}
+		g_queued_jobs--;
+		result = pthread_cond_signal(&g_job_queue_not_full);
+		PTHREAD_ASSERT(result);
+	}
+	result = pthread_mutex_unlock(&g_job_queue_lock);
+	PTHREAD_ASSERT(result);
+	return job;
+}
+
+void* server_worker_logic(void* unused) {
+	(void)unused;
+	ServerJob* job = NULL;
+	while (NULL != (job = dequeue_job())) {
+		bool succeeded = execute_command(job->opcode, job->param, job->count, NULL);
+		reply_with_result(job->client, job->line, succeeded);
+		release_client(job->client);
+		free(job);
+	}
+	return NULL;
+}
+
+void wait_for_client_idle(IN ServerClient* client) {
+	int result = pthread_mutex_lock(&client->lock);
+	PTHREAD_ASSERT(result);
+	while (client->references > 1) {
+		result = pthread_cond_wait(&client->idle, &client->lock);
+		PTHREAD_ASSERT(result);
+	}
+	result = pthread_mutex_unlock(&client->lock);
+	PTHREAD_ASSERT(result);
+}
+
+void* client_reader_logic(void* argument) {
+	ServerClient* client = argument;
+	// Note - Reading through its own FILE (of a dup of the socket) keeps stdio away from the replies we send
+	FILE* input = fdopen(dup(client->fd), "r");
+
+	char input_line[1024];
+	char given_command[0x20];
+	long line = 0;
+	while (NULL != input && NULL != fgets(input_line, sizeof(input_line), input)) {
+		line++;
+		ServerJob job = {.client = client, .line = line};
+		job.opcode = parse_text_command(input_line, given_command, &job.param, &job.count);
+		bool device_command = is_device_command(job.opcode);
+		if (OP_INVALID == job.opcode || (!device_command && job.count < 1) ||
+			(device_command && (job.param < 0 || job.param >= g_num_dev))) {
+			send_reply(client, line, "INVALID");
+			continue;
+		}
+
+		if (device_command) {
+			wait_for_client_idle(client);
+			reply_with_result(client, line, execute_command(job.opcode, job.param, job.count, NULL));
+			continue;
+		}
+
+		ServerJob* queued_job = malloc(sizeof(*queued_job));
+		assert(NULL != queued_job);
+		*queued_job = job;
+		int result = pthread_mutex_lock(&client->lock);
+		PTHREAD_ASSERT(result);
+		client->references++;
+		result = pthread_mutex_unlock(&client->lock);
+		PTHREAD_ASSERT(result);
+		if (!enqueue_job(queued_job)) {
+			free(queued_job);
+			release_client(client);
+			break;
+		}
+	}
+
+	if (NULL != input) {
+		fclose(input);
+	}
+
+	int result = pthread_mutex_lock(&g_clients_lock);
+	PTHREAD_ASSERT(result);
+	if (NULL != client->prev) {
+		client->prev->next = client->next;
+	}
+	else {
+		g_clients = client->next;
+	}
+	if (NULL != client->next) {
+		client->next->prev = client->prev;
+	}
+	g_client_count--;
+	result = pthread_cond_signal(&g_clients_gone);
+	PTHREAD_ASSERT(result);
+	result = pthread_mutex_unlock(&g_clients_lock);
+	PTHREAD_ASSERT(result);
+
+	release_client(client);
+	return NULL;
+}
+
+void start_client(IN int client_fd) {
+	ServerClient* client = calloc(1, sizeof(*client));
+	assert(NULL != client);
+	client->fd = client_fd;
+	client->references = 1;
+	int result = pthread_mutex_init(&client->lock, NULL);
+	PTHREAD_ASSERT(result);
+	result = pthread_cond_init(&client->idle, NULL);
+	PTHREAD_ASSERT(result);
+
+	result = pthread_mutex_lock(&g_clients_lock);
+	PTHREAD_ASSERT(result);
+	client->next = g_clients;
+	if (NULL != g_clients) {
+		g_clients->prev = client;
+	}
+	g_clients = client;
+	g_client_count++;
+	result = pthread_mutex_unlock(&g_clients_lock);
+	PTHREAD_ASSERT(result);
+
+	pthread_t reader;
+	result = pthread_create(&reader, NULL, client_reader_logic, client);
+	PTHREAD_ASSERT(result);
+	result = pthread_detach(reader);
+	PTHREAD_ASSERT(result);
+}
+
+// Wakes up the readers of all the clients (their reads end as if the clients hung up) and waits for them to exit
+void stop_clients() {
+	int result = pthread_mutex_lock(&g_clients_lock);
+	PTHREAD_ASSERT(result);
+	for (ServerClient* client = g_clients; NULL != client; client = client->next) {
+		shutdown(client->fd, SHUT_RD);
+	}
+	while (g_client_count > 0) {
+		result = pthread_cond_wait(&g_clients_gone, &g_clients_lock);
+		PTHREAD_ASSERT(result);
+	}
+	result = pthread_mutex_unlock(&g_clients_lock);
+	PTHREAD_ASSERT(result);
+}
+
+int open_server_socket(IN const char* socket_path) {
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		printf("Socket path is too long: %s\n", socket_path);
+		return INVALID_DEVICE;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (INVALID_DEVICE == listen_fd) {
+		printf("Failed to create a socket with error %s\n", strerror(errno));
+		return INVALID_DEVICE;
+	}
+	if (0 != bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) || 0 != listen(listen_fd, SERVER_BACKLOG)) {
+		printf("Failed to listen on %s with error %s\n", socket_path, strerror(errno));
+		close(listen_fd);
+		return INVALID_DEVICE;
+	}
+	return listen_fd;
+}
+
+// Serves clients until SIGINT or SIGTERM, then finishes every command already queued before returning
+void run_server(IN const char* socket_path, IN int worker_count) {
+	int listen_fd = open_server_socket(socket_path);
+	if (INVALID_DEVICE == listen_fd) {
+		return;
+	}
+
+	// Note - The stop signals stay blocked everywhere except inside ppoll, so they can only interrupt the accept
+	// Note - loop (every thread we start inherits the blocked mask) and can't slip in between a check and a wait
+	sigset_t stop_signals;
+	sigset_t wait_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	int result = pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+	PTHREAD_ASSERT(result);
+	sigdelset(&wait_mask, SIGINT);
+	sigdelset(&wait_mask, SIGTERM);
+	struct sigaction action = {.sa_handler = handle_stop_signal};
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	g_concurrent_commands = true;
+	pthread_t workers[worker_count];
+	for (int i = 0; i < worker_count; i++) {
+		result = pthread_create(&workers[i], NULL, server_worker_logic, NULL);
+		PTHREAD_ASSERT(result);
+	}
+	printf("Serving on %s with %d workers\n", socket_path, worker_count);
+	fflush(stdout);
+
+	while (!g_stop_requested) {
+		struct pollfd listen_poll = {.fd = listen_fd, .events = POLLIN};
+		if (-1 == ppoll(&listen_poll, 1, NULL, &wait_mask)) {
+			if (EINTR != errno) {
+				printf("Failed to wait for clients with error %s\n", strerror(errno));
+				break;
+			}
+			continue;
+		}
+		int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (INVALID_DEVICE != client_fd) {
+			start_client(client_fd);
+		}
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+	stop_clients();
+
+	result = pthread_mutex_lock(&g_job_queue_lock);
+	PTHREAD_ASSERT(result);
+	g_workers_should_exit = true;
+	result = pthread_cond_broadcast(&g_job_queue_not_empty);
+	PTHREAD_ASSERT(result);
+	result = pthread_mutex_unlock(&g_job_queue_lock);
+	PTHREAD_ASSERT(result);
+	for (int i = 0; i < worker_count; i++) {
+		result = pthread_join(workers[i], NULL);
+		PTHREAD_ASSERT(result);
+	}
+	g_concurrent_commands = false;
+	printf("Server stopped\n");
+}
+
+void print_usage(IN const char* program) {
+	printf("Usage: %s [-b] [-q] [-k sectors] [-s bytes] [-l layout] [-6] [-w bitmap] [-r stripes] [-j journal] [-B writes]\n", program);
+	printf("          [-S | -R] [-m] [-t MB/s] [-u socket] [-W pattern [-M percent] [-z sectors] [-O operations] [-D device]]\n");
+	printf("          [-n threads] [-d] [-f writes]\n");
+	printf("          <device> <device> <device> ...\n");
+	printf("       %s -x [-p] [-s bytes] < text_commands > binary_commands\n", program);
+	printf("  -b  Read binary command records from stdin instead of text commands\n");
+	printf("  -q  Don't trace every device operation\n");
+	printf("  -k  Sectors per block (the chunk size of a device in a stripe, default %d)\n", DEFAULT_SECTORS_PER_BLOCK);
+	printf("  -s  Sector size in bytes, a multiple of %d (default %d)\n", MIN_SECTOR_SIZE, DEFAULT_SECTOR_SIZE);
+	printf("  -l  Parity layout: left-asymmetric (default), left-symmetric, right-asymmetric or right-symmetric\n");
+	printf("  -6  RAID6 - keep P and Q parities and survive two failed devices (needs 4 devices or more)\n");
+	printf("  -w  Write-intent bitmap file, regions marked in it are resynced on startup\n");
+	printf("  -r  Stripes per bitmap region for a new bitmap (default %d)\n", DEFAULT_REGION_STRIPES);
+	printf("  -j  Write-ahead journal file for the data and parity of every write, replayed on startup\n");
+	printf("  -S  Scrub - verify the parity of every stripe on the devices and exit\n");
+	printf("  -R  Scrub and rewrite the parity of mismatched stripes from their data\n");
+	printf("  -m  Scrub through mmap instead of reader threads\n");
+	printf("  -t  Limit the scrub to the given MB/s over all the devices\n");
+	printf("  -B  Run the given number of random single sector writes, report their rate and exit\n");
+	printf("  -u  Serve text commands from any number of clients on the given Unix socket until SIGINT or SIGTERM\n");
+	printf("  -W  Run a workload healthy, degraded and while rebuilding, and report its rate, latencies and device I/O.\n");
+	printf("      The pattern is sequential, uniform or zipf. It writes random data all over the devices!\n");
+	printf("  -M  Percent of the workload's requests that are reads (default %d)\n", DEFAULT_READ_PERCENT);
+	printf("  -z  Sectors per workload request (default 1)\n");
+	printf("  -O  Workload requests in the healthy and degraded phases (default %d)\n", DEFAULT_WORKLOAD_OPERATIONS);
+	printf("  -D  The device to fail and rebuild in the workload (default 0)\n");
+	printf("  -n  Number of server workers or workload threads running commands concurrently (default the number of CPUs)\n");
+	printf("  -d  Direct I/O - open the devices with O_DIRECT (devices that can't do it fall back to buffered I/O)\n");
+	printf("  -f  fdatasync the devices once every given number of writes\n");
+	printf("  -x  Convert text commands to binary records and exit\n");
+	printf("  -p  With -x, attach pseudo random payloads to WRITE records\n");
+}
+
+bool parse_pattern(IN const char* name, OUT WorkloadPattern* pattern) {
+	for (size_t i = 0; i < ARRAYSIZE(g_pattern_names); i++) {
+		if (!strcmp(name, g_pattern_names[i])) {
+			*pattern = (WorkloadPattern)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool parse_layout(IN const char* name, OUT ParityLayout* layout) {
+	for (size_t i = 0; i < ARRAYSIZE(g_layout_names); i++) {
+		if (!strcmp(name, g_layout_names[i])) {
+			*layout = (ParityLayout)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+void allocate_buffers() {
+	g_io_buffer = allocate_io_buffer(g_sector_size);
+	g_parity_buffer = allocate_io_buffer(g_sector_size);
+	g_payload_buffer = allocate_io_buffer(g_sector_size);
+}
+
+void free_buffers() {
+	free(g_io_buffer);
+	free(g_parity_buffer);
+	free(g_payload_buffer);
+}
+
+int main(int argc, char** argv)
+{
+	bool binary_commands = false;
+	bool convert_commands = false;
+	bool attach_payload = false;
+	const char* bitmap_path = NULL;
+	const char* journal_path = NULL;
+	int benchmark_writes = 0;
+	bool scrub = false;
+	bool scrub_repair = false;
+	bool scrub_mmap = false;
+	double scrub_bandwidth = 0;
+	const char* socket_path = NULL;
+	int worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	bool workload = false;
+	WorkloadConfig workload_config = {.read_percent = DEFAULT_READ_PERCENT, .request_sectors = 1, .operations = DEFAULT_WORKLOAD_OPERATIONS};
+
+	int option = 0;
+	// Note - The '+' stops parsing at the first device path, so device paths are never taken as options
+	while (-1 != (option = getopt(argc, argv, "+bqxpk:s:l:6w:r:j:B:SRmt:u:n:W:M:z:O:D:df:"))) {
+		switch (option) {
+			case 'b': binary_commands = true; break;
+			case 'q': g_trace = false; break;
+			case 'x': convert_commands = true; break;
+			case 'p': attach_payload = true; break;
+			case 'k': g_sectors_per_block = atoi(optarg); break;
+			case 's': g_sector_size = atoi(optarg); break;
+			case '6': g_parity_count = 2; break;
+			case 'w': bitmap_path = optarg; break;
+			case 'r': g_bitmap.region_stripes = atoi(optarg); break;
+			case 'j': journal_path = optarg; break;
+			case 'B': benchmark_writes = atoi(optarg); break;
+			case 'S': scrub = true; break;
+			case 'R': scrub = true; scrub_repair = true; break;
+			case 'm': scrub_mmap = true; break;
+			case 't': scrub_bandwidth = atof(optarg); break;
+			case 'u': socket_path = optarg; break;
+			case 'n': worker_count = atoi(optarg); break;
+			case 'd': g_direct_io = true; break;
+			case 'f': g_sync_interval = atoi(optarg); break;
+			case 'M': workload_config.read_percent = atoi(optarg); break;
+			case 'z': workload_config.request_sectors = atoi(optarg); break;
+			case 'O': workload_config.operations = atoi(optarg); break;
+			case 'D': workload_config.failed_device = atoi(optarg); break;
+			case 'W':
+				workload = true;
+				if (parse_pattern(optarg, &workload_config.pattern)) {
+					break;
+				}
+				printf("Unknown workload pattern: %s\n", optarg);
+				print_usage(argv[0]);
+				return -1;
+			case 'l':
+				if (parse_layout(optarg, &g_layout)) {
+					break;
+				}
+				printf("Unknown parity layout: %s\n", optarg);
+				// fallthrough
+			default:
+				print_usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (workload_config.read_percent < 0 || workload_config.read_percent > 100 || workload_config.request_sectors < 1 ||
+		workload_config.request_sectors > MAX_RECORD_SECTORS || workload_config.operations < 1) {
+		print_usage(argv[0]);
+		return -1;
+	}
+	if (g_sectors_per_block < 1 || g_bitmap.region_stripes < 1 || worker_count < 1 || g_sync_interval < 0 || g_sector_size < MIN_SECTOR_SIZE || 0 != (g_sector_size % MIN_SECTOR_SIZE)) {
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	allocate_buffers();
+	init_gf_tables();
+
+	if (convert_commands) {
+		convert_text_commands(attach_payload);
+		free_buffers();
+		return 0;
+	}
+
+	assert(argc - optind >= 2 + g_parity_count);
+
+	// Note - The trace is the bulk of our output, so we let stdio batch it unless someone is watching
+	if (!isatty(STDOUT_FILENO)) {
+		setvbuf(stdout, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+	}
+	
+	// number of devices == number of arguments (ignore the program name and options)
+	g_argc = argc - optind + 1;
+	g_argv = argv + optind - 1;
+	g_num_dev = g_argc - 1;
+	int _dev_status[g_num_dev];
+	int _retired_fds[g_num_dev];
+	DeviceStats _device_stats[g_num_dev];
+	g_dev_status = _dev_status;
+	g_retired_fds = _retired_fds;
+	g_device_stats = _device_stats;
+	memset(g_device_stats, 0, sizeof(_device_stats));
+	for (int i = 0; i < g_num_dev; i++) {
+		g_retired_fds[i] = INVALID_DEVICE;
+	}
+	init_devices_lock();
+	init_stripe_locks();
+	init_io_buffer_pool((size_t)stripes_per_workspace() * g_num_dev * g_sectors_per_block * g_sector_size);
+	open_devices();
+
+	if ((NULL != bitmap_path && !open_bitmap(bitmap_path)) || (NULL != journal_path && !open_journal(journal_path))) {
+		close_devices();
+		return -1;
+	}
+	recover_after_crash();
+	// Note - After the recovery, so the stripes the journal replay wrote count as allocated
+	init_allocation_map();
+
+	if (scrub) {
+		run_scrub(scrub_repair, scrub_mmap, scrub_bandwidth);
+	}
+	else if (benchmark_writes > 0) {
+		run_write_benchmark(benchmark_writes);
+	}
+	else if (NULL != socket_path) {
+		run_server(socket_path, worker_count);
+	}
+	else if (workload) {
+		if (workload_config.failed_device < 0 || workload_config.failed_device >= g_num_dev) {
+			printf("Invalid device index: %d\n", workload_config.failed_device);
+		}
+		else {
+			workload_config.thread_count = worker_count;
+			run_workload(&workload_config);
+		}
+	}
+	else if (binary_commands) {
+		run_binary_commands();
+	}
+	else {
+		run_text_commands();
+	}
+
+	close_durability_files();
+	if (g_sync_interval > 0) {
+		sync_devices();
+	}
+	close_devices();
+	free_allocation_map();
+	free_io_buffer_pool();
+	free_buffers();
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -18,6 +20,9 @@
 
 #define FILE_PERMISSIONS (S_IRWXU | S_IRWXG | S_IRWXO)
 #define WRITE_AREA_SIZE (0x1000)
+#define BULK_PIPE_SIZE (0x100000)
+#define MIN_PIPE_SIZE (0x10000)
+#define BULK_BUFFER_SIZE (0x100000)
 
 #define ERRNO_ASSERT_WITH_VALUE(assertion, errno_value)  	\
 	if (!(assertion)) {							\
@@ -30,6 +35,8 @@
 char g_write_area[WRITE_AREA_SIZE];
 int g_fifo_fd;
 const char* g_fifo_path;
+// Bulk mode streams the fifo to stdout as it is instead of printing it
+bool g_is_bulk;
 struct sigaction g_original_sigterm;
 struct sigaction g_original_sigint;
 
@@ -108,6 +115,78 @@ void read_write_loop() {
 	close_fifo_file();
 }
 
+// Note - Past /proc/sys/fs/pipe-max-size only root can grow a pipe, so this settles for the biggest size it may have.
+// It's just a hint, fds that aren't pipes stay as they are
+void grow_pipe(IN int fd) {
+	for (int size = BULK_PIPE_SIZE; size >= MIN_PIPE_SIZE; size /= 2) {
+		if (-1 != fcntl(fd, F_SETPIPE_SZ, size)) {
+			return;
+		}
+	}
+}
+
+// Moves the fifo to stdout without copying it through user space, the fifo is a pipe so splice takes anything on the
+// other side that has splice support. Returns false if stdout doesn't (a terminal), and then nothing was moved
+bool splice_loop() {
+	bool moved_data = false;
+	while (true) {
+		ssize_t result = splice(g_fifo_fd, NULL, STDOUT_FILENO, NULL, BULK_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (0 == result) {
+			return true;
+		}
+		if (-1 == result) {
+			if (EINTR == errno) {
+				continue;
+			}
+			if (EINVAL == errno && !moved_data) {
+				return false;
+			}
+			ERRNO_ASSERT(false);
+		}
+		moved_data = true;
+	}
+}
+
+void write_to_screen(IN const char* data, IN ssize_t dataLength) {
+	while (dataLength > 0) {
+		ssize_t result = write(STDOUT_FILENO, data, dataLength);
+		if (-1 == result && EINTR == errno) {
+			continue;
+		}
+		ERRNO_ASSERT(-1 != result);
+		data += result;
+		dataLength -= result;
+	}
+}
+
+// The fallback of bulk mode, big reads and writes without clearing the buffer or looking for the end of a string
+void buffered_loop() {
+	char* buffer = malloc(BULK_BUFFER_SIZE);
+	ERRNO_ASSERT(NULL != buffer);
+
+	while (true) {
+		ssize_t dataLength = read(g_fifo_fd, buffer, BULK_BUFFER_SIZE);
+		if (-1 == dataLength && EINTR == errno) {
+			continue;
+		}
+		ERRNO_ASSERT(-1 != dataLength);
+		if (0 == dataLength) {
+			break;
+		}
+		write_to_screen(buffer, dataLength);
+	}
+	free(buffer);
+}
+
+void bulk_loop() {
+	grow_pipe(g_fifo_fd);
+	grow_pipe(STDOUT_FILENO);
+	if (!splice_loop()) {
+		buffered_loop();
+	}
+	close_fifo_file();
+}
+
 int get_fifo_file_fd(IN const char* filePath) {
 	while (true) {
 		if (does_file_exist(filePath) && is_fifo_file(filePath)) {
@@ -123,13 +202,29 @@ int get_fifo_file_fd(IN const char* filePath) {
 }
 
 int main(int argc, char** argv) {
-	assert(argc == 2);
+	int option = 0;
+	while (-1 != (option = getopt(argc, argv, "b"))) {
+		switch (option) {
+			case 'b':
+				g_is_bulk = true;
+				break;
+			default:
+				printf("Usage: %s [-b] <fifo>\n", argv[0]);
+				exit(-1);
+		}
+	}
+	assert(argc - optind == 1);
 
-	g_fifo_path = argv[1];
+	g_fifo_path = argv[optind];
 
 	while(true) {
-		g_fifo_fd = get_fifo_file_fd(argv[1]);
-		read_write_loop();
+		g_fifo_fd = get_fifo_file_fd(argv[optind]);
+		if (g_is_bulk) {
+			bulk_loop();
+		}
+		else {
+			read_write_loop();
+		}
 	}
 
 	return 0;
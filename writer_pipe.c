@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -18,6 +20,9 @@
 
 #define FIFO_FILE_PERMISSIONS (S_IRWXU | S_IRWXG | S_IRWXO)
 #define WRITE_AREA_SIZE (0x1000)
+#define BULK_PIPE_SIZE (0x100000)
+#define MIN_PIPE_SIZE (0x10000)
+#define BULK_BUFFER_SIZE (0x100000)
 
 #define ERRNO_ASSERT_WITH_VALUE(assertion, errno_value)  	\
 	if (!(assertion)) {							\
@@ -30,6 +35,8 @@
 char g_write_area[WRITE_AREA_SIZE];
 int g_fifo_fd;
 const char* g_fifo_path;
+// Bulk mode streams stdin to the fifo as it is instead of line by line
+bool g_is_bulk;
 
 bool is_fifo_file(IN const char* filePath) {
 	struct stat statData = {0};
@@ -77,12 +84,12 @@ bool read_from_stdin(OUT ssize_t* dataLength) {
 	return false;
 }
 
-void write_to_file(IN ssize_t dataLength) {
-	ssize_t result = write(g_fifo_fd, g_write_area, dataLength);
+void write_to_file(IN const char* data, IN ssize_t dataLength) {
+	ssize_t result = write(g_fifo_fd, data, dataLength);
 	if (result != dataLength) {
 		if (EPIPE == errno) {
 			printf("Recovering from bad pipe\n");
-			result = write(g_fifo_fd, g_write_area, dataLength);
+			result = write(g_fifo_fd, data, dataLength);
 		}
 	}
 	ERRNO_ASSERT(result == dataLength);
@@ -96,13 +103,77 @@ void read_write_loop() {
 	while (true) {
 		ssize_t dataLength = 0;
 		bool gotEOF = read_from_stdin(&dataLength);
-		write_to_file(dataLength);
+		write_to_file(g_write_area, dataLength);
 		if (gotEOF) {
 			break;
 		}
 	}
 }
 
+// Note - Past /proc/sys/fs/pipe-max-size only root can grow a pipe, so this settles for the biggest size it may have.
+// It's just a hint, fds that aren't pipes stay as they are
+void grow_pipe(IN int fd) {
+	for (int size = BULK_PIPE_SIZE; size >= MIN_PIPE_SIZE; size /= 2) {
+		if (-1 != fcntl(fd, F_SETPIPE_SZ, size)) {
+			return;
+		}
+	}
+}
+
+// Moves stdin to the fifo without copying it through user space, the fifo is a pipe so splice takes anything on the
+// other side that has splice support. Returns false if stdin doesn't, and then nothing was moved
+bool splice_loop() {
+	bool moved_data = false;
+	while (true) {
+		ssize_t result = splice(STDIN_FILENO, NULL, g_fifo_fd, NULL, BULK_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (0 == result) {
+			return true;
+		}
+		if (-1 == result) {
+			if (EINTR == errno) {
+				continue;
+			}
+			// Note - The SIGPIPE handler already waited for a new reader
+			if (EPIPE == errno) {
+				printf("Recovering from bad pipe\n");
+				continue;
+			}
+			if (EINVAL == errno && !moved_data) {
+				return false;
+			}
+			ERRNO_ASSERT(false);
+		}
+		moved_data = true;
+	}
+}
+
+// The fallback of bulk mode, big reads and writes without looking for lines or clearing the buffer
+void buffered_loop() {
+	char* buffer = malloc(BULK_BUFFER_SIZE);
+	ERRNO_ASSERT(NULL != buffer);
+
+	while (true) {
+		ssize_t dataLength = read(STDIN_FILENO, buffer, BULK_BUFFER_SIZE);
+		if (-1 == dataLength && EINTR == errno) {
+			continue;
+		}
+		ERRNO_ASSERT(-1 != dataLength);
+		if (0 == dataLength) {
+			break;
+		}
+		write_to_file(buffer, dataLength);
+	}
+	free(buffer);
+}
+
+void bulk_loop() {
+	grow_pipe(g_fifo_fd);
+	grow_pipe(STDIN_FILENO);
+	if (!splice_loop()) {
+		buffered_loop();
+	}
+}
+
 int get_fifo_file_fd(IN const char* filePath) {
 	bool make_fifo = true;
 	if (does_file_exist(filePath)) {
@@ -159,14 +230,30 @@ void register_signal_handlers() {
 
 int main(int argc, char** argv)
 {
-	assert(argc == 2);
+	int option = 0;
+	while (-1 != (option = getopt(argc, argv, "b"))) {
+		switch (option) {
+			case 'b':
+				g_is_bulk = true;
+				break;
+			default:
+				printf("Usage: %s [-b] <fifo>\n", argv[0]);
+				exit(-1);
+		}
+	}
+	assert(argc - optind == 1);
 
 	register_signal_handlers();
 
-	g_fifo_fd = get_fifo_file_fd(argv[1]);
-	g_fifo_path = argv[1];
+	g_fifo_fd = get_fifo_file_fd(argv[optind]);
+	g_fifo_path = argv[optind];
 
-	read_write_loop();
+	if (g_is_bulk) {
+		bulk_loop();
+	}
+	else {
+		read_write_loop();
+	}
 
 	exit_cleanly();
 }
\ No newline at end of file